@@ -0,0 +1,212 @@
+# /benchmarks/bench_kernels.py
+# Throughput benchmarks of the processing stages on synthetic scans.
+#
+#
+# Copyright (C) 2024 Tine Kalac
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+"""
+Benchmarks the processing stages on a synthetic scan (see synthetic.py)
+and reports frames/s and GB/s for every stage and thread count.
+
+Usage
+-----
+    python benchmarks/bench_kernels.py --frames 2000 --threads 1,4,0 \
+        --output baseline.json
+    python benchmarks/bench_kernels.py --frames 2000 --threads 1,4,0 \
+        --compare baseline.json
+
+With --compare, every stage and thread count that is slower than the
+baseline by more than --tolerance is reported as a regression, and the
+script exits with status 1. GB/s is the size of the input of a stage (the
+int16 frames, or the profiles for the fits) divided by the wall time.
+"""
+
+import argparse
+import datetime
+import json
+import os
+import platform
+import sys
+import time
+
+import numpy as np
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+from synthetic import synthetic_scan
+from biosed import preprocess, integration, orientation
+from biosed._cpp.center_of_mass import simd_backend
+
+
+def _stages(frames, beam_centers, profiles, phi_vals):
+    """
+    Benchmarked stages as name: (function(n_threads), input bytes).
+    """
+    return {
+        "beam_centers": (lambda n_threads: preprocess.find_beam_centers(
+            frames, n_threads = n_threads, window_radius = 0, detector_mask = None),
+            frames.nbytes),
+        "beam_tracking": (lambda n_threads: preprocess.find_beam_centers(
+            frames, n_threads = n_threads, window_radius = 16, detector_mask = None),
+            frames.nbytes),
+        "integration": (lambda n_threads: integration.centered_crown_integration(
+            frames, beam_centers, n_threads = n_threads, detector_mask = None),
+            frames.nbytes),
+        "integration_subpixel": (lambda n_threads: integration.centered_crown_integration(
+            frames, beam_centers, n_threads = n_threads, detector_mask = None, subpixel = True),
+            frames.nbytes),
+        "integration_harmonics": (lambda n_threads: integration.centered_crown_integration(
+            frames, beam_centers, n_threads = n_threads, detector_mask = None,
+            harmonic_orders = (0, 2)),
+            frames.nbytes),
+        "cake": (lambda n_threads: integration.cake_integration(
+            frames, beam_centers, n_threads = n_threads, detector_mask = None),
+            frames.nbytes),
+        "principal_components": (lambda n_threads: orientation.find_principal_components(
+            frames, beam_centers = beam_centers, n_threads = n_threads, detector_mask = None),
+            frames.nbytes),
+        "odf_fit": (lambda n_threads: orientation.fit_poisson_odf(
+            profiles, phi_vals, backend = "native", n_threads = n_threads),
+            profiles.nbytes),
+    }
+
+
+def _time(function, repeat):
+    """
+    Best wall time of repeat calls, after one warm-up call.
+    """
+    function()
+    best = np.inf
+    for _ in range(repeat):
+        start = time.perf_counter()
+        function()
+        best = min(best, time.perf_counter() - start)
+    return best
+
+
+def run(frames, beam_centers, thread_counts, repeat, stage_names = None):
+    """
+    Runs the stages for every thread count and returns their results.
+    """
+    profiles, phi_vals = integration.centered_crown_integration(frames, beam_centers,
+                                                                detector_mask = None)
+    stages = _stages(frames, beam_centers, profiles, phi_vals)
+    if stage_names is not None:
+        unknown = set(stage_names) - set(stages)
+        if unknown:
+            raise ValueError(f"Unknown stages: {sorted(unknown)}")
+        stages = {name: stages[name] for name in stage_names}
+
+    results = []
+    for name, (function, n_bytes) in stages.items():
+        for n_threads in thread_counts:
+            seconds = _time(lambda: function(n_threads), repeat)
+            result = {"stage": name,
+                      "threads": n_threads,
+                      "seconds": seconds,
+                      "frames_per_s": len(frames) / seconds,
+                      "gb_per_s": n_bytes / seconds / 1e9}
+            results.append(result)
+            print(f"{name:24s} threads={n_threads:<3d} {result['frames_per_s']:12.1f} frames/s"
+                  f" {result['gb_per_s']:8.3f} GB/s")
+    return results
+
+
+def compare(results, baseline, tolerance):
+    """
+    Prints the speed of every result relative to the baseline and returns
+    the regressions, the results that are slower by more than tolerance.
+    """
+    reference = {(entry["stage"], entry["threads"]): entry for entry in baseline["results"]}
+    regressions = []
+
+    print("\nComparison with the baseline:")
+    for result in results:
+        key = (result["stage"], result["threads"])
+        if key not in reference:
+            print(f"{key[0]:24s} threads={key[1]:<3d} (not in baseline)")
+            continue
+        ratio = result["frames_per_s"] / reference[key]["frames_per_s"]
+        regressed = ratio < 1 - tolerance
+        if regressed:
+            regressions.append(result)
+        print(f"{key[0]:24s} threads={key[1]:<3d} {ratio:6.2f}x"
+              f"{'  REGRESSION' if regressed else ''}")
+    return regressions
+
+
+def main(argv = None):
+    parser = argparse.ArgumentParser(description = __doc__,
+                                     formatter_class = argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--frames", type = int, default = 2000, help = "Frames of the scan")
+    parser.add_argument("--detector", type = int, nargs = 2, default = (512, 512),
+                        metavar = ("QY", "QX"), help = "Detector shape")
+    parser.add_argument("--threads", default = "1,0",
+                        help = "Comma-separated thread counts (0 = all cores)")
+    parser.add_argument("--repeat", type = int, default = 3, help = "Timed runs per measurement")
+    parser.add_argument("--stages", default = None, help = "Comma-separated stages to run")
+    parser.add_argument("--seed", type = int, default = 0, help = "Seed of the synthetic scan")
+    parser.add_argument("--data", default = None,
+                        help = "Stores the synthetic frames in this .npy file and reuses them")
+    parser.add_argument("--output", default = None, help = "Writes the results to this JSON file")
+    parser.add_argument("--compare", default = None, help = "Baseline JSON file to compare with")
+    parser.add_argument("--tolerance", type = float, default = 0.1,
+                        help = "Allowed relative slowdown in the comparison")
+    args = parser.parse_args(argv)
+
+    if args.data is not None and os.path.exists(args.data):
+        frames = np.load(args.data, mmap_mode = "r")
+        frames = np.ascontiguousarray(frames)
+    else:
+        print("Generating synthetic data...")
+        frames, _ = synthetic_scan(n_frames = args.frames, detector_shape = tuple(args.detector),
+                                   seed = args.seed)
+        if args.data is not None:
+            np.save(args.data, frames)
+        print("...done!\n")
+
+    beam_centers = preprocess.find_beam_centers(frames, detector_mask = None)
+    thread_counts = [int(n) for n in args.threads.split(",")]
+    stage_names = args.stages.split(",") if args.stages else None
+
+    results = run(frames, beam_centers, thread_counts, args.repeat, stage_names)
+
+    report = {"meta": {"date": datetime.datetime.now().isoformat(timespec = "seconds"),
+                       "platform": platform.platform(),
+                       "processor": platform.processor(),
+                       "cpu_count": os.cpu_count(),
+                       "python": platform.python_version(),
+                       "numpy": np.__version__,
+                       "simd_backend": simd_backend(int(frames.shape[2])),
+                       "frames": int(frames.shape[0]),
+                       "detector_shape": [int(n) for n in frames.shape[1:]],
+                       "repeat": args.repeat},
+              "results": results}
+
+    if args.output is not None:
+        with open(args.output, "w") as file:
+            json.dump(report, file, indent = 2)
+
+    if args.compare is not None:
+        with open(args.compare) as file:
+            baseline = json.load(file)
+        if compare(results, baseline, args.tolerance):
+            return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
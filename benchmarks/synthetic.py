@@ -0,0 +1,126 @@
+# /benchmarks/synthetic.py
+# Reproducible synthetic SED scans for benchmarking the kernels.
+#
+#
+# Copyright (C) 2024 Tine Kalac
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+import numpy as np
+
+from biosed.orientation import poisson_odf
+
+
+def synthetic_scan(n_frames = 2000,
+                   detector_shape = (512, 512),
+                   row_length = 50,
+                   flyback_frames = 3,
+                   beam_travel = 40.0,
+                   beam_intensity = 3000.0,
+                   beam_sigma = 2.0,
+                   ring_radius = 60.0,
+                   ring_width = 3.0,
+                   ring_intensity = 40.0,
+                   eta = 0.7,
+                   background = 1.0,
+                   seed = 0):
+    """
+    Generates a scan of detector images with a moving direct beam and a
+    fibre-like Bragg ring, with Poisson noise.
+
+    Parameters
+    ----------
+    n_frames : int, optional
+        Number of frames.
+    detector_shape : tuple, optional
+        (QY, QX) of the detector.
+    row_length : int, optional
+        Frames of a scan row. Every row is followed by flyback_frames
+        frames where the beam returns to the start of the row.
+    flyback_frames : int, optional
+        Frames of the flyback between the rows.
+    beam_travel : float, optional
+        Pixels the direct beam moves along QX during a row (descan).
+    beam_intensity, beam_sigma : float, optional
+        Peak counts and width (pixels) of the Gaussian direct beam.
+    ring_radius, ring_width : float, optional
+        Radius and width (pixels) of the Bragg ring around the beam.
+    ring_intensity : float, optional
+        Peak counts of the ring at the preferential orientation.
+    eta : float, optional
+        Degree of alignment of the poisson_odf of the ring.
+    background : float, optional
+        Mean background counts per pixel.
+    seed : int, optional
+        Seed of the random generator. The same parameters and seed give the
+        same frames.
+
+    Returns
+    -------
+    tuple
+        (frames, truth). frames is an int16 (n_frames, QY, QX) array. truth
+        is a dict with the exact "beam_centers" (n_frames, 2), the
+        "orientation" of the ring in radians (n_frames,) and the "row_frames"
+        boolean array of the frames that are not flyback frames.
+
+    Examples
+    --------
+    >>> frames, truth = synthetic_scan(n_frames = 500, detector_shape = (256, 256))
+    >>> beam_centers = biosed.find_beam_centers(frames)
+    """
+
+    rng = np.random.default_rng(seed)
+    n_QY, n_QX = detector_shape
+    period = row_length + flyback_frames
+
+    # Beam position: linear descan within a row, back during the flyback,
+    # and a slow drift along QY from row to row
+    frame_index = np.arange(n_frames)
+    row_index = frame_index // period
+    row_position = frame_index % period
+    row_frames = row_position < row_length
+    progress = np.where(row_frames,
+                        row_position / max(row_length - 1, 1),
+                        1 - (row_position - row_length + 1) / (flyback_frames + 1))
+
+    beam_centers = np.empty((n_frames, 2))
+    beam_centers[:, 0] = 0.5 * n_QY + 0.05 * row_index + rng.normal(0, 0.2, n_frames)
+    beam_centers[:, 1] = 0.5 * n_QX - 0.5 * beam_travel + beam_travel * progress \
+                         + rng.normal(0, 0.2, n_frames)
+
+    # Orientation field varying smoothly over the scan
+    orientation = (0.5 * np.pi * (1 + np.sin(2 * np.pi * row_position / period))
+                   + 0.02 * row_index) % np.pi
+
+    QY, QX = np.mgrid[0:n_QY, 0:n_QX]
+    frames = np.empty((n_frames, n_QY, n_QX), dtype = np.int16)
+    odf_norm = poisson_odf(0.0, 0.0, eta, 1.0)
+
+    for index in range(n_frames):
+        dQY = QY - beam_centers[index, 0]
+        dQX = QX - beam_centers[index, 1]
+        radius = np.hypot(dQY, dQX)
+        phi = np.arctan2(dQY, dQX)
+
+        expected = np.full(detector_shape, background)
+        expected += beam_intensity * np.exp(-0.5 * (radius / beam_sigma)**2)
+        expected += (ring_intensity * poisson_odf(phi, orientation[index], eta, 1.0) / odf_norm
+                     * np.exp(-0.5 * ((radius - ring_radius) / ring_width)**2))
+
+        frames[index] = np.minimum(rng.poisson(expected), np.iinfo(np.int16).max)
+
+    truth = {"beam_centers": beam_centers,
+             "orientation": orientation,
+             "row_frames": row_frames}
+    return frames, truth
@@ -16,13 +16,14 @@
 # You should have received a copy of the GNU General Public License
 # along with this program. If not, see <https://www.gnu.org/licenses/>.
 
-from .io import load_data, save_to_hdf5, load_from_hdf5
-from .preprocess import find_beam_centers, get_scan_shape, center_images
-from .integration import crown_integration
+from .io import load_data, save_to_hdf5, load_from_hdf5, open_raw, open_hdf5_stack
+from .preprocess import find_beam_centers, find_scan_limits, get_scan_shape, center_images, bin_images, unbin_beam_centers
+from .integration import crown_integration, centered_crown_integration, cake_integration, get_integration_plan, CrownIntegrationPlan
 from .masking import mask_data
-from .orientation import poisson_odf, fit_poisson_odf, find_orientation_peaks, harmonic_analysis, find_principal_components
+from .orientation import poisson_odf, fit_poisson_odf, find_orientation_peaks, harmonic_analysis, harmonic_orientation, find_principal_components
 from .visualize import detector_plot, plot_orientation
-from .analyze import AnalysisPipeline
+from .analyze import AnalysisPipeline, LiveAnalysisPipeline
+from .instrumentation import PipelineReport, kernel_counters
 
 from .config import config
 from .utilities import FormatDataShape
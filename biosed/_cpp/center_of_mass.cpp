@@ -20,18 +20,217 @@
 #include <vector>
 #include <tuple>
 #include <cstdint>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <optional>
 #include <pybind11/pybind11.h>
 #include <pybind11/numpy.h>
 #include <pybind11/stl.h>
 
+#include "parallel.h"
+#include "kernel_stats.h"
+
+// The AVX2 kernel is compiled for x86-64 with GCC and Clang, and selected at
+// runtime when the CPU supports it. Other platforms use the portable kernel.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define BIOSED_HAVE_AVX2 1
+#include <immintrin.h>
+#else
+#define BIOSED_HAVE_AVX2 0
+#endif
+
 namespace py = pybind11;
 
+///// ROW KERNELS /////
+
+// The row kernels compute the thresholded sums of a single detector row,
+// sum(pixel) and sum(pixel * indexQX), with exact integer arithmetic.
+// Pixels below the threshold contribute 0. Integer sums are exact, so all
+// kernels give results identical to a double precision accumulation.
+typedef void (*RowMomentsKernel)(const int16_t* row, py::ssize_t nQX,
+                                 int16_t threshold,
+                                 int64_t& rowSum, int64_t& rowSumQX);
+
+// Portable branchless kernel, which compilers can auto-vectorize.
+static void row_moments_scalar(const int16_t* row, py::ssize_t nQX,
+                               int16_t threshold,
+                               int64_t& rowSum, int64_t& rowSumQX) {
+    int64_t sum = 0, sumQX = 0;
+    for (py::ssize_t indexQX = 0; indexQX < nQX; ++indexQX) {
+        int64_t pixel = (row[indexQX] < threshold) ? 0 : row[indexQX];
+        sum += pixel;
+        sumQX += pixel * indexQX;
+    }
+    rowSum = sum;
+    rowSumQX = sumQX;
+}
+
+#if BIOSED_HAVE_AVX2
+// Horizontal sum of the four int64 lanes.
+__attribute__((target("avx2")))
+static inline int64_t hsum_epi64(__m256i v) {
+    __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(v),
+                                _mm256_extracti128_si256(v, 1));
+    return _mm_cvtsi128_si64(sum) + _mm_extract_epi64(sum, 1);
+}
+
+// Processes 16 pixels per iteration. Masked pixels are zeroed with a
+// compare and andnot, and _mm256_madd_epi16 forms the pairwise products
+// with the column indices. The int32 products are widened to int64 right
+// away, so the row width is only limited by the int16 column index.
+__attribute__((target("avx2")))
+static void row_moments_avx2(const int16_t* row, py::ssize_t nQX,
+                             int16_t threshold,
+                             int64_t& rowSum, int64_t& rowSumQX) {
+    const __m256i thresholds = _mm256_set1_epi16(threshold);
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i step = _mm256_set1_epi16(16);
+    __m256i columns = _mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7,
+                                        8, 9, 10, 11, 12, 13, 14, 15);
+    __m256i sums = _mm256_setzero_si256();
+    __m256i sumsQX = _mm256_setzero_si256();
+
+    py::ssize_t indexQX = 0;
+    for (; indexQX + 16 <= nQX; indexQX += 16) {
+        __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + indexQX));
+        __m256i below = _mm256_cmpgt_epi16(thresholds, pixels);
+        pixels = _mm256_andnot_si256(below, pixels);
+
+        __m256i pairSums = _mm256_madd_epi16(pixels, ones);
+        __m256i pairSumsQX = _mm256_madd_epi16(pixels, columns);
+
+        sums = _mm256_add_epi64(sums, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(pairSums)));
+        sums = _mm256_add_epi64(sums, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(pairSums, 1)));
+        sumsQX = _mm256_add_epi64(sumsQX, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(pairSumsQX)));
+        sumsQX = _mm256_add_epi64(sumsQX, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(pairSumsQX, 1)));
+
+        columns = _mm256_add_epi16(columns, step);
+    }
+
+    int64_t sum = hsum_epi64(sums), sumQX = hsum_epi64(sumsQX);
+
+    // Remaining pixels of the row
+    for (; indexQX < nQX; ++indexQX) {
+        int64_t pixel = (row[indexQX] < threshold) ? 0 : row[indexQX];
+        sum += pixel;
+        sumQX += pixel * indexQX;
+    }
+    rowSum = sum;
+    rowSumQX = sumQX;
+}
+#endif
+
+// Picks the fastest row kernel supported by the CPU and the row width.
+static RowMomentsKernel select_row_kernel(py::ssize_t nQX) {
+#if BIOSED_HAVE_AVX2
+    // The column indices are held in int16 lanes
+    if (nQX <= INT16_MAX && __builtin_cpu_supports("avx2")) {
+        return row_moments_avx2;
+    }
+#endif
+    (void)nQX;
+    return row_moments_scalar;
+}
+
+// Name of the row kernel that is used for rows of nQX pixels.
+std::string simd_backend(py::ssize_t nQX) {
+#if BIOSED_HAVE_AVX2
+    if (select_row_kernel(nQX) == row_moments_avx2) return "avx2";
+#endif
+    (void)nQX;
+    return "scalar";
+}
+
 ///// FOR MASKED ARRAYS /////
 
-// Function to calculate centers of mass for each image in the stack with a threshold
-py::array_t<double>
+// 2D detector mask (true = masked pixel), shared by all images of a stack
+typedef std::optional<py::array_t<bool, py::array::c_style | py::array::forcecast>> DetectorMask;
+
+// The unmasked pixels of a detector as runs of consecutive columns
+// [begin, end) per row, so the row kernels can still process contiguous
+// pixels. The runs of row i are runs[rowStarts[i]:rowStarts[i+1]].
+struct MaskRuns {
+    std::vector<py::ssize_t> rowStarts;
+    std::vector<std::pair<py::ssize_t, py::ssize_t>> runs;
+
+    MaskRuns(const bool* mask, py::ssize_t nQY, py::ssize_t nQX) : rowStarts(nQY + 1, 0) {
+        for (py::ssize_t indexQY = 0; indexQY < nQY; ++indexQY) {
+            const bool* maskRow = mask + indexQY * nQX;
+            py::ssize_t indexQX = 0;
+            while (indexQX < nQX) {
+                while (indexQX < nQX && maskRow[indexQX]) indexQX++;
+                py::ssize_t runBegin = indexQX;
+                while (indexQX < nQX && !maskRow[indexQX]) indexQX++;
+                if (indexQX > runBegin) runs.emplace_back(runBegin, indexQX);
+            }
+            rowStarts[indexQY + 1] = static_cast<py::ssize_t>(runs.size());
+        }
+    }
+};
+
+// Number of consecutive frames tracked from one full detector scan in the
+// windowed mode. Blocks are independent, which makes them the unit of
+// parallel work, and their fixed length keeps the results independent of
+// the number of threads.
+static const py::ssize_t kTrackingBlockSize = 256;
+
+// Computes the thresholded center of mass of the window [QY0, QY1) x
+// [QX0, QX1) of an image with nQX columns. Only the unmasked runs are
+// used if maskRuns is given. Returns false if no pixel of the window is
+// above the threshold.
+static bool window_center_of_mass(const int16_t* image, py::ssize_t nQX,
+                                  py::ssize_t QY0, py::ssize_t QY1,
+                                  py::ssize_t QX0, py::ssize_t QX1,
+                                  int16_t threshold, RowMomentsKernel rowMoments,
+                                  const MaskRuns* maskRuns,
+                                  double& centerQY, double& centerQX) {
+    // Initialize the temporary sums. They are exact integers, the largest
+    // possible value (512x512 detector) is far below 2^63.
+    int64_t sumQY = 0, sumQX = 0, totalSum = 0;
+
+    // Computes the center of mass row by row
+    for (py::ssize_t indexQY = QY0; indexQY < QY1; ++indexQY) {
+        const int16_t* row = image + indexQY * nQX;
+        int64_t rowSum, rowSumQX;
+
+        if (!maskRuns) {
+            rowMoments(row + QX0, QX1 - QX0, threshold, rowSum, rowSumQX);
+            sumQY += rowSum * indexQY;
+            sumQX += rowSumQX + rowSum * QX0;
+            totalSum += rowSum;
+            continue;
+        }
+
+        for (py::ssize_t iRun = maskRuns->rowStarts[indexQY];
+             iRun < maskRuns->rowStarts[indexQY + 1]; ++iRun) {
+            py::ssize_t runQX0 = std::max(maskRuns->runs[iRun].first, QX0);
+            py::ssize_t runQX1 = std::min(maskRuns->runs[iRun].second, QX1);
+            if (runQX0 >= runQX1) continue;
+
+            rowMoments(row + runQX0, runQX1 - runQX0, threshold, rowSum, rowSumQX);
+            sumQY += rowSum * indexQY;
+            sumQX += rowSumQX + rowSum * runQX0;
+            totalSum += rowSum;
+        }
+    }
+
+    if (totalSum == 0) return false;
+
+    centerQY = static_cast<double>(sumQY) / static_cast<double>(totalSum);
+    centerQX = static_cast<double>(sumQX) / static_cast<double>(totalSum);
+    return true;
+}
+
+// Function to calculate centers of mass for each image in the stack with a threshold.
+// The sums are exact integers whatever the output dtype (float64 or float32).
+py::array
     compute_centers_of_mass(py::array_t<int16_t> image_stack,
-                            int16_t threshold) {
+                            int16_t threshold,
+                            int n_threads = 1,
+                            int window_radius = 0,
+                            DetectorMask mask = std::nullopt,
+                            const std::string& dtype = "float64") {
     
     // Get the buffers for the arrays                        
     auto bufData = image_stack.request();
@@ -44,63 +243,265 @@ py::array_t<double>
         throw std::runtime_error("Input arrays must be C-contiguous.");
     }
 
+    if (window_radius < 0) {
+        throw std::runtime_error("The window radius should not be negative.");
+    }
+
+    if (dtype != "float64" && dtype != "float32") {
+        throw std::runtime_error("Unsupported output dtype " + dtype + ", use float32 or float64.");
+    }
+
     py::ssize_t nImages = bufData.shape[0];
     py::ssize_t nQY = bufData.shape[1];
     py::ssize_t nQX = bufData.shape[2];
     
     auto centersOfMass = py::array_t<double>(std::vector<py::ssize_t>{nImages, 2});
     auto centersOfMass_mutable = centersOfMass.mutable_unchecked<2>();
-    
 
-    // The memory should be overwritten to avoid weird things happening
-    for (py::ssize_t imageIndex = 0; imageIndex < nImages; imageIndex++) {
-        
-        // Overwrites the results array with 0 to avoid weird things.
-        for (py::ssize_t comIndex = 0; comIndex < 2; ++comIndex) {
-            centersOfMass_mutable(imageIndex, comIndex) = 0.0;
+    const int16_t* imageData = static_cast<const int16_t*>(bufData.ptr);
+    const RowMomentsKernel rowMoments = select_row_kernel(nQX);
+
+    // Masked pixels are skipped as if they were below the threshold
+    std::optional<MaskRuns> maskRuns;
+    if (mask) {
+        if (mask->ndim() != 2 || mask->shape(0) != nQY || mask->shape(1) != nQX) {
+            throw std::runtime_error("The mask should have the shape of a single image.");
         }
-            
-        // Initialize the temporary sums
-        double sumQY = 0.0, sumQX = 0.0, totalSum = 0.0;
+        maskRuns.emplace(mask->data(), nQY, nQX);
+    }
+    const MaskRuns* runs = maskRuns ? &*maskRuns : nullptr;
 
-        // Computes the center of mass
-        for (py::ssize_t indexQY = 0; indexQY < nQY; ++indexQY) {
-            for (py::ssize_t indexQX = 0; indexQX < nQX; ++indexQX) {
-                
-                auto pixel = static_cast<int16_t*>(bufData.ptr)
-                                                    [imageIndex  * nQY * nQX
-                                                             + indexQY * nQX
-                                                                   + indexQX];
-                                                                   
-
-                // Skip certain pixels
-                if (pixel < threshold) continue;
-                
-                // 
-                sumQY += pixel * indexQY;
-                sumQX += pixel * indexQX;
-                totalSum += pixel;       
-                
+    // Full detector scan of a single image
+    auto computeFull = [&](py::ssize_t imageIndex) {
+        double centerQY, centerQX;
+        const int16_t* image = imageData + imageIndex * nQY * nQX;
+        bool found = window_center_of_mass(image, nQX, 0, nQY, 0, nQX, threshold,
+                                           rowMoments, runs, centerQY, centerQX);
+        // If no pixels in the image are above the threshold it returns -1
+        centersOfMass_mutable(imageIndex, 0) = found ? centerQY : -1.0;
+        centersOfMass_mutable(imageIndex, 1) = found ? centerQX : -1.0;
+        return found;
+    };
+
+    // Every image is processed by exactly one thread, so the results do
+    // not depend on the thread count.
+    auto computeImages = [&](int, std::ptrdiff_t imageBegin, std::ptrdiff_t imageEnd) {
+        for (py::ssize_t imageIndex = imageBegin; imageIndex < imageEnd; imageIndex++) {
+            computeFull(imageIndex);
+        }
+    };
+
+    // Windowed mode. The beam is located with a full scan at the start of
+    // every block, after which each frame is only scanned in a window
+    // around the center of the previous frame. The full scan is repeated
+    // when the window holds no pixel above the threshold, or when the new
+    // center lies closer to the window edge than half the radius, i.e.
+    // part of the beam may be outside of the window.
+    // The number of full scans and of the pixels of the windows are counted
+    // per block for the kernel counters.
+    std::atomic<int64_t> fullScans{0}, windowPixels{0};
+    auto trackBlocks = [&](int, std::ptrdiff_t blockBegin, std::ptrdiff_t blockEnd) {
+        int64_t blockFullScans = 0, blockWindowPixels = 0;
+        auto scanFull = [&](py::ssize_t imageIndex) {
+            blockFullScans++;
+            return computeFull(imageIndex);
+        };
+
+        for (py::ssize_t iBlock = blockBegin; iBlock < blockEnd; ++iBlock) {
+            py::ssize_t imageBegin = iBlock * kTrackingBlockSize;
+            py::ssize_t imageEnd = std::min(imageBegin + kTrackingBlockSize, nImages);
+
+            bool tracking = scanFull(imageBegin);
+            for (py::ssize_t imageIndex = imageBegin + 1; imageIndex < imageEnd; ++imageIndex) {
+                if (!tracking) {
+                    tracking = scanFull(imageIndex);
+                    continue;
+                }
+
+                py::ssize_t previousQY = static_cast<py::ssize_t>(centersOfMass_mutable(imageIndex - 1, 0) + 0.5);
+                py::ssize_t previousQX = static_cast<py::ssize_t>(centersOfMass_mutable(imageIndex - 1, 1) + 0.5);
+                py::ssize_t QY0 = std::max<py::ssize_t>(0, previousQY - window_radius);
+                py::ssize_t QY1 = std::min<py::ssize_t>(nQY, previousQY + window_radius + 1);
+                py::ssize_t QX0 = std::max<py::ssize_t>(0, previousQX - window_radius);
+                py::ssize_t QX1 = std::min<py::ssize_t>(nQX, previousQX + window_radius + 1);
+
+                double centerQY = 0.0, centerQX = 0.0;
+                const int16_t* image = imageData + imageIndex * nQY * nQX;
+                bool found = window_center_of_mass(image, nQX, QY0, QY1, QX0, QX1, threshold,
+                                                   rowMoments, runs, centerQY, centerQX);
+                blockWindowPixels += (QY1 - QY0) * (QX1 - QX0);
+                if (!found) {
+                    tracking = scanFull(imageIndex);
+                    continue;
+                }
+
+                // Window edges that coincide with the detector edge are fine
+                double margin = 0.5 * window_radius;
+                bool nearEdge = (QY0 > 0 && centerQY - QY0 < margin)
+                             || (QY1 < nQY && QY1 - 1 - centerQY < margin)
+                             || (QX0 > 0 && centerQX - QX0 < margin)
+                             || (QX1 < nQX && QX1 - 1 - centerQX < margin);
+
+                if (nearEdge) {
+                    tracking = scanFull(imageIndex);
+                    continue;
+                }
+
+                centersOfMass_mutable(imageIndex, 0) = centerQY;
+                centersOfMass_mutable(imageIndex, 1) = centerQX;
             }
         }
-        
-        // If no pixels in the image are above the threshold it returns this
-        if (totalSum == 0.0) {
-            centersOfMass_mutable(imageIndex, 0) = -1.0;
-            centersOfMass_mutable(imageIndex, 1) = -1.0;
-            continue;
+
+        fullScans += blockFullScans;
+        windowPixels += blockWindowPixels;
+    };
+
+    // The kernel does not call into Python, so other threads can run
+    biosed::ParallelStats stats;
+    {
+        py::gil_scoped_release release;
+        if (window_radius == 0) {
+            biosed::parallel_for(nImages, n_threads, computeImages, 0, &stats);
+        } else {
+            py::ssize_t nBlocks = (nImages + kTrackingBlockSize - 1) / kTrackingBlockSize;
+            biosed::parallel_for(nBlocks, n_threads, trackBlocks, 1, &stats);
         }
-        
-        // write the results into the results array
-        centersOfMass_mutable(imageIndex, 0) = sumQY / totalSum;
-        centersOfMass_mutable(imageIndex, 1) = sumQX / totalSum;
     }
-    
+
+    // Pixels outside of the windows count as skipped
+    int64_t imagePixels = static_cast<int64_t>(nImages) * nQY * nQX;
+    if (window_radius == 0) {
+        biosed::record_kernel("centers_of_mass", stats, nImages, imagePixels, 0, nImages);
+    } else {
+        int64_t scannedPixels = fullScans * nQY * nQX + windowPixels;
+        biosed::record_kernel("centers_of_mass_tracking", stats, nImages, imagePixels,
+                              imagePixels - scannedPixels, fullScans);
+    }
+
+    // The centers are rounded once, after tracking used the exact values
+    if (dtype == "float32") {
+        auto centersOfMassFloat = py::array_t<float>(std::vector<py::ssize_t>{nImages, 2});
+        std::copy(centersOfMass.data(), centersOfMass.data() + 2 * nImages,
+                  centersOfMassFloat.mutable_data());
+        return centersOfMassFloat;
+    }
     return centersOfMass;
 }
 
+///// DETECTOR BINNING /////
+
+// Averages binning x binning blocks of every frame_step-th image of a stack,
+// for fast previews of a scan. A binned pixel is the rounded mean of the
+// unmasked, non-negative pixels of its block, or -1 if there are none, so
+// the binned stack can be passed to the other kernels like a masked stack.
+// Rows and columns after the last whole block are dropped.
+py::array_t<int16_t> bin_images(py::array_t<int16_t> image_stack,
+                                int binning,
+                                int frame_step = 1,
+                                int n_threads = 1,
+                                DetectorMask mask = std::nullopt) {
+    auto bufData = image_stack.request();
+
+    if (bufData.ndim != 3) {
+        throw std::runtime_error("Data must be a 3D NumPy array: (num_images, height, width).");
+    }
+    if (!(image_stack.flags() & py::array::c_style)) {
+        throw std::runtime_error("Input arrays must be C-contiguous.");
+    }
+    if (binning < 1 || frame_step < 1) {
+        throw std::runtime_error("The binning and the frame step should be positive.");
+    }
+
+    py::ssize_t nImages = bufData.shape[0];
+    py::ssize_t nQY = bufData.shape[1];
+    py::ssize_t nQX = bufData.shape[2];
+    py::ssize_t nFrames = (nImages + frame_step - 1) / frame_step;
+    py::ssize_t nBinnedQY = nQY / binning;
+    py::ssize_t nBinnedQX = nQX / binning;
+
+    const bool* maskData = nullptr;
+    if (mask) {
+        if (mask->ndim() != 2 || mask->shape(0) != nQY || mask->shape(1) != nQX) {
+            throw std::runtime_error("The mask should have the shape of a single image.");
+        }
+        maskData = mask->data();
+    }
+
+    auto binnedArray = py::array_t<int16_t>(std::vector<py::ssize_t>{nFrames, nBinnedQY, nBinnedQX});
+    int16_t* binned = binnedArray.mutable_data();
+    const int16_t* imageData = static_cast<const int16_t*>(bufData.ptr);
+
+    // The block sums of a binned row are accumulated over the detector rows
+    // of the block, so the image is read row by row
+    std::atomic<int64_t> skippedPixels{0};
+    auto binFrames = [&](int, std::ptrdiff_t frameBegin, std::ptrdiff_t frameEnd) {
+        std::vector<int64_t> blockSums(nBinnedQX);
+        std::vector<int32_t> blockCounts(nBinnedQX);
+        int64_t frameSkipped = 0;
+
+        for (py::ssize_t iFrame = frameBegin; iFrame < frameEnd; ++iFrame) {
+            const int16_t* image = imageData + iFrame * frame_step * nQY * nQX;
+            int16_t* binnedImage = binned + iFrame * nBinnedQY * nBinnedQX;
+
+            for (py::ssize_t binnedQY = 0; binnedQY < nBinnedQY; ++binnedQY) {
+                std::fill(blockSums.begin(), blockSums.end(), 0);
+                std::fill(blockCounts.begin(), blockCounts.end(), 0);
+
+                for (py::ssize_t indexQY = binnedQY * binning;
+                     indexQY < (binnedQY + 1) * binning; ++indexQY) {
+                    const int16_t* row = image + indexQY * nQX;
+                    const bool* maskRow = maskData ? maskData + indexQY * nQX : nullptr;
+                    for (py::ssize_t indexQX = 0; indexQX < nBinnedQX * binning; ++indexQX) {
+                        bool valid = row[indexQX] >= 0 && !(maskRow && maskRow[indexQX]);
+                        blockSums[indexQX / binning] += valid ? row[indexQX] : 0;
+                        blockCounts[indexQX / binning] += valid;
+                    }
+                }
+
+                for (py::ssize_t binnedQX = 0; binnedQX < nBinnedQX; ++binnedQX) {
+                    int32_t count = blockCounts[binnedQX];
+                    frameSkipped += binning * binning - count;
+                    binnedImage[binnedQY * nBinnedQX + binnedQX] = (count == 0)
+                        ? static_cast<int16_t>(-1)
+                        : static_cast<int16_t>((blockSums[binnedQX] + count / 2) / count);
+                }
+            }
+        }
+        skippedPixels += frameSkipped;
+    };
+
+    biosed::ParallelStats stats;
+    {
+        py::gil_scoped_release release;
+        biosed::parallel_for(nFrames, n_threads, binFrames, 0, &stats);
+    }
+    biosed::record_kernel("bin_images", stats, nFrames,
+                          static_cast<int64_t>(nFrames) * nBinnedQY * nBinnedQX * binning * binning,
+                          skippedPixels);
+
+    return binnedArray;
+}
+
 PYBIND11_MODULE(center_of_mass, m) {
     m.def("compute_centers_of_mass", &compute_centers_of_mass,
-          "Compute centers of mass for a masked stack of images with a threshold.",
-          py::arg("image_stack"), py::arg("threshold"));
+          "Compute centers of mass for a masked stack of images with a threshold. "
+          "Images are distributed over n_threads threads (0 uses all cores). "
+          "With a window_radius above 0, the beam is tracked in a square window "
+          "around the previous frame's center instead of scanning the full detector. "
+          "Pixels that are true in the 2D mask are skipped. dtype is the output "
+          "type, float64 or float32.",
+          py::arg("image_stack"), py::arg("threshold"), py::arg("n_threads") = 1,
+          py::arg("window_radius") = 0, py::arg("mask") = py::none(),
+          py::arg("dtype") = "float64");
+    m.def("bin_images", &bin_images,
+          "Averages binning x binning blocks of every frame_step-th image of a stack. "
+          "Binned pixels without unmasked, non-negative pixels are -1. Pixels that are "
+          "true in the 2D mask are skipped.",
+          py::arg("image_stack"), py::arg("binning"), py::arg("frame_step") = 1,
+          py::arg("n_threads") = 1, py::arg("mask") = py::none());
+    m.def("simd_backend", &simd_backend,
+          "Name of the vectorized kernel used for images of the given width.",
+          py::arg("width") = 512);
+    m.def("kernel_counters", &biosed::kernel_counters_dict,
+          "Cumulative counters of the kernels of the module, by kernel name.");
 }
@@ -20,115 +20,1322 @@
 // Python binding libraries
 #include <pybind11/pybind11.h>
 #include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+#include <pybind11/complex.h>
+
+#include "parallel.h"
+#include "harmonics.h"
+#include "kernel_stats.h"
 
 // Math stuff
 #define M_PI 3.14159265358979323846
 #include <cmath>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <complex>
+#include <cstdint>
+#include <limits>
+#include <optional>
 #include <vector>
 #include <tuple>
+#include <utility>
+#include <string>
+#include <type_traits>
 
 // Namespace required by Pybind11
 namespace py = pybind11;
 
-/// Function for computing the crown integral.
-py::array_t<double> compute_crown_integral(
-    // SED data as a stack of 2D arrays (int16)
-    py::array_t<int16_t> sedDataArray, 
-    int nPhiBins,                        // Number of phi bins
-    std::tuple<double, double> QRange,   // q range of integration (incl.)
-    double qCallibration                 // q/pixel value
-){
-    // Retrieve the array data and information through the buffer
-    py::buffer_info bufSedData = sedDataArray.request();
+/// Detector geometry of a crown integration.
+///
+/// The q and phi values of every pixel only depend on the detector shape,
+/// the q range, the number of phi bins and the calibration. The plan
+/// computes the phi bin of every pixel once, so that many stacks with the
+/// same geometry can be integrated without repeating the setup. The pixels
+/// inside the q range are stored as a list sorted by bin, so integration
+/// never visits the pixels outside of the crown.
+///
+/// A plan can also hold several rings, each with its own q range and
+/// number of phi bins. The bins of all rings share one pixel list, so all
+/// rings of an image are integrated in a single pass over its pixels, and
+/// the profiles have the shape (nRings, nPhiBins) with nPhiBins the
+/// largest number of bins of a ring. The unused bins are NaN.
+class CrownIntegrationPlan {
+public:
+    /// Optional indices of the images of a stack to process
+    using FrameIndices = std::optional<py::array_t<int64_t>>;
+    /// Optional 2D mask (true = masked pixel), shared by all images of a stack
+    using DetectorMask = std::optional<py::array_t<bool, py::array::c_style | py::array::forcecast>>;
+    /// Optional background or gain, an image or one value per image of a stack
+    using Correction = std::optional<py::array_t<float, py::array::c_style | py::array::forcecast>>;
 
-    // Data checks
-    if (bufSedData.ndim != 3) {
-        throw std::runtime_error("Input should be a 3D NumPy array. The shape "
-            "should be (nImages, nQY, nQX)");
+    CrownIntegrationPlan(
+        std::tuple<py::ssize_t, py::ssize_t> shape, // (nQY, nQX) of the images
+        int nPhiBins,                        // Number of phi bins
+        std::tuple<double, double> QRange,   // q range of integration (incl.)
+        double qCallibration,                // q/pixel value
+        DetectorMask mask = std::nullopt     // Pixels left out of the plan
+    ) : nQY(std::get<0>(shape)), nQX(std::get<1>(shape)), nPhiBins(nPhiBins),
+        QRange(QRange), qCallibration(qCallibration), multiRing(false),
+        ringPhiBins{nPhiBins}, ringQRanges{QRange} {
+        build(mask);
+    }
+
+    /// Plan of several rings, integrated in one pass. Overlapping q ranges
+    /// are allowed, a pixel then contributes to a bin of every ring.
+    CrownIntegrationPlan(
+        std::tuple<py::ssize_t, py::ssize_t> shape, // (nQY, nQX) of the images
+        std::vector<int> ringPhiBins,        // Number of phi bins of every ring
+        std::vector<std::tuple<double, double>> ringQRanges, // q range of every ring (incl.)
+        double qCallibration,                // q/pixel value
+        DetectorMask mask = std::nullopt     // Pixels left out of the plan
+    ) : nQY(std::get<0>(shape)), nQX(std::get<1>(shape)), nPhiBins(0),
+        qCallibration(qCallibration), multiRing(true),
+        ringPhiBins(ringPhiBins), ringQRanges(ringQRanges) {
+
+        if (ringQRanges.empty() || ringPhiBins.size() != ringQRanges.size()) {
+            throw std::runtime_error("Every ring needs a q range and a number of phi bins.");
+        }
+
+        // The envelope of all rings
+        nPhiBins = *std::max_element(ringPhiBins.begin(), ringPhiBins.end());
+        QRange = ringQRanges[0];
+        for (const auto& ringQRange : ringQRanges) {
+            QRange = {std::min(std::get<0>(QRange), std::get<0>(ringQRange)),
+                      std::max(std::get<1>(QRange), std::get<1>(ringQRange))};
+        }
+        build(mask);
+    }
+
+    /// Integrates a stack of centered images with the plan's geometry. The
+    /// profiles are float64 or float32 (dtype), the sums are always exact.
+    /// The background is subtracted from every pixel and the difference is
+    /// multiplied by the gain while the bins are summed, see
+    /// PixelCorrection. With hotPixelSigma > 0, hot pixels are rejected in
+    /// every bin, see sum_corrected_bins.
+    py::array integrate(
+        // SED data as a stack of 2D arrays (int16)
+        py::array_t<int16_t> sedDataArray,
+        int nThreads = 1,                    // Number of threads (0 = all cores)
+        const std::string& dtype = "float64", // Output type of the profiles
+        Correction background = std::nullopt, // (nQY, nQX) image or one value per image
+        Correction gain = std::nullopt,      // (nQY, nQX) flat-field gain
+        double hotPixelSigma = 0.0           // Rejection threshold (0 = off)
+    ) const {
+        auto corrections = pixel_correction(background, gain, hotPixelSigma,
+                                            sedDataArray.shape(0), nQY, nQX);
+        return with_output_type(dtype, [&](auto outputType) -> py::array {
+            return integrate_stack<decltype(outputType)>(sedDataArray, nThreads, nullptr, nullptr,
+                                                         corrections);
+        });
+    }
+
+    /// Integrates a stack of centered images and computes the given circular
+    /// harmonics of every profile while it is still in cache. Returns the
+    /// profiles and the (nImages, nOrders) complex coefficients.
+    py::tuple integrate_harmonics(
+        py::array_t<int16_t> sedDataArray,
+        std::vector<int> orders,             // Harmonic orders (np.fft.fft convention)
+        int nThreads = 1,                    // Number of threads (0 = all cores)
+        const std::string& dtype = "float64", // Output type of the profiles
+        Correction background = std::nullopt,
+        Correction gain = std::nullopt,
+        double hotPixelSigma = 0.0
+    ) const {
+        check_single_ring("integrate_harmonics");
+        biosed::HarmonicTable harmonics(nPhiBins, orders);
+        auto corrections = pixel_correction(background, gain, hotPixelSigma,
+                                            sedDataArray.shape(0), nQY, nQX);
+        py::array_t<std::complex<double>> coefficientsArray;
+        py::array aziIntensityProfilesArray = with_output_type(dtype, [&](auto outputType) -> py::array {
+            return integrate_stack<decltype(outputType)>(
+                sedDataArray, nThreads, &harmonics, &coefficientsArray, corrections);
+        });
+        return py::make_tuple(aziIntensityProfilesArray, coefficientsArray);
+    }
+
+    /// Integrates a stack of uncentered detector images. The crown of every
+    /// image is placed around its own beam center, exactly as if the images
+    /// had been trimmed with preprocess.center_images first, but without
+    /// making the centered copy. Pixels outside of the detector are skipped.
+    /// If frameIndices is given, only those images are integrated, in the
+    /// given order, and the output has one profile per index. Pixels that
+    /// are true in the (nDetY, nDetX) detectorMask are skipped as well.
+    /// With subpixel, the crown is placed at the fractional beam center
+    /// instead of the truncated one, see for_each_subpixel_image. The
+    /// corrections are those of integrate, with a background and gain in
+    /// the shape of the detector.
+    py::array integrate_centered(
+        // SED data as a stack of 2D arrays (int16)
+        py::array_t<int16_t> sedDataArray,
+        // Beam center (QY, QX) of every image
+        py::array_t<double> beamCentersArray,
+        int nThreads = 1,                    // Number of threads (0 = all cores)
+        FrameIndices frameIndicesArray = std::nullopt,
+        DetectorMask detectorMask = std::nullopt,
+        bool subpixel = false,               // Interpolate at the exact beam center
+        const std::string& dtype = "float64", // Output type of the profiles
+        Correction background = std::nullopt, // (nDetY, nDetX) image or one value per image
+        Correction gain = std::nullopt,      // (nDetY, nDetX) flat-field gain
+        double hotPixelSigma = 0.0           // Rejection threshold (0 = off)
+    ) const {
+        auto corrections = pixel_correction(background, gain, hotPixelSigma, sedDataArray.shape(0),
+                                            sedDataArray.shape(1), sedDataArray.shape(2));
+        return with_output_type(dtype, [&](auto outputType) -> py::array {
+            return integrate_centered_stack<decltype(outputType)>(
+                sedDataArray, beamCentersArray, frameIndicesArray, detectorMask, subpixel,
+                nThreads, nullptr, nullptr, corrections);
+        });
+    }
+
+    /// integrate_centered with the circular harmonics of every profile,
+    /// see integrate_harmonics.
+    py::tuple integrate_centered_harmonics(
+        py::array_t<int16_t> sedDataArray,
+        py::array_t<double> beamCentersArray,
+        std::vector<int> orders,             // Harmonic orders (np.fft.fft convention)
+        int nThreads = 1,                    // Number of threads (0 = all cores)
+        FrameIndices frameIndicesArray = std::nullopt,
+        DetectorMask detectorMask = std::nullopt,
+        bool subpixel = false,               // Interpolate at the exact beam center
+        const std::string& dtype = "float64", // Output type of the profiles
+        Correction background = std::nullopt,
+        Correction gain = std::nullopt,
+        double hotPixelSigma = 0.0
+    ) const {
+        check_single_ring("integrate_centered_harmonics");
+        biosed::HarmonicTable harmonics(nPhiBins, orders);
+        auto corrections = pixel_correction(background, gain, hotPixelSigma, sedDataArray.shape(0),
+                                            sedDataArray.shape(1), sedDataArray.shape(2));
+        py::array_t<std::complex<double>> coefficientsArray;
+        py::array aziIntensityProfilesArray = with_output_type(dtype, [&](auto outputType) -> py::array {
+            return integrate_centered_stack<decltype(outputType)>(
+                sedDataArray, beamCentersArray, frameIndicesArray, detectorMask, subpixel,
+                nThreads, &harmonics, &coefficientsArray, corrections);
+        });
+        return py::make_tuple(aziIntensityProfilesArray, coefficientsArray);
+    }
+
+    /// Caking of a stack of centered images: the sum and the number of the
+    /// unmasked pixels of every bin, in one pass over the pixel list. With
+    /// a plan of many narrow rings, this is the (q, phi) cake of every
+    /// image. Returns float32 sums and int32 counts in the shape of the
+    /// profiles. The unused bins of multi-ring plans are NaN with count 0.
+    py::tuple cake(
+        py::array_t<int16_t> sedDataArray,
+        int nThreads = 1                     // Number of threads (0 = all cores)
+    ) const {
+        py::buffer_info bufSedData = check_stack(sedDataArray);
+        py::ssize_t nImages = bufSedData.shape[0];
+
+        auto sumsArray = py::array_t<float>(profile_shape(nImages));
+        auto countsArray = py::array_t<int32_t>(profile_shape(nImages));
+        float* sums = sumsArray.mutable_data();
+        int32_t* counts = countsArray.mutable_data();
+
+        biosed::ParallelStats stats;
+        std::atomic<int64_t> usedPixels{0};
+        for_each_image(sedDataArray, nThreads, [&](py::ssize_t iImage, auto&& pixelValue) {
+            usedPixels += cake_image(pixelValue, sums + iImage * profile_size(),
+                                     counts + iImage * profile_size());
+        }, &stats);
+        record_kernel("cake", stats, nImages, usedPixels);
+
+        return py::make_tuple(sumsArray, countsArray);
+    }
+
+    /// cake of uncentered images, with the same options as integrate_centered.
+    py::tuple cake_centered(
+        py::array_t<int16_t> sedDataArray,
+        py::array_t<double> beamCentersArray,
+        int nThreads = 1,                    // Number of threads (0 = all cores)
+        FrameIndices frameIndicesArray = std::nullopt,
+        DetectorMask detectorMask = std::nullopt,
+        bool subpixel = false                // Interpolate at the exact beam center
+    ) const {
+        check_centered_stack(sedDataArray, beamCentersArray, detectorMask);
+        FrameSelection frames = select_frames(sedDataArray, frameIndicesArray);
+
+        auto sumsArray = py::array_t<float>(profile_shape(frames.nFrames));
+        auto countsArray = py::array_t<int32_t>(profile_shape(frames.nFrames));
+        float* sums = sumsArray.mutable_data();
+        int32_t* counts = countsArray.mutable_data();
+
+        biosed::ParallelStats stats;
+        std::atomic<int64_t> usedPixels{0};
+        for_each_placed_image(sedDataArray, beamCentersArray, frames, detectorMask, subpixel,
+                              nThreads, [&](py::ssize_t iFrame, auto&& pixelValue) {
+            usedPixels += cake_image(pixelValue, sums + iFrame * profile_size(),
+                                     counts + iFrame * profile_size());
+        }, &stats);
+        record_kernel("cake_centered", stats, frames.nFrames, usedPixels);
+
+        return py::make_tuple(sumsArray, countsArray);
+    }
+
+    /// Intensity-weighted principal component analysis of the pixels inside
+    /// the q range of every centered image. Returns (nImages, 3) with
+    /// [orientation, anisotropy, aspect ratio], see image_principal_components.
+    py::array_t<double> principal_components(
+        py::array_t<int16_t> sedDataArray,
+        int nThreads = 1                     // Number of threads (0 = all cores)
+    ) const {
+        check_single_ring("principal_components");
+        py::buffer_info bufSedData = check_stack(sedDataArray);
+        py::ssize_t nImages = bufSedData.shape[0];
+
+        auto pixelPositions = pixel_positions();
+        auto componentsArray = py::array_t<double>(std::vector<py::ssize_t>{nImages, 3});
+        double* components = componentsArray.mutable_data();
+
+        biosed::ParallelStats stats;
+        std::atomic<int64_t> usedPixels{0};
+        for_each_image(sedDataArray, nThreads, [&](py::ssize_t iImage, auto&& pixelValue) {
+            usedPixels += image_principal_components(pixelValue, pixelPositions,
+                                                     components + 3 * iImage);
+        }, &stats);
+        record_kernel("principal_components", stats, nImages, usedPixels);
+
+        return componentsArray;
+    }
+
+    /// principal_components of uncentered images, with the q range placed
+    /// around the beam center of every image like in integrate_centered.
+    py::array_t<double> principal_components_centered(
+        py::array_t<int16_t> sedDataArray,
+        py::array_t<double> beamCentersArray,
+        int nThreads = 1,                    // Number of threads (0 = all cores)
+        FrameIndices frameIndicesArray = std::nullopt,
+        DetectorMask detectorMask = std::nullopt
+    ) const {
+        check_single_ring("principal_components_centered");
+        check_centered_stack(sedDataArray, beamCentersArray, detectorMask);
+        FrameSelection frames = select_frames(sedDataArray, frameIndicesArray);
+
+        auto pixelPositions = pixel_positions();
+        auto componentsArray = py::array_t<double>(std::vector<py::ssize_t>{frames.nFrames, 3});
+        double* components = componentsArray.mutable_data();
+
+        biosed::ParallelStats stats;
+        std::atomic<int64_t> usedPixels{0};
+        for_each_centered_image(sedDataArray, beamCentersArray, frames, detectorMask, nThreads,
+                                [&](py::ssize_t iFrame, auto&& pixelValue) {
+            usedPixels += image_principal_components(pixelValue, pixelPositions,
+                                                     components + 3 * iFrame);
+        }, &stats);
+        record_kernel("principal_components_centered", stats, frames.nFrames, usedPixels);
+
+        return componentsArray;
+    }
+
+    /// Phi bin of every pixel as a (nQY, nQX) array. -1 marks pixels
+    /// outside of the q range. For several rings, the entry of the bin in a
+    /// flattened (nRings, nPhiBins) profile, with the last ring winning
+    /// where rings overlap.
+    py::array_t<int> bin_indices() const {
+        auto binIndiciesArray = py::array_t<int>(std::vector<py::ssize_t>{nQY, nQX});
+        int* binIndicies = binIndiciesArray.mutable_data();
+        std::fill(binIndicies, binIndicies + nQY * nQX, -1);
+        for (int iBin = 0; iBin < nBins; ++iBin) {
+            for (py::ssize_t iPixel = binStarts[iBin];
+                 iPixel < binStarts[iBin + 1]; ++iPixel) {
+                binIndicies[pixelOffsets[iPixel]] = binSlots[iBin];
+            }
+        }
+        return binIndiciesArray;
+    }
+
+    /// The pixel list as (binStarts, pixelOffsets, binSlots) arrays, for other
+    /// backends such as biosed/gpu.py. The pixels of bin i are
+    /// pixelOffsets[binStarts[i]:binStarts[i + 1]], flat indices in the
+    /// plan shape, and are written to entry binSlots[i] of a profile.
+    py::tuple csr_arrays() const {
+        auto binStartsArray = py::array_t<int64_t>(static_cast<py::ssize_t>(binStarts.size()));
+        auto pixelOffsetsArray = py::array_t<int32_t>(static_cast<py::ssize_t>(pixelOffsets.size()));
+        auto binSlotsArray = py::array_t<int32_t>(static_cast<py::ssize_t>(binSlots.size()));
+        std::copy(binStarts.begin(), binStarts.end(), binStartsArray.mutable_data());
+        std::copy(pixelOffsets.begin(), pixelOffsets.end(), pixelOffsetsArray.mutable_data());
+        std::copy(binSlots.begin(), binSlots.end(), binSlotsArray.mutable_data());
+        return py::make_tuple(binStartsArray, pixelOffsetsArray, binSlotsArray);
+    }
+
+    /// Number of entries of the pixel list, the pixels inside the q range
+    /// of every ring.
+    py::ssize_t n_pixels() const { return binStarts[nBins]; }
+
+    /// Number of values of a profile, nRings * nPhiBins.
+    py::ssize_t profile_size() const {
+        return static_cast<py::ssize_t>(ringPhiBins.size()) * nPhiBins;
+    }
+
+    /// Shape (nImages, nPhiBins) or, for several rings, (nImages, nRings,
+    /// nPhiBins) of the profiles of a stack.
+    std::vector<py::ssize_t> profile_shape(py::ssize_t nImages) const {
+        if (!multiRing) return {nImages, nPhiBins};
+        return {nImages, static_cast<py::ssize_t>(ringPhiBins.size()), nPhiBins};
+    }
+
+    py::ssize_t nQY, nQX;
+    int nPhiBins;                            // Largest number of bins of a ring
+    std::tuple<double, double> QRange;       // Envelope of the rings
+    double qCallibration;
+    bool multiRing;                          // Profiles have a ring axis
+    std::vector<int> ringPhiBins;
+    std::vector<std::tuple<double, double>> ringQRanges;
+
+private:
+    /// Images selected by FrameIndices. Without indices every image is used.
+    struct FrameSelection {
+        const int64_t* indices;
+        py::ssize_t nFrames;
+
+        py::ssize_t operator[](py::ssize_t iFrame) const {
+            return indices ? static_cast<py::ssize_t>(indices[iFrame]) : iFrame;
+        }
+    };
+
+    /// Pixel values as they are read, negative values are masked.
+    struct RawPixel {
+        int16_t operator()(py::ssize_t, py::ssize_t, int16_t pixel) const { return pixel; }
+    };
+
+    /// Background subtraction and flat-field gain of single pixels, applied
+    /// where a pixel is read. The background is an image shared by all
+    /// images of the stack or one value per image. Corrected values can be
+    /// negative, so masked pixels are NaN instead.
+    struct PixelCorrection {
+        const float* backgroundImage;        // Offsets of the image, or nullptr
+        const float* imageBackgrounds;       // One value per image, or nullptr
+        const float* gain;                   // Offsets of the image, or nullptr
+        double hotPixelSigma;                // See sum_corrected_bins
+
+        double operator()(py::ssize_t iImage, py::ssize_t offset, int16_t pixel) const {
+            if (pixel < 0) return std::numeric_limits<double>::quiet_NaN();
+            double value = pixel;
+            if (backgroundImage) value -= backgroundImage[offset];
+            if (imageBackgrounds) value -= imageBackgrounds[iImage];
+            if (gain) value *= gain[offset];
+            return value;
+        }
+    };
+
+    /// Checks the corrections of a stack of nImages (nCorrectionQY,
+    /// nCorrectionQX) images. Returns nullopt if there are none, so the
+    /// pixels are summed as integers.
+    static std::optional<PixelCorrection> pixel_correction(
+        const Correction& background, const Correction& gain, double hotPixelSigma,
+        py::ssize_t nImages, py::ssize_t nCorrectionQY, py::ssize_t nCorrectionQX) {
+        if (!background && !gain && hotPixelSigma <= 0.0) return std::nullopt;
+
+        PixelCorrection correction{nullptr, nullptr, nullptr, hotPixelSigma};
+        if (background) {
+            if (background->ndim() == 2 && background->shape(0) == nCorrectionQY
+                && background->shape(1) == nCorrectionQX) {
+                correction.backgroundImage = background->data();
+            } else if (background->ndim() == 1 && background->shape(0) == nImages) {
+                correction.imageBackgrounds = background->data();
+            } else {
+                throw std::runtime_error("The background should have the shape of a single "
+                    "image or one value per image.");
+            }
+        }
+        if (gain) {
+            if (gain->ndim() != 2 || gain->shape(0) != nCorrectionQY
+                || gain->shape(1) != nCorrectionQX) {
+                throw std::runtime_error("The gain should have the shape of a single image.");
+            }
+            correction.gain = gain->data();
+        }
+        return correction;
+    }
+
+    /// Checks a stack of centered images.
+    py::buffer_info check_stack(const py::array_t<int16_t>& sedDataArray) const {
+        // Retrieve the array data and information through the buffer
+        py::buffer_info bufSedData = sedDataArray.request();
+
+        // Data checks
+        if (bufSedData.ndim != 3) {
+            throw std::runtime_error("Input should be a 3D NumPy array. The shape "
+                "should be (nImages, nQY, nQX)");
+        }
+        if (!(sedDataArray.flags() & py::array::c_style)) {
+            throw std::runtime_error("Input arrays must be C-contiguous.");
+        }
+        if (bufSedData.shape[1] != nQY || bufSedData.shape[2] != nQX) {
+            throw std::runtime_error("The image shape does not match the shape "
+                "of the integration plan.");
+        }
+        return bufSedData;
+    }
+
+    /// Checks the shape of a mask.
+    static void check_mask(const py::array_t<bool, py::array::c_style | py::array::forcecast>& mask,
+                           py::ssize_t nMaskQY, py::ssize_t nMaskQX) {
+        if (mask.ndim() != 2 || mask.shape(0) != nMaskQY || mask.shape(1) != nMaskQX) {
+            throw std::runtime_error("The mask should have the shape of a single image.");
+        }
+    }
+
+    /// Checks a stack of uncentered images, their beam centers and the mask.
+    static void check_centered_stack(const py::array_t<int16_t>& sedDataArray,
+                                     const py::array_t<double>& beamCentersArray,
+                                     const DetectorMask& detectorMask) {
+        py::buffer_info bufSedData = sedDataArray.request();
+        py::buffer_info bufBeamCenters = beamCentersArray.request();
+
+        // Data checks
+        if (bufSedData.ndim != 3) {
+            throw std::runtime_error("Input should be a 3D NumPy array. The shape "
+                "should be (nImages, nDetY, nDetX)");
+        }
+        if (!(sedDataArray.flags() & py::array::c_style)
+            || !(beamCentersArray.flags() & py::array::c_style)) {
+            throw std::runtime_error("Input arrays must be C-contiguous.");
+        }
+        if (bufBeamCenters.ndim != 2 || bufBeamCenters.shape[1] != 2
+            || bufBeamCenters.shape[0] != bufSedData.shape[0]) {
+            throw std::runtime_error("Beam center array should have shape (nImages, 2).");
+        }
+        if (detectorMask) check_mask(*detectorMask, bufSedData.shape[1], bufSedData.shape[2]);
+    }
+
+    /// Runs imageKernel(iImage, pixelValue) for every image of a checked
+    /// stack of centered images, in parallel with the GIL released.
+    /// pixelValue(iPixel) returns the value of the iPixel-th entry of the
+    /// pixel list. Every image is processed by a single thread, so the
+    /// results do not depend on the number of threads. Every pixel is
+    /// passed through transform(iImage, offset, pixel), e.g. a
+    /// PixelCorrection, with its offset in the image.
+    template <typename ImageKernel, typename PixelTransform = RawPixel>
+    void for_each_image(const py::array_t<int16_t>& sedDataArray, int nThreads,
+                        ImageKernel&& imageKernel,
+                        biosed::ParallelStats* stats = nullptr,
+                        const PixelTransform& transform = PixelTransform()) const {
+        py::ssize_t nImages = sedDataArray.shape(0);
+        const int16_t* sedData = sedDataArray.data();
+
+        auto processImages = [&](int, std::ptrdiff_t imageBegin, std::ptrdiff_t imageEnd) {
+            for (py::ssize_t iImage = imageBegin; iImage < imageEnd; ++iImage) {
+                const int16_t* image = sedData + iImage * nQY * nQX;
+                imageKernel(iImage, [&](py::ssize_t iPixel) {
+                    py::ssize_t offset = pixelOffsets[iPixel];
+                    return transform(iImage, offset, image[offset]);
+                });
+            }
+        };
+
+        py::gil_scoped_release release;
+        biosed::parallel_for(nImages, nThreads, processImages, 0, stats);
+    }
+
+    /// for_each_image for the selected frames of a checked stack of
+    /// uncentered images. imageKernel is called with the position of the
+    /// frame in the selection. The pixel list of every image is placed
+    /// around its beam center, exactly as if the image had been trimmed with
+    /// preprocess.center_images first. Pixels outside of the detector and
+    /// pixels of the detector mask have the value -1. The pixels are
+    /// passed through transform like in for_each_image, with their offset
+    /// in the detector image.
+    template <typename ImageKernel, typename PixelTransform = RawPixel>
+    void for_each_centered_image(const py::array_t<int16_t>& sedDataArray,
+                                 const py::array_t<double>& beamCentersArray,
+                                 const FrameSelection& frames,
+                                 const DetectorMask& detectorMask,
+                                 int nThreads, ImageKernel&& imageKernel,
+                                 biosed::ParallelStats* stats = nullptr,
+                                 const PixelTransform& transform = PixelTransform()) const {
+        py::ssize_t nDetY = sedDataArray.shape(1);
+        py::ssize_t nDetX = sedDataArray.shape(2);
+
+        std::vector<int32_t> pixelsQY, pixelsQX;
+        std::vector<py::ssize_t> detectorOffsets;
+        crop_positions(nDetX, pixelsQY, pixelsQX, detectorOffsets);
+
+        const int16_t* sedData = sedDataArray.data();
+        const double* beamCenters = beamCentersArray.data();
+        const bool* mask = detectorMask ? detectorMask->data() : nullptr;
+
+        auto processImages = [&](int, std::ptrdiff_t frameBegin, std::ptrdiff_t frameEnd) {
+            for (py::ssize_t iFrame = frameBegin; iFrame < frameEnd; ++iFrame) {
+                py::ssize_t iImage = frames[iFrame];
+                const int16_t* image = sedData + iImage * nDetY * nDetX;
+
+                // Same truncation as center_images, which casts with astype(int)
+                py::ssize_t cropQY = crop_corner(beamCenters[2 * iImage], nQY, nDetY);
+                py::ssize_t cropQX = crop_corner(beamCenters[2 * iImage + 1], nQX, nDetX);
+
+                if (cropQY >= 0 && cropQX >= 0
+                    && cropQY + nQY <= nDetY && cropQX + nQX <= nDetX) {
+                    // The crop lies on the detector, no bounds checks needed
+                    const py::ssize_t cropOffset = cropQY * nDetX + cropQX;
+                    const int16_t* crop = image + cropOffset;
+                    if (!mask) {
+                        imageKernel(iFrame, [&](py::ssize_t iPixel) {
+                            py::ssize_t offset = detectorOffsets[iPixel];
+                            return transform(iImage, cropOffset + offset, crop[offset]);
+                        });
+                    } else {
+                        const bool* cropMask = mask + cropOffset;
+                        imageKernel(iFrame, [&](py::ssize_t iPixel) {
+                            py::ssize_t offset = detectorOffsets[iPixel];
+                            return transform(iImage, cropOffset + offset,
+                                             cropMask[offset] ? static_cast<int16_t>(-1) : crop[offset]);
+                        });
+                    }
+                } else {
+                    imageKernel(iFrame, [&](py::ssize_t iPixel) {
+                        py::ssize_t iQY = cropQY + pixelsQY[iPixel];
+                        py::ssize_t iQX = cropQX + pixelsQX[iPixel];
+                        if (iQY < 0 || iQY >= nDetY || iQX < 0 || iQX >= nDetX
+                            || (mask && mask[iQY * nDetX + iQX])) {
+                            return transform(iImage, 0, static_cast<int16_t>(-1));
+                        }
+                        return transform(iImage, iQY * nDetX + iQX, image[iQY * nDetX + iQX]);
+                    });
+                }
+            }
+        };
+
+        py::gil_scoped_release release;
+        biosed::parallel_for(frames.nFrames, nThreads, processImages, 0, stats);
+    }
+
+    /// for_each_centered_image with the pixel list placed at the fractional
+    /// beam center. Every pixel of the list is sampled at its exact position
+    /// relative to the beam center by bilinear interpolation of the four
+    /// surrounding detector pixels, so its q and phi are those of the plan.
+    /// The fractional part of the beam center is the same for every pixel
+    /// of an image, so are the four weights. Samples that need a pixel
+    /// outside of the detector, a masked or a negative pixel are -1.
+    template <typename ImageKernel>
+    void for_each_subpixel_image(const py::array_t<int16_t>& sedDataArray,
+                                 const py::array_t<double>& beamCentersArray,
+                                 const FrameSelection& frames,
+                                 const DetectorMask& detectorMask,
+                                 int nThreads, ImageKernel&& imageKernel,
+                                 biosed::ParallelStats* stats = nullptr) const {
+        py::ssize_t nDetY = sedDataArray.shape(1);
+        py::ssize_t nDetX = sedDataArray.shape(2);
+
+        std::vector<int32_t> pixelsQY, pixelsQX;
+        std::vector<py::ssize_t> detectorOffsets;
+        crop_positions(nDetX, pixelsQY, pixelsQX, detectorOffsets);
+
+        const int16_t* sedData = sedDataArray.data();
+        const double* beamCenters = beamCentersArray.data();
+        const bool* mask = detectorMask ? detectorMask->data() : nullptr;
+
+        auto processImages = [&](int, std::ptrdiff_t frameBegin, std::ptrdiff_t frameEnd) {
+            for (py::ssize_t iFrame = frameBegin; iFrame < frameEnd; ++iFrame) {
+                py::ssize_t iImage = frames[iFrame];
+                const int16_t* image = sedData + iImage * nDetY * nDetX;
+
+                // The crop corner is the pixel below the exact position of
+                // the first listed pixel, the fraction is the same for all.
+                // Centers that are not finite put the crop off the detector.
+                double floorQY = std::floor(beamCenters[2 * iImage]);
+                double floorQX = std::floor(beamCenters[2 * iImage + 1]);
+                double fracQY = beamCenters[2 * iImage] - floorQY;
+                double fracQX = beamCenters[2 * iImage + 1] - floorQX;
+                if (!std::isfinite(fracQY) || !std::isfinite(fracQX)) {
+                    fracQY = fracQX = 0.0;
+                }
+                py::ssize_t cropQY = crop_corner(floorQY, nQY, nDetY);
+                py::ssize_t cropQX = crop_corner(floorQX, nQX, nDetX);
+
+                const double weight00 = (1.0 - fracQY) * (1.0 - fracQX);
+                const double weight01 = (1.0 - fracQY) * fracQX;
+                const double weight10 = fracQY * (1.0 - fracQX);
+                const double weight11 = fracQY * fracQX;
+
+                if (cropQY >= 0 && cropQX >= 0
+                    && cropQY + nQY + 1 <= nDetY && cropQX + nQX + 1 <= nDetX) {
+                    // The crop and its neighbors lie on the detector
+                    const int16_t* crop = image + cropQY * nDetX + cropQX;
+                    const bool* cropMask = mask ? mask + cropQY * nDetX + cropQX : nullptr;
+                    imageKernel(iFrame, [&](py::ssize_t iPixel) {
+                        const py::ssize_t offset = detectorOffsets[iPixel];
+                        const int16_t* corner = crop + offset;
+                        int16_t pixel00 = corner[0], pixel01 = corner[1];
+                        int16_t pixel10 = corner[nDetX], pixel11 = corner[nDetX + 1];
+                        if (cropMask) {
+                            if (cropMask[offset]) pixel00 = -1;
+                            if (cropMask[offset + 1]) pixel01 = -1;
+                            if (cropMask[offset + nDetX]) pixel10 = -1;
+                            if (cropMask[offset + nDetX + 1]) pixel11 = -1;
+                        }
+                        // Only neighbors with a weight can invalidate a sample
+                        if ((pixel00 < 0 && weight00 != 0.0) || (pixel01 < 0 && weight01 != 0.0)
+                            || (pixel10 < 0 && weight10 != 0.0) || (pixel11 < 0 && weight11 != 0.0)) {
+                            return -1.0;
+                        }
+                        return weight00 * pixel00 + weight01 * pixel01
+                             + weight10 * pixel10 + weight11 * pixel11;
+                    });
+                } else {
+                    // Neighbors without weight may lie outside of the detector
+                    auto tap = [&](py::ssize_t iQY, py::ssize_t iQX, double weight, double& value) {
+                        if (weight == 0.0) return true;
+                        if (iQY < 0 || iQY >= nDetY || iQX < 0 || iQX >= nDetX
+                            || (mask && mask[iQY * nDetX + iQX])) {
+                            return false;
+                        }
+                        int16_t pixel = image[iQY * nDetX + iQX];
+                        value += weight * pixel;
+                        return pixel >= 0;
+                    };
+                    imageKernel(iFrame, [&](py::ssize_t iPixel) {
+                        py::ssize_t iQY = cropQY + pixelsQY[iPixel];
+                        py::ssize_t iQX = cropQX + pixelsQX[iPixel];
+                        double value = 0.0;
+                        bool valid = tap(iQY, iQX, weight00, value)
+                                  && tap(iQY, iQX + 1, weight01, value)
+                                  && tap(iQY + 1, iQX, weight10, value)
+                                  && tap(iQY + 1, iQX + 1, weight11, value);
+                        return valid ? value : -1.0;
+                    });
+                }
+            }
+        };
+
+        py::gil_scoped_release release;
+        biosed::parallel_for(frames.nFrames, nThreads, processImages, 0, stats);
+    }
+
+    /// for_each_subpixel_image or for_each_centered_image.
+    template <typename ImageKernel>
+    void for_each_placed_image(const py::array_t<int16_t>& sedDataArray,
+                               const py::array_t<double>& beamCentersArray,
+                               const FrameSelection& frames,
+                               const DetectorMask& detectorMask, bool subpixel,
+                               int nThreads, ImageKernel&& imageKernel,
+                               biosed::ParallelStats* stats = nullptr) const {
+        if (subpixel) {
+            for_each_subpixel_image(sedDataArray, beamCentersArray, frames, detectorMask,
+                                    nThreads, imageKernel, stats);
+        } else {
+            for_each_centered_image(sedDataArray, beamCentersArray, frames, detectorMask,
+                                    nThreads, imageKernel, stats);
+        }
+    }
+
+    /// Position of every entry of the pixel list relative to the corner of
+    /// the crop, and its offset in a detector image with nDetX columns.
+    void crop_positions(py::ssize_t nDetX, std::vector<int32_t>& pixelsQY,
+                        std::vector<int32_t>& pixelsQX,
+                        std::vector<py::ssize_t>& detectorOffsets) const {
+        pixelsQY.resize(pixelOffsets.size());
+        pixelsQX.resize(pixelOffsets.size());
+        detectorOffsets.resize(pixelOffsets.size());
+        for (size_t iPixel = 0; iPixel < pixelOffsets.size(); ++iPixel) {
+            pixelsQY[iPixel] = pixelOffsets[iPixel] / static_cast<int32_t>(nQX);
+            pixelsQX[iPixel] = pixelOffsets[iPixel] % static_cast<int32_t>(nQX);
+            detectorOffsets[iPixel] = pixelsQY[iPixel] * nDetX + pixelsQX[iPixel];
+        }
+    }
+
+    /// Corner of a crop of cropSize pixels around a beam center coordinate,
+    /// truncated towards zero. Centers that are not finite or lie further
+    /// off the detector than the crop size, e.g. NaN centers of frames
+    /// without a beam, put the crop and its neighbors off the detector
+    /// instead of overflowing the cast.
+    static py::ssize_t crop_corner(double beamCenter, py::ssize_t cropSize,
+                                   py::ssize_t detectorSize) {
+        if (!(std::abs(beamCenter) <= static_cast<double>(detectorSize + cropSize))) {
+            return -cropSize - 1;
+        }
+        return static_cast<py::ssize_t>(beamCenter) - cropSize / 2;
+    }
+
+    /// Adds a kernel call over nFrames images to the module counters. Every
+    /// image visits the whole pixel list, the pixels that were not used
+    /// were masked, off the detector or rejected as hot pixels.
+    void record_kernel(const std::string& kernel, const biosed::ParallelStats& stats,
+                       py::ssize_t nFrames, int64_t usedPixels) const {
+        int64_t visitedPixels = static_cast<int64_t>(nFrames) * n_pixels();
+        biosed::record_kernel(kernel, stats, nFrames, visitedPixels, visitedPixels - usedPixels);
+    }
+
+    /// Calls function with a value of the output type named by dtype.
+    template <typename Function>
+    static py::array with_output_type(const std::string& dtype, Function&& function) {
+        if (dtype == "float64") return function(double());
+        if (dtype == "float32") return function(float());
+        throw std::runtime_error("Unsupported output dtype " + dtype + ", use float32 or float64.");
+    }
+
+    /// Integrates centered images into Output (float or double) profiles.
+    /// If harmonics is given, the coefficients of every profile are written
+    /// to a new coefficientsArray as well. With corrections, the pixels are
+    /// corrected and summed as doubles, see integrate_corrected_image.
+    template <typename Output>
+    py::array_t<Output> integrate_stack(
+        py::array_t<int16_t> sedDataArray,
+        int nThreads,
+        const biosed::HarmonicTable* harmonics,
+        py::array_t<std::complex<double>>* coefficientsArray,
+        const std::optional<PixelCorrection>& corrections = std::nullopt
+    ) const {
+        py::buffer_info bufSedData = check_stack(sedDataArray);
+        py::ssize_t nImages = bufSedData.shape[0];
+
+        // Initialize the output
+        auto aziIntensityProfilesArray = py::array_t<Output>(profile_shape(nImages));
+        Output* aziIntensityProfiles = aziIntensityProfilesArray.mutable_data();
+        std::complex<double>* coefficients = harmonic_output(nImages, harmonics, coefficientsArray);
+
+        biosed::ParallelStats stats;
+        std::atomic<int64_t> usedPixels{0};
+        auto project = [&](py::ssize_t iImage, const Output* profile) {
+            if (harmonics) {
+                harmonics->project(profile, coefficients + iImage * harmonics->nOrders);
+            }
+        };
+        if (!corrections) {
+            for_each_image(sedDataArray, nThreads, [&](py::ssize_t iImage, auto&& pixelValue) {
+                Output* profile = aziIntensityProfiles + iImage * profile_size();
+                usedPixels += integrate_image(pixelValue, profile);
+                project(iImage, profile);
+            }, &stats);
+        } else {
+            for_each_image(sedDataArray, nThreads, [&](py::ssize_t iImage, auto&& pixelValue) {
+                Output* profile = aziIntensityProfiles + iImage * profile_size();
+                usedPixels += integrate_corrected_image(pixelValue, corrections->hotPixelSigma,
+                                                        profile);
+                project(iImage, profile);
+            }, &stats, *corrections);
+        }
+        record_kernel("integrate", stats, nImages, usedPixels);
+
+        return aziIntensityProfilesArray;
+    }
+
+    /// Integrates the selected frames of uncentered images, see integrate_stack.
+    template <typename Output>
+    py::array_t<Output> integrate_centered_stack(
+        py::array_t<int16_t> sedDataArray,
+        py::array_t<double> beamCentersArray,
+        const FrameIndices& frameIndicesArray,
+        const DetectorMask& detectorMask,
+        bool subpixel,
+        int nThreads,
+        const biosed::HarmonicTable* harmonics,
+        py::array_t<std::complex<double>>* coefficientsArray,
+        const std::optional<PixelCorrection>& corrections = std::nullopt
+    ) const {
+        check_centered_stack(sedDataArray, beamCentersArray, detectorMask);
+        if (corrections && subpixel) {
+            throw std::runtime_error("Background, gain and hot pixel corrections are not "
+                "available with subpixel.");
+        }
+        FrameSelection frames = select_frames(sedDataArray, frameIndicesArray);
+
+        // Initialize the output
+        auto aziIntensityProfilesArray = py::array_t<Output>(profile_shape(frames.nFrames));
+        Output* aziIntensityProfiles = aziIntensityProfilesArray.mutable_data();
+        std::complex<double>* coefficients
+            = harmonic_output(frames.nFrames, harmonics, coefficientsArray);
+
+        biosed::ParallelStats stats;
+        std::atomic<int64_t> usedPixels{0};
+        auto project = [&](py::ssize_t iFrame, const Output* profile) {
+            if (harmonics) {
+                harmonics->project(profile, coefficients + iFrame * harmonics->nOrders);
+            }
+        };
+        if (!corrections) {
+            auto imageKernel = [&](py::ssize_t iFrame, auto&& pixelValue) {
+                Output* profile = aziIntensityProfiles + iFrame * profile_size();
+                usedPixels += integrate_image(pixelValue, profile);
+                project(iFrame, profile);
+            };
+            for_each_placed_image(sedDataArray, beamCentersArray, frames, detectorMask, subpixel,
+                                  nThreads, imageKernel, &stats);
+        } else {
+            auto imageKernel = [&](py::ssize_t iFrame, auto&& pixelValue) {
+                Output* profile = aziIntensityProfiles + iFrame * profile_size();
+                usedPixels += integrate_corrected_image(pixelValue, corrections->hotPixelSigma,
+                                                        profile);
+                project(iFrame, profile);
+            };
+            for_each_centered_image(sedDataArray, beamCentersArray, frames, detectorMask,
+                                    nThreads, imageKernel, &stats, *corrections);
+        }
+        record_kernel("integrate_centered", stats, frames.nFrames, usedPixels);
+
+        return aziIntensityProfilesArray;
+    }
+
+    /// Allocates the (nImages, nOrders) harmonic coefficients of a stack, if
+    /// any are computed, and returns the pointer to write them to.
+    static std::complex<double>* harmonic_output(
+        py::ssize_t nImages,
+        const biosed::HarmonicTable* harmonics,
+        py::array_t<std::complex<double>>* coefficientsArray
+    ) {
+        if (!harmonics) return nullptr;
+        *coefficientsArray = py::array_t<std::complex<double>>(
+            std::vector<py::ssize_t>{nImages, harmonics->nOrders});
+        return coefficientsArray->mutable_data();
+    }
+
+    /// Frames of a stack that are processed. Checks that the indices are
+    /// valid image indices of the stack.
+    static FrameSelection select_frames(const py::array_t<int16_t>& sedDataArray,
+                                        const FrameIndices& frameIndicesArray) {
+        py::ssize_t nImages = sedDataArray.shape(0);
+        if (!frameIndicesArray) return FrameSelection{nullptr, nImages};
+
+        py::buffer_info bufFrameIndices = frameIndicesArray->request();
+        if (bufFrameIndices.ndim != 1) {
+            throw std::runtime_error("Frame indices should be a 1D array.");
+        }
+        if (!(frameIndicesArray->flags() & py::array::c_style)) {
+            throw std::runtime_error("Input arrays must be C-contiguous.");
+        }
+
+        const int64_t* frameIndices = static_cast<const int64_t*>(bufFrameIndices.ptr);
+        for (py::ssize_t iFrame = 0; iFrame < bufFrameIndices.shape[0]; ++iFrame) {
+            if (frameIndices[iFrame] < 0 || frameIndices[iFrame] >= nImages) {
+                throw py::index_error("Frame index out of range.");
+            }
+        }
+        return FrameSelection{frameIndices, bufFrameIndices.shape[0]};
+    }
+
+    /// (QY, QX) of every entry of the pixel list relative to the beam center.
+    std::vector<std::array<int32_t, 2>> pixel_positions() const {
+        std::vector<std::array<int32_t, 2>> pixelPositions(pixelOffsets.size());
+        for (size_t iPixel = 0; iPixel < pixelOffsets.size(); ++iPixel) {
+            pixelPositions[iPixel] = {
+                pixelOffsets[iPixel] / static_cast<int32_t>(nQX) - static_cast<int32_t>(nQY / 2),
+                pixelOffsets[iPixel] % static_cast<int32_t>(nQX) - static_cast<int32_t>(nQX / 2)};
+        }
+        return pixelPositions;
     }
-    
-    py::ssize_t nImages = bufSedData.shape[0];    // Y scan dimension
-    py::ssize_t nQY = bufSedData.shape[1];    // X scan dimension
-    py::ssize_t nQX = bufSedData.shape[2];  // QY dimension size of the detector
 
-    // Calculate beam center
-    int beamCenterQY = static_cast<int>(nQY / 2);  // Integer division
-    int beamCenterQX = static_cast<int>(nQX / 2);
+    /// Writes [orientation, anisotropy, aspect ratio] of a single image into
+    /// result. The weighted moments are accumulated in one pass over the
+    /// pixel list. Pixel values and positions are integers, so the sums are
+    /// exact. The eigenvalues of the 2x2 covariance matrix are solved in
+    /// closed form. Negative (masked) pixels are skipped. Returns the number
+    /// of unmasked pixels.
+    template <typename PixelValue>
+    int64_t image_principal_components(PixelValue&& pixelValue,
+                                    const std::vector<std::array<int32_t, 2>>& pixelPositions,
+                                    double* result) const {
+        int64_t sumI = 0, sumY = 0, sumX = 0, sumYY = 0, sumXX = 0, sumYX = 0;
+        int64_t usedPixels = 0;
+        for (size_t iPixel = 0; iPixel < pixelPositions.size(); ++iPixel) {
+            int64_t pixel = pixelValue(iPixel);
+            if (pixel < 0) continue;
+            usedPixels++;
+            int64_t QY = pixelPositions[iPixel][0], QX = pixelPositions[iPixel][1];
+            sumI += pixel;
+            sumY += pixel * QY;
+            sumX += pixel * QX;
+            sumYY += pixel * QY * QY;
+            sumXX += pixel * QX * QX;
+            sumYX += pixel * QY * QX;
+        }
+
+        if (sumI == 0) {
+            result[0] = result[1] = result[2] = std::numeric_limits<double>::quiet_NaN();
+            return usedPixels;
+        }
 
-    // Compute q and phi values for the entire detector
-    auto pixelsPhiArray = py::array_t<double>({nQY, nQX});
-    auto pixelsPhi = pixelsPhiArray.mutable_unchecked<2>();
-    auto pixelsQArray = py::array_t<double>({nQY, nQX});
-    auto pixelsQ = pixelsQArray.mutable_unchecked<2>();
+        // Covariance matrix [[covYY, covYX], [covYX, covXX]]. The units of q
+        // cancel in all of the results.
+        double meanY = static_cast<double>(sumY) / sumI;
+        double meanX = static_cast<double>(sumX) / sumI;
+        double covYY = static_cast<double>(sumYY) / sumI - meanY * meanY;
+        double covXX = static_cast<double>(sumXX) / sumI - meanX * meanX;
+        double covYX = static_cast<double>(sumYX) / sumI - meanY * meanX;
 
-    auto validPixelsArray = py::array_t<bool>({nQY, nQX});
-    auto validPixels = validPixelsArray.mutable_unchecked<2>();
+        double halfTrace = 0.5 * (covYY + covXX);
+        double radius = std::hypot(0.5 * (covXX - covYY), covYX);
+        double eigenvalue1 = halfTrace + radius;    // Major axis
+        double eigenvalue2 = halfTrace - radius;    // Minor axis
 
-    auto binIndiciesArray = py::array_t<int>({nQY, nQX});
-    auto binIndicies = binIndiciesArray.mutable_unchecked<2>();
+        // Angle of the major axis from QX towards QY
+        double orientation = 0.5 * std::atan2(2.0 * covYX, covXX - covYY);
+        if (orientation < 0) orientation += M_PI;
 
-    // This is for valid for the centered detectors. It excludes the masked.
-    for (py::ssize_t iQY = 0; iQY < nQY; ++iQY) {
-        int QY = iQY - beamCenterQY;
-        for (py::ssize_t iQX = 0; iQX < nQX; ++iQX) {
-            int QX = iQX - beamCenterQX;
-            // Compute phi values
-            pixelsQ(iQY, iQX) = std::sqrt(QY*QY + QX*QX) * qCallibration;
-            pixelsPhi(iQY, iQX) = std::atan2(QY, QX) * 180.0 / M_PI;
-            if (pixelsPhi(iQY, iQX) < 0) pixelsPhi(iQY, iQX) += 360.0;
+        result[0] = orientation;
+        result[1] = (eigenvalue1 - eigenvalue2) / (eigenvalue1 + eigenvalue2);
+        result[2] = std::sqrt(eigenvalue1 / eigenvalue2);
+        return usedPixels;
+    }
 
-            // Determine valid pixels for the given q range
-            validPixels(iQY, iQX) = (pixelsQ(iQY, iQX) >= std::get<0>(QRange)) &&
-                            (pixelsQ(iQY, iQX) <= std::get<1>(QRange));
+    /// Calls binResult(iSlot, sum, count) with the sum and the number of
+    /// the unmasked pixels of every bin of a single image. pixelValue(iPixel)
+    /// returns the value of the iPixel-th entry of the pixel list, as int16
+    /// or as interpolated double. Negative values are masked and skipped.
+    /// int16 pixels are summed in integers, in int32 when no bin can
+    /// overflow it, so the sums are exact and the loop is narrower. Returns
+    /// the number of unmasked pixels of the image.
+    template <typename PixelValue, typename BinResult>
+    int64_t sum_bins(PixelValue&& pixelValue, BinResult&& binResult) const {
+        using Pixel = std::decay_t<decltype(pixelValue(py::ssize_t(0)))>;
+        if constexpr (std::is_integral_v<Pixel>) {
+            if (int32Sums) {
+                return sum_bins_as<int32_t>(pixelValue, binResult);
+            } else {
+                return sum_bins_as<int64_t>(pixelValue, binResult);
+            }
+        } else {
+            return sum_bins_as<double>(pixelValue, binResult);
+        }
+    }
+
+    /// sum_bins with the given accumulator type.
+    template <typename Accumulator, typename PixelValue, typename BinResult>
+    int64_t sum_bins_as(PixelValue&& pixelValue, BinResult&& binResult) const {
+        int64_t usedPixels = 0;
+
+        // Only the pixels inside the q range are visited
+        for (int iBin = 0; iBin < nBins; ++iBin) {
+            Accumulator phiBinSum = 0;
+            int32_t pixelCount = 0;
+            accumulate_bin(pixelValue, binStarts[iBin], binStarts[iBin + 1],
+                           phiBinSum, pixelCount);
+
+            binResult(binSlots[iBin], static_cast<double>(phiBinSum), pixelCount);
+            usedPixels += pixelCount;
+        }
+        return usedPixels;
+    }
 
-            // Compute bin assignations
-            if (validPixels(iQY, iQX)) {
-                binIndicies(iQY, iQX)
-                = static_cast<int>(pixelsPhi(iQY, iQX) /(360.0/nPhiBins));
-                binIndicies(iQY, iQX) = std::clamp(binIndicies(iQY, iQX), 0, nPhiBins - 1);
+    /// Adds the unmasked entries [pixelBegin, pixelEnd) of the pixel list to
+    /// phiBinSum and pixelCount. Integer pixels are summed without branches
+    /// in four independent lanes, unrolled, which is exact in any order.
+    /// Interpolated pixels are summed in list order, so the floating point
+    /// sums do not change.
+    template <typename Accumulator, typename PixelValue>
+    static void accumulate_bin(PixelValue& pixelValue, py::ssize_t pixelBegin,
+                               py::ssize_t pixelEnd, Accumulator& phiBinSum,
+                               int32_t& pixelCount) {
+        if constexpr (std::is_integral_v<Accumulator>) {
+            constexpr int nLanes = 4;
+            Accumulator laneSums[nLanes] = {};
+            int32_t laneCounts[nLanes] = {};
+            py::ssize_t iPixel = pixelBegin;
+            for (; iPixel + nLanes <= pixelEnd; iPixel += nLanes) {
+                for (int iLane = 0; iLane < nLanes; ++iLane) {
+                    Accumulator pixel = pixelValue(iPixel + iLane);
+                    bool valid = pixel >= 0;
+                    laneSums[iLane] += valid ? pixel : 0;
+                    laneCounts[iLane] += valid;
+                }
+            }
+            for (; iPixel < pixelEnd; ++iPixel) {
+                Accumulator pixel = pixelValue(iPixel);
+                bool valid = pixel >= 0;
+                laneSums[0] += valid ? pixel : 0;
+                laneCounts[0] += valid;
+            }
+            for (int iLane = 0; iLane < nLanes; ++iLane) {
+                phiBinSum += laneSums[iLane];
+                pixelCount += laneCounts[iLane];
+            }
+        } else {
+            for (py::ssize_t iPixel = pixelBegin; iPixel < pixelEnd; ++iPixel) {
+                auto pixel = pixelValue(iPixel);
+                if (pixel < 0) continue;
+                phiBinSum += pixel;
+                pixelCount++;
             }
         }
     }
 
-    //// IMAGE STACK PROCESSING ////
+    /// Writes the azimuthal profile of a single image into profile, see
+    /// sum_bins.
+    template <typename PixelValue, typename Output>
+    int64_t integrate_image(PixelValue&& pixelValue, Output* profile) const {
+        // Bins of rings with fewer phi bins than the plan
+        if (nBins < profile_size()) {
+            std::fill(profile, profile + profile_size(), std::numeric_limits<Output>::quiet_NaN());
+        }
+
+        return sum_bins(pixelValue, [&](int iSlot, double phiBinSum, int32_t pixelCount) {
+            // Average the intensities
+            profile[iSlot] = static_cast<Output>((pixelCount > 0) ? phiBinSum / pixelCount : 0.0);
+        });
+    }
 
-    // Initialize the output
-    auto aziIntensityProfilesArray
-        = py::array_t<double>(std::vector<py::ssize_t>{nImages, nPhiBins});
-    auto aziIntensityProfiles
-        = aziIntensityProfilesArray.mutable_unchecked<2>();
+    /// integrate_image for corrected pixel values, see sum_corrected_bins.
+    template <typename PixelValue, typename Output>
+    int64_t integrate_corrected_image(PixelValue&& pixelValue, double hotPixelSigma,
+                                      Output* profile) const {
+        if (nBins < profile_size()) {
+            std::fill(profile, profile + profile_size(), std::numeric_limits<Output>::quiet_NaN());
+        }
+
+        return sum_corrected_bins(pixelValue, hotPixelSigma,
+                                  [&](int iSlot, double phiBinSum, int32_t pixelCount) {
+            profile[iSlot] = static_cast<Output>((pixelCount > 0) ? phiBinSum / pixelCount : 0.0);
+        });
+    }
+
+    /// sum_bins for corrected pixel values (PixelCorrection), where masked
+    /// pixels are NaN. With hotPixelSigma > 0, the pixels of a bin that lie
+    /// more than hotPixelSigma standard deviations above its median are
+    /// rejected, see hot_pixel_limit. The values of the bin are kept from
+    /// the first pass, so the second pass does not correct them again.
+    /// Returns the number of pixels that were used.
+    template <typename PixelValue, typename BinResult>
+    int64_t sum_corrected_bins(PixelValue&& pixelValue, double hotPixelSigma,
+                               BinResult&& binResult) const {
+        int64_t usedPixels = 0;
+        std::vector<double> binValues, scratch;
+
+        for (int iBin = 0; iBin < nBins; ++iBin) {
+            double phiBinSum = 0.0, phiBinSquares = 0.0;
+            int32_t pixelCount = 0;
+            binValues.clear();
+            for (py::ssize_t iPixel = binStarts[iBin]; iPixel < binStarts[iBin + 1]; ++iPixel) {
+                double pixel = pixelValue(iPixel);
+                if (std::isnan(pixel)) continue;
+                phiBinSum += pixel;
+                phiBinSquares += pixel * pixel;
+                pixelCount++;
+                if (hotPixelSigma > 0.0) binValues.push_back(pixel);
+            }
+
+            if (hotPixelSigma > 0.0 && pixelCount > 2) {
+                double limit = hot_pixel_limit(binValues, phiBinSum, phiBinSquares,
+                                               hotPixelSigma, scratch);
+                phiBinSum = 0.0;
+                pixelCount = 0;
+                for (double pixel : binValues) {
+                    if (pixel > limit) continue;
+                    phiBinSum += pixel;
+                    pixelCount++;
+                }
+            }
 
-    for (py::ssize_t iImage = 0; iImage < nImages; ++iImage) {
-        for (py::ssize_t iPhiBin = 0; iPhiBin < nPhiBins; ++iPhiBin) {
-            aziIntensityProfiles(iImage, iPhiBin) = 0.0;
+            binResult(binSlots[iBin], phiBinSum, pixelCount);
+            usedPixels += pixelCount;
         }
+        return usedPixels;
     }
-    auto sedData = sedDataArray.mutable_unchecked<3>();
 
-    for (py::ssize_t iImage = 0; iImage < nImages; ++iImage) {
-        std::vector<double> phiBinsSum(nPhiBins, 0.0);
-        std::vector<int> pixelCount(nPhiBins, 0);
+    /// Upper limit of the pixels of a bin: median + hotPixelSigma * sigma,
+    /// with sigma estimated from the median absolute deviation. The outlier
+    /// does not shift the median and the MAD, so a single hot pixel is
+    /// rejected in any bin of at least 3 pixels. A mean + k sigma cut could
+    /// not do this in small bins, where the z-score of a single outlier is
+    /// at most (n - 1) / sqrt(n). Where more than half of the pixels have
+    /// the same value (e.g. zero counts), the MAD is 0 and the standard
+    /// deviation of the bin is used instead, as a median cut would reject
+    /// every pixel above it. That only rejects a hot pixel in bins of more
+    /// than about hotPixelSigma^2 pixels.
+    static double hot_pixel_limit(const std::vector<double>& values, double sum, double squares,
+                                  double hotPixelSigma, std::vector<double>& scratch) {
+        scratch.assign(values.begin(), values.end());
+        auto middle = scratch.begin() + scratch.size() / 2;
+        std::nth_element(scratch.begin(), middle, scratch.end());
+        double median = *middle;
 
+        for (double& value : scratch) value = std::abs(value - median);
+        std::nth_element(scratch.begin(), middle, scratch.end());
+        double sigma = 1.4826 * *middle;    // MAD of a normal distribution
+
+        if (sigma > 0.0) return median + hotPixelSigma * sigma;
+
+        double mean = sum / values.size();
+        double variance = std::max(0.0, squares / values.size() - mean * mean);
+        return mean + hotPixelSigma * std::sqrt(variance);
+    }
+
+    /// Writes the sum and the number of the unmasked pixels of every bin of
+    /// a single image, see sum_bins.
+    template <typename PixelValue>
+    int64_t cake_image(PixelValue&& pixelValue, float* sums, int32_t* counts) const {
+        if (nBins < profile_size()) {
+            std::fill(sums, sums + profile_size(), std::numeric_limits<float>::quiet_NaN());
+            std::fill(counts, counts + profile_size(), 0);
+        }
+
+        return sum_bins(pixelValue, [&](int iSlot, double phiBinSum, int32_t pixelCount) {
+            // The sum is exact, only the output is rounded
+            sums[iSlot] = static_cast<float>(phiBinSum);
+            counts[iSlot] = pixelCount;
+        });
+    }
+
+    /// Computes the pixel list of all rings.
+    void build(const DetectorMask& mask) {
+        if (nQY <= 0 || nQX <= 0) {
+            throw std::runtime_error("The detector shape should be positive.");
+        }
+        for (int ringBins : ringPhiBins) {
+            if (ringBins <= 0) {
+                throw std::runtime_error("The number of phi bins should be positive.");
+            }
+        }
+        if (nQY * nQX > std::numeric_limits<int32_t>::max()) {
+            throw std::runtime_error("The detector shape is too large.");
+        }
+        if (mask) check_mask(*mask, nQY, nQX);
+        const bool* maskData = mask ? mask->data() : nullptr;
+
+        // Calculate beam center
+        int beamCenterQY = static_cast<int>(nQY / 2);  // Integer division
+        int beamCenterQX = static_cast<int>(nQX / 2);
+
+        // The bins of ring r are [ringStarts[r], ringStarts[r+1]). Bin
+        // ringStarts[r] + i is written to entry r * nPhiBins + i of a profile.
+        int nRings = static_cast<int>(ringPhiBins.size());
+        std::vector<int> ringStarts(nRings + 1, 0);
+        for (int iRing = 0; iRing < nRings; ++iRing) {
+            ringStarts[iRing + 1] = ringStarts[iRing] + ringPhiBins[iRing];
+        }
+        nBins = ringStarts[nRings];
+        binSlots.resize(nBins);
+        for (int iRing = 0; iRing < nRings; ++iRing) {
+            for (int iPhiBin = 0; iPhiBin < ringPhiBins[iRing]; ++iPhiBin) {
+                binSlots[ringStarts[iRing] + iPhiBin] = iRing * nPhiBins + iPhiBin;
+            }
+        }
+
+        // Rings sorted by their lower q limit. The rings that contain a q
+        // value are among those with a lower limit up to q, and the scan
+        // over them stops once no ring before has an upper limit above q.
+        std::vector<int> sortedRings(nRings);
+        for (int iRing = 0; iRing < nRings; ++iRing) sortedRings[iRing] = iRing;
+        std::sort(sortedRings.begin(), sortedRings.end(), [&](int a, int b) {
+            return std::get<0>(ringQRanges[a]) < std::get<0>(ringQRanges[b]);
+        });
+        std::vector<double> sortedQMins(nRings), maxQMaxs(nRings);
+        for (int iSorted = 0; iSorted < nRings; ++iSorted) {
+            sortedQMins[iSorted] = std::get<0>(ringQRanges[sortedRings[iSorted]]);
+            double ringQMax = std::get<1>(ringQRanges[sortedRings[iSorted]]);
+            maxQMaxs[iSorted] = iSorted > 0 ? std::max(maxQMaxs[iSorted - 1], ringQMax) : ringQMax;
+        }
+
+        // (pixel, bin) of every pixel of every ring, in raster order. q and
+        // phi are computed once per pixel, whatever the number of rings.
+        // This is for valid for the centered detectors. It excludes the masked.
+        std::vector<std::pair<int32_t, int>> pixelBins;
+        binStarts.assign(nBins + 1, 0);
         for (py::ssize_t iQY = 0; iQY < nQY; ++iQY) {
+            int QY = iQY - beamCenterQY;
             for (py::ssize_t iQX = 0; iQX < nQX; ++iQX) {
-                if(!validPixels(iQY, iQX)) continue;
-                if(sedData(iImage, iQY, iQX) < 0) continue;
-                phiBinsSum[binIndicies(iQY, iQX)] += sedData(iImage, iQY, iQX);
-                pixelCount[binIndicies(iQY, iQX)]++;
+                int QX = iQX - beamCenterQX;
+                // Masked pixels are never visited
+                if (maskData && maskData[iQY * nQX + iQX]) continue;
+
+                double pixelQ = std::sqrt(QY*QY + QX*QX) * qCallibration;
+                int iSorted = static_cast<int>(std::upper_bound(sortedQMins.begin(), sortedQMins.end(),
+                                                                pixelQ) - sortedQMins.begin()) - 1;
+                if (iSorted < 0 || maxQMaxs[iSorted] < pixelQ) continue;
+
+                double pixelPhi = std::atan2(QY, QX) * 180.0 / M_PI;
+                if (pixelPhi < 0) pixelPhi += 360.0;
+
+                for (; iSorted >= 0 && maxQMaxs[iSorted] >= pixelQ; --iSorted) {
+                    int iRing = sortedRings[iSorted];
+                    if (pixelQ > std::get<1>(ringQRanges[iRing])) continue;
+                    int ringBins = ringPhiBins[iRing];
+                    int binIndex = static_cast<int>(pixelPhi /(360.0/ringBins));
+                    binIndex = ringStarts[iRing] + std::clamp(binIndex, 0, ringBins - 1);
+                    pixelBins.emplace_back(static_cast<int32_t>(iQY * nQX + iQX), binIndex);
+                    binStarts[binIndex + 1]++;
+                }
             }
         }
 
-        // Average the intensities
-        for (int iPhiBins = 0; iPhiBins < nPhiBins; ++iPhiBins) {
-            if (pixelCount[iPhiBins] > 0) {
-                aziIntensityProfiles(iImage, iPhiBins) = 0.0;
-                aziIntensityProfiles(iImage, iPhiBins)
-                = phiBinsSum[iPhiBins] / pixelCount[iPhiBins];
-            }
+        // Sparse (CSR) pixel list. The pixels of bin i are
+        // pixelOffsets[binStarts[i]:binStarts[i+1]], in raster order, so
+        // every bin is summed in the same order as a full detector scan.
+        for (int iBin = 0; iBin < nBins; ++iBin) {
+            binStarts[iBin + 1] += binStarts[iBin];
+        }
+
+        // Largest bin, for the range of the integer sums of int16 pixels
+        py::ssize_t maxBinPixels = 0;
+        for (int iBin = 0; iBin < nBins; ++iBin) {
+            maxBinPixels = std::max(maxBinPixels, binStarts[iBin + 1] - binStarts[iBin]);
+        }
+        int32Sums = maxBinPixels <= std::numeric_limits<int32_t>::max()
+                                    / std::numeric_limits<int16_t>::max();
+
+        pixelOffsets.resize(binStarts[nBins]);
+        std::vector<py::ssize_t> binFill(binStarts.begin(), binStarts.end() - 1);
+        for (const auto& [iPixel, binIndex] : pixelBins) {
+            pixelOffsets[binFill[binIndex]++] = iPixel;
         }
     }
 
-    return aziIntensityProfilesArray;
+    /// Throws for the methods that need a single ring.
+    void check_single_ring(const char* method) const {
+        if (multiRing) {
+            throw std::runtime_error(std::string(method) + " needs a plan with a single ring.");
+        }
+    }
+
+    std::vector<py::ssize_t> binStarts;     // CSR row pointers, one row per bin
+    std::vector<int32_t> pixelOffsets;      // Flat pixel indices of each bin
+    std::vector<int> binSlots;              // Entry of every bin in a profile
+    int nBins;                              // Number of bins of all rings
+    bool int32Sums;                         // No bin sum of int16 pixels overflows int32
+};
+
+
+/// Function for computing the crown integral.
+py::array compute_crown_integral(
+    // SED data as a stack of 2D arrays (int16)
+    py::array_t<int16_t> sedDataArray, 
+    int nPhiBins,                        // Number of phi bins
+    std::tuple<double, double> QRange,   // q range of integration (incl.)
+    double qCallibration,                // q/pixel value
+    int nThreads,                        // Number of threads (0 = all cores)
+    CrownIntegrationPlan::DetectorMask mask = std::nullopt, // Pixels to skip
+    const std::string& dtype = "float64", // Output type, float32 or float64
+    CrownIntegrationPlan::Correction background = std::nullopt, // Subtracted from the pixels
+    CrownIntegrationPlan::Correction gain = std::nullopt, // Flat-field gain of the pixels
+    double hotPixelSigma = 0.0           // Hot pixel rejection threshold (0 = off)
+){
+    // Retrieve the array data and information through the buffer
+    py::buffer_info bufSedData = sedDataArray.request();
+
+    // Data checks
+    if (bufSedData.ndim != 3) {
+        throw std::runtime_error("Input should be a 3D NumPy array. The shape "
+            "should be (nImages, nQY, nQX)");
+    }
+
+    // The geometry is only used once, so the plan is thrown away afterwards
+    CrownIntegrationPlan plan({bufSedData.shape[1], bufSedData.shape[2]},
+                              nPhiBins, QRange, qCallibration, mask);
+    return plan.integrate(sedDataArray, nThreads, dtype, background, gain, hotPixelSigma);
+}
+
+
+/// Crown integral of several rings in one pass, (nImages, nRings, nPhiBins).
+py::array compute_multi_ring_integral(
+    py::array_t<int16_t> sedDataArray,
+    std::vector<int> ringPhiBins,        // Number of phi bins of every ring
+    std::vector<std::tuple<double, double>> ringQRanges, // q range of every ring (incl.)
+    double qCallibration,                // q/pixel value
+    int nThreads,                        // Number of threads (0 = all cores)
+    CrownIntegrationPlan::DetectorMask mask = std::nullopt, // Pixels to skip
+    const std::string& dtype = "float64", // Output type, float32 or float64
+    CrownIntegrationPlan::Correction background = std::nullopt,
+    CrownIntegrationPlan::Correction gain = std::nullopt,
+    double hotPixelSigma = 0.0
+){
+    py::buffer_info bufSedData = sedDataArray.request();
+    if (bufSedData.ndim != 3) {
+        throw std::runtime_error("Input should be a 3D NumPy array. The shape "
+            "should be (nImages, nQY, nQX)");
+    }
+
+    CrownIntegrationPlan plan({bufSedData.shape[1], bufSedData.shape[2]},
+                              ringPhiBins, ringQRanges, qCallibration, mask);
+    return plan.integrate(sedDataArray, nThreads, dtype, background, gain, hotPixelSigma);
 }
 
 
@@ -137,7 +1344,111 @@ PYBIND11_MODULE(crown_integration, m) {
     // Optional docstring for the module
     m.doc() = "Crown integration algorithm."; 
 
+    // Reusable integration geometry
+    py::class_<CrownIntegrationPlan>(m, "CrownIntegrationPlan",
+        "Precomputed crown integration geometry for images of a given shape.")
+        .def(py::init<std::tuple<py::ssize_t, py::ssize_t>, int,
+                      std::tuple<double, double>, double,
+                      CrownIntegrationPlan::DetectorMask>(),
+            py::arg("shape"), py::arg("n_phi_bins"), py::arg("q_range"),
+            py::arg("q_callibration"), py::arg("mask") = py::none())
+        .def(py::init<std::tuple<py::ssize_t, py::ssize_t>, std::vector<int>,
+                      std::vector<std::tuple<double, double>>, double,
+                      CrownIntegrationPlan::DetectorMask>(),
+            "Plan of several rings, integrated in one pass into (n_rings, n_phi_bins) "
+            "profiles.",
+            py::arg("shape"), py::arg("ring_phi_bins"), py::arg("q_ranges"),
+            py::arg("q_callibration"), py::arg("mask") = py::none())
+        .def("integrate", &CrownIntegrationPlan::integrate,
+            "Performs crown integration on a stack of centered 2D detector images. "
+            "Images are distributed over n_threads threads (0 uses all cores). "
+            "dtype is the output type of the profiles, float64 or float32. The "
+            "background (an image or one value per image) is subtracted from every "
+            "pixel and the difference multiplied by the gain image while the bins are "
+            "summed. With hot_pixel_sigma > 0, pixels more than hot_pixel_sigma "
+            "standard deviations above the median of their bin are rejected.",
+            py::arg("sed_data"), py::arg("n_threads") = 1, py::arg("dtype") = "float64",
+            py::arg("background") = py::none(), py::arg("gain") = py::none(),
+            py::arg("hot_pixel_sigma") = 0.0)
+        .def("integrate_centered", &CrownIntegrationPlan::integrate_centered,
+            "Performs crown integration on a stack of uncentered 2D detector images, "
+            "with each crown placed around the image's beam center. If frame_indices "
+            "is given, only those images are integrated. With subpixel, the images "
+            "are interpolated bilinearly at the fractional beam centers. The "
+            "corrections of integrate take a background and gain in detector shape.",
+            py::arg("sed_data"), py::arg("beam_centers"), py::arg("n_threads") = 1,
+            py::arg("frame_indices") = py::none(), py::arg("detector_mask") = py::none(),
+            py::arg("subpixel") = false, py::arg("dtype") = "float64",
+            py::arg("background") = py::none(), py::arg("gain") = py::none(),
+            py::arg("hot_pixel_sigma") = 0.0)
+        .def("integrate_harmonics", &CrownIntegrationPlan::integrate_harmonics,
+            "Like integrate, but also returns the given Fourier coefficients "
+            "(np.fft.fft convention) of every profile.",
+            py::arg("sed_data"), py::arg("orders") = std::vector<int>{0, 2},
+            py::arg("n_threads") = 1, py::arg("dtype") = "float64",
+            py::arg("background") = py::none(), py::arg("gain") = py::none(),
+            py::arg("hot_pixel_sigma") = 0.0)
+        .def("integrate_centered_harmonics", &CrownIntegrationPlan::integrate_centered_harmonics,
+            "Like integrate_centered, but also returns the given Fourier coefficients "
+            "(np.fft.fft convention) of every profile.",
+            py::arg("sed_data"), py::arg("beam_centers"),
+            py::arg("orders") = std::vector<int>{0, 2}, py::arg("n_threads") = 1,
+            py::arg("frame_indices") = py::none(), py::arg("detector_mask") = py::none(),
+            py::arg("subpixel") = false, py::arg("dtype") = "float64",
+            py::arg("background") = py::none(), py::arg("gain") = py::none(),
+            py::arg("hot_pixel_sigma") = 0.0)
+        .def("cake", &CrownIntegrationPlan::cake,
+            "Sums (float32) and numbers (int32) of the unmasked pixels of every bin "
+            "of a stack of centered images, in the shape of the profiles.",
+            py::arg("sed_data"), py::arg("n_threads") = 1)
+        .def("cake_centered", &CrownIntegrationPlan::cake_centered,
+            "Like cake, for uncentered images with the options of integrate_centered.",
+            py::arg("sed_data"), py::arg("beam_centers"), py::arg("n_threads") = 1,
+            py::arg("frame_indices") = py::none(), py::arg("detector_mask") = py::none(),
+            py::arg("subpixel") = false)
+        .def("principal_components", &CrownIntegrationPlan::principal_components,
+            "Intensity-weighted PCA of the pixels inside the q range of every centered "
+            "image. Returns [orientation, anisotropy, aspect_ratio] per image.",
+            py::arg("sed_data"), py::arg("n_threads") = 1)
+        .def("principal_components_centered", &CrownIntegrationPlan::principal_components_centered,
+            "Like principal_components, for uncentered images with the q range "
+            "placed around each image's beam center.",
+            py::arg("sed_data"), py::arg("beam_centers"), py::arg("n_threads") = 1,
+            py::arg("frame_indices") = py::none(), py::arg("detector_mask") = py::none())
+        .def("bin_indices", &CrownIntegrationPlan::bin_indices,
+            "Returns the phi bin of every pixel (-1 outside of the q range).")
+        .def("csr_arrays", &CrownIntegrationPlan::csr_arrays,
+            "The pixel list as (bin_starts, pixel_offsets, bin_slots) arrays. The pixels "
+            "of bin i are pixel_offsets[bin_starts[i]:bin_starts[i + 1]] (flat indices "
+            "in the plan shape), written to entry bin_slots[i] of a flattened profile.")
+        .def_property_readonly("n_pixels", &CrownIntegrationPlan::n_pixels,
+            "Number of detector pixels inside the q range.")
+        .def_property_readonly("profile_size", &CrownIntegrationPlan::profile_size,
+            "Number of values of a profile, n_rings * n_phi_bins.")
+        .def_property_readonly("shape", [](const CrownIntegrationPlan& plan) {
+            return std::make_tuple(plan.nQY, plan.nQX);
+        })
+        .def_readonly("n_phi_bins", &CrownIntegrationPlan::nPhiBins)
+        .def_readonly("q_range", &CrownIntegrationPlan::QRange)
+        .def_readonly("multi_ring", &CrownIntegrationPlan::multiRing)
+        .def_readonly("ring_phi_bins", &CrownIntegrationPlan::ringPhiBins)
+        .def_readonly("q_ranges", &CrownIntegrationPlan::ringQRanges)
+        .def_readonly("q_callibration", &CrownIntegrationPlan::qCallibration);
+
     // Bind the 4D masked function
     m.def("compute_crown_integral", &compute_crown_integral,
-        "Performs crown integration on a stack 2D detector images.");
+        "Performs crown integration on a stack 2D detector images.",
+        py::arg("sed_data"), py::arg("n_phi_bins"), py::arg("q_range"),
+        py::arg("q_callibration"), py::arg("n_threads") = 1, py::arg("mask") = py::none(),
+        py::arg("dtype") = "float64", py::arg("background") = py::none(),
+        py::arg("gain") = py::none(), py::arg("hot_pixel_sigma") = 0.0);
+    m.def("compute_crown_integral", &compute_multi_ring_integral,
+        "Performs crown integration of several rings in one pass, with a list of "
+        "n_phi_bins and q_range per ring.",
+        py::arg("sed_data"), py::arg("n_phi_bins"), py::arg("q_range"),
+        py::arg("q_callibration"), py::arg("n_threads") = 1, py::arg("mask") = py::none(),
+        py::arg("dtype") = "float64", py::arg("background") = py::none(),
+        py::arg("gain") = py::none(), py::arg("hot_pixel_sigma") = 0.0);
+    m.def("kernel_counters", &biosed::kernel_counters_dict,
+        "Cumulative counters of the kernels of the module, by kernel name.");
 }
@@ -0,0 +1,94 @@
+/* harmonics.cpp
+ *
+ *
+ * Copyright (C) 2024 Tine Kalac
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Python binding libraries
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+#include <pybind11/complex.h>
+
+#include "parallel.h"
+#include "harmonics.h"
+#include "kernel_stats.h"
+
+#include <complex>
+#include <vector>
+
+// Namespace required by Pybind11
+namespace py = pybind11;
+
+/// Computes selected circular harmonics of every azimuthal profile.
+py::array_t<std::complex<double>> compute_harmonics(
+    py::array_t<double> aziIntensitiesArray,  // (nProfiles, nPhiBins)
+    std::vector<int> orders,                  // Harmonic orders to compute
+    int nThreads                              // Number of threads (0 = all cores)
+) {
+    py::buffer_info bufIntensities = aziIntensitiesArray.request();
+
+    // Data checks
+    if (bufIntensities.ndim != 2) {
+        throw std::runtime_error("Input should be a 2D NumPy array. The shape "
+            "should be (nProfiles, nPhiBins)");
+    }
+    if (!(aziIntensitiesArray.flags() & py::array::c_style)) {
+        throw std::runtime_error("Input arrays must be C-contiguous.");
+    }
+
+    py::ssize_t nProfiles = bufIntensities.shape[0];
+    py::ssize_t nPhiBins = bufIntensities.shape[1];
+    biosed::HarmonicTable table(nPhiBins, orders);
+
+    // Initialize the output
+    auto coefficientsArray = py::array_t<std::complex<double>>(
+        std::vector<py::ssize_t>{nProfiles, table.nOrders});
+    std::complex<double>* coefficients = coefficientsArray.mutable_data();
+    const double* aziIntensities = static_cast<const double*>(bufIntensities.ptr);
+
+    auto projectProfiles = [&](int, std::ptrdiff_t profileBegin, std::ptrdiff_t profileEnd) {
+        for (py::ssize_t iProfile = profileBegin; iProfile < profileEnd; ++iProfile) {
+            table.project(aziIntensities + iProfile * nPhiBins,
+                          coefficients + iProfile * table.nOrders);
+        }
+    };
+
+    biosed::ParallelStats stats;
+    {
+        py::gil_scoped_release release;
+        biosed::parallel_for(nProfiles, nThreads, projectProfiles, 0, &stats);
+    }
+    biosed::record_kernel("compute_harmonics", stats, nProfiles,
+                          static_cast<int64_t>(nProfiles) * nPhiBins);
+
+    return coefficientsArray;
+}
+
+
+// Pybind11 module definition
+PYBIND11_MODULE(harmonics, m) {
+    // Optional docstring for the module
+    m.doc() = "Circular harmonics of azimuthal intensity profiles.";
+
+    m.def("compute_harmonics", &compute_harmonics,
+        "Computes the given Fourier coefficients (np.fft.fft convention) of every "
+        "azimuthal intensity profile.",
+        py::arg("azi_intensities"), py::arg("orders") = std::vector<int>{2},
+        py::arg("n_threads") = 1);
+    m.def("kernel_counters", &biosed::kernel_counters_dict,
+        "Cumulative counters of the kernels of the module, by kernel name.");
+}
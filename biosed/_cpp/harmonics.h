@@ -0,0 +1,95 @@
+/* harmonics.h
+ *
+ *
+ * Copyright (C) 2024 Tine Kalac
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Circular harmonics of azimuthal profiles, shared by the harmonic
+// analysis and crown integration extensions. Like parallel.h, nothing in
+// here touches the Python API.
+
+#ifndef BIOSED_HARMONICS_H
+#define BIOSED_HARMONICS_H
+
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+namespace biosed {
+
+/// Selected coefficients of the discrete Fourier transform of profiles
+/// with nPhiBins bins. Coefficient k is sum_b I[b] exp(-2 pi i k b / nPhiBins),
+/// the same convention as np.fft.fft, but only the requested orders are
+/// computed, as projections onto precomputed cos/sin tables.
+class HarmonicTable {
+public:
+    HarmonicTable(std::ptrdiff_t nPhiBins, const std::vector<int>& orders)
+        : nPhiBins(checked_phi_bins(nPhiBins)),
+          nOrders(static_cast<std::ptrdiff_t>(orders.size())),
+          cosTable(orders.size() * nPhiBins), sinTable(orders.size() * nPhiBins) {
+
+        for (std::ptrdiff_t iOrder = 0; iOrder < nOrders; ++iOrder) {
+            if (orders[iOrder] < 0) {
+                throw std::runtime_error("Harmonic orders should not be negative.");
+            }
+            // The angle is reduced to one period first, so high orders
+            // are as accurate as low ones
+            for (std::ptrdiff_t iPhiBin = 0; iPhiBin < nPhiBins; ++iPhiBin) {
+                std::ptrdiff_t period = (orders[iOrder] * iPhiBin) % nPhiBins;
+                double angle = 2.0 * 3.14159265358979323846 * period / nPhiBins;
+                cosTable[iOrder * nPhiBins + iPhiBin] = std::cos(angle);
+                sinTable[iOrder * nPhiBins + iPhiBin] = -std::sin(angle);
+            }
+        }
+    }
+
+    /// Writes the nOrders coefficients of a single (float or double) profile
+    /// into coefficients.
+    template <typename Profile>
+    void project(const Profile* profile, std::complex<double>* coefficients) const {
+        for (std::ptrdiff_t iOrder = 0; iOrder < nOrders; ++iOrder) {
+            const double* cosRow = cosTable.data() + iOrder * nPhiBins;
+            const double* sinRow = sinTable.data() + iOrder * nPhiBins;
+            double real = 0.0, imag = 0.0;
+            for (std::ptrdiff_t iPhiBin = 0; iPhiBin < nPhiBins; ++iPhiBin) {
+                real += profile[iPhiBin] * cosRow[iPhiBin];
+                imag += profile[iPhiBin] * sinRow[iPhiBin];
+            }
+            coefficients[iOrder] = std::complex<double>(real, imag);
+        }
+    }
+
+    std::ptrdiff_t nPhiBins, nOrders;
+
+private:
+    // Called from the initializer list, so a bad bin count is rejected
+    // before the tables are allocated
+    static std::ptrdiff_t checked_phi_bins(std::ptrdiff_t nPhiBins) {
+        if (nPhiBins <= 0) {
+            throw std::runtime_error("The number of phi bins should be positive.");
+        }
+        return nPhiBins;
+    }
+
+    std::vector<double> cosTable;   // (nOrders, nPhiBins)
+    std::vector<double> sinTable;   // (nOrders, nPhiBins), already negated
+};
+
+}  // namespace biosed
+
+#endif  // BIOSED_HARMONICS_H
@@ -0,0 +1,99 @@
+/* kernel_stats.h
+ *
+ *
+ * Copyright (C) 2024 Tine Kalac
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Cumulative counters of the kernels of an extension module, for the
+// instrumentation of the pipeline (see biosed/instrumentation.py). Every
+// extension module has its own counters. The counters are only updated
+// once per kernel call, never from the inner loops.
+
+#ifndef BIOSED_KERNEL_STATS_H
+#define BIOSED_KERNEL_STATS_H
+
+#include <pybind11/pybind11.h>
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "parallel.h"
+
+namespace biosed {
+
+/// Totals over all calls of a kernel.
+struct KernelCounters {
+    int64_t calls = 0;
+    int64_t frames = 0;             // Images (or profiles) processed
+    int64_t pixelsVisited = 0;      // Pixels in the scope of the kernel
+    int64_t pixelsSkipped = 0;      // Of these, masked, off the detector, not scanned or rejected
+    int64_t fullScans = 0;          // Full detector scans of the windowed beam finding
+    double wallSeconds = 0.0;       // Time in the parallel section
+    double busySeconds = 0.0;       // Time the workers spent working
+    double threadSeconds = 0.0;     // wallSeconds times the number of threads
+};
+
+inline std::map<std::string, KernelCounters>& kernel_counters() {
+    static std::map<std::string, KernelCounters> counters;
+    return counters;
+}
+
+inline std::mutex& kernel_counters_mutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+/// Adds a kernel call to the counters. Kernels may run concurrently from
+/// several Python threads, so the counters are locked.
+inline void record_kernel(const std::string& kernel, const ParallelStats& stats,
+                          int64_t frames, int64_t pixelsVisited = 0,
+                          int64_t pixelsSkipped = 0, int64_t fullScans = 0) {
+    std::lock_guard<std::mutex> lock(kernel_counters_mutex());
+    KernelCounters& counters = kernel_counters()[kernel];
+    counters.calls++;
+    counters.frames += frames;
+    counters.pixelsVisited += pixelsVisited;
+    counters.pixelsSkipped += pixelsSkipped;
+    counters.fullScans += fullScans;
+    counters.wallSeconds += stats.wallSeconds;
+    counters.busySeconds += stats.busySeconds;
+    counters.threadSeconds += stats.wallSeconds * stats.nThreads;
+}
+
+/// The counters of every kernel of the module as a dict of dicts.
+inline pybind11::dict kernel_counters_dict() {
+    std::lock_guard<std::mutex> lock(kernel_counters_mutex());
+    pybind11::dict result;
+    for (const auto& [kernel, counters] : kernel_counters()) {
+        pybind11::dict entry;
+        entry["calls"] = counters.calls;
+        entry["frames"] = counters.frames;
+        entry["pixels_visited"] = counters.pixelsVisited;
+        entry["pixels_skipped"] = counters.pixelsSkipped;
+        entry["full_scans"] = counters.fullScans;
+        entry["wall_seconds"] = counters.wallSeconds;
+        entry["busy_seconds"] = counters.busySeconds;
+        entry["thread_seconds"] = counters.threadSeconds;
+        result[kernel.c_str()] = entry;
+    }
+    return result;
+}
+
+}  // namespace biosed
+
+#endif  // BIOSED_KERNEL_STATS_H
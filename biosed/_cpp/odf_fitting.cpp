@@ -0,0 +1,402 @@
+/* odf_fitting.cpp
+ *
+ *
+ * Copyright (C) 2024 Tine Kalac
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Python binding libraries
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+
+#include "parallel.h"
+#include "kernel_stats.h"
+
+// Math stuff
+#define M_PI 3.14159265358979323846
+#include <cmath>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <limits>
+#include <optional>
+#include <vector>
+#include <tuple>
+
+// Namespace required by Pybind11
+namespace py = pybind11;
+
+///// PARAMETER BOUNDS /////
+
+// The bounds are handled like in lmfit (MINUIT): the fit runs on
+// unbounded internal parameters that are mapped onto the bounded ones, so
+// results agree with orientation.fit_poisson_odf's lmfit backend.
+struct Bounds {
+    double min, max;   // max = inf for parameters with only a lower bound
+
+    double to_external(double internal) const {
+        if (std::isinf(max)) return min - 1.0 + std::sqrt(internal * internal + 1.0);
+        return min + (std::sin(internal) + 1.0) * (max - min) / 2.0;
+    }
+
+    // Derivative of to_external
+    double gradient(double internal) const {
+        if (std::isinf(max)) return internal / std::sqrt(internal * internal + 1.0);
+        return std::cos(internal) * (max - min) / 2.0;
+    }
+
+    double to_internal(double external) const {
+        external = std::max(external, min);
+        if (std::isinf(max)) return std::sqrt((external - min + 1.0) * (external - min + 1.0) - 1.0);
+        external = std::min(external, max);
+        return std::asin(std::clamp(2.0 * (external - min) / (max - min) - 1.0, -1.0, 1.0));
+    }
+};
+
+///// MODEL /////
+
+// Poisson kernel orientation distribution function, see orientation.poisson_odf.
+// params = (phi_0, eta, C). Writes the partial derivatives into gradient.
+static inline double poisson_odf(double phi, const std::array<double, 3>& params,
+                                 std::array<double, 3>& gradient) {
+    const double phi0 = params[0], eta = params[1], C = params[2];
+    const double c = std::cos(phi - phi0), s = std::sin(phi - phi0);
+    const double numerator = 1.0 - eta * eta;
+    const double denominator = (1.0 + eta) * (1.0 + eta) - 4.0 * eta * c * c;
+    const double kernel = numerator / denominator;
+
+    gradient[0] = 8.0 * C * numerator * eta * c * s / (denominator * denominator);
+    gradient[1] = C * (-2.0 * eta * denominator
+                       - numerator * (2.0 * (1.0 + eta) - 4.0 * c * c))
+                  / (denominator * denominator);
+    gradient[2] = kernel;
+    return C * kernel;
+}
+
+// Solves the 3x3 system A x = b with partial pivoting. Returns false if A
+// is singular.
+static bool solve3(std::array<std::array<double, 3>, 3> A, std::array<double, 3> b,
+                   std::array<double, 3>& x) {
+    for (int col = 0; col < 3; ++col) {
+        int pivot = col;
+        for (int row = col + 1; row < 3; ++row) {
+            if (std::abs(A[row][col]) > std::abs(A[pivot][col])) pivot = row;
+        }
+        if (A[pivot][col] == 0.0 || !std::isfinite(A[pivot][col])) return false;
+        std::swap(A[col], A[pivot]);
+        std::swap(b[col], b[pivot]);
+        for (int row = col + 1; row < 3; ++row) {
+            double factor = A[row][col] / A[col][col];
+            for (int k = col; k < 3; ++k) A[row][k] -= factor * A[col][k];
+            b[row] -= factor * b[col];
+        }
+    }
+    for (int row = 2; row >= 0; --row) {
+        double sum = b[row];
+        for (int k = row + 1; k < 3; ++k) sum -= A[row][k] * x[k];
+        x[row] = sum / A[row][row];
+    }
+    return true;
+}
+
+///// LEVENBERG-MARQUARDT /////
+
+struct FitSettings {
+    std::array<Bounds, 3> bounds;
+    int maxIterations;
+};
+
+// Fits a single profile. phi, intensity and weight hold the nValid points
+// that take part in the fit. params holds the initial values on input and
+// the fitted values on output. Returns the number of iterations.
+static int fit_profile(const double* phi, const double* intensity, const double* weight,
+                       py::ssize_t nValid, const FitSettings& settings,
+                       std::array<double, 3>& params) {
+    const double ftol = 1e-10, xtol = 1e-10;
+
+    std::array<double, 3> internal, external, gradient;
+
+    // C enters the model linearly, so its best value for the initial phi_0
+    // and eta is known in closed form. Starting from it keeps the first
+    // steps from overshooting when the initial C is far off.
+    double sumKernelIntensity = 0.0, sumKernelSquared = 0.0;
+    std::array<double, 3> shape = {params[0], params[1], 1.0};
+    for (py::ssize_t i = 0; i < nValid; ++i) {
+        double kernel = poisson_odf(phi[i], shape, gradient);
+        sumKernelIntensity += weight[i] * weight[i] * kernel * intensity[i];
+        sumKernelSquared += weight[i] * weight[i] * kernel * kernel;
+    }
+    if (sumKernelSquared > 0.0 && sumKernelIntensity > 0.0) {
+        params[2] = sumKernelIntensity / sumKernelSquared;
+    }
+
+    for (int k = 0; k < 3; ++k) internal[k] = settings.bounds[k].to_internal(params[k]);
+
+    auto to_external = [&](const std::array<double, 3>& p) {
+        std::array<double, 3> e;
+        for (int k = 0; k < 3; ++k) e[k] = settings.bounds[k].to_external(p[k]);
+        return e;
+    };
+
+    auto cost_of = [&](const std::array<double, 3>& p) {
+        std::array<double, 3> e = to_external(p), g;
+        double cost = 0.0;
+        for (py::ssize_t i = 0; i < nValid; ++i) {
+            double residual = weight[i] * (poisson_odf(phi[i], e, g) - intensity[i]);
+            cost += residual * residual;
+        }
+        return cost;
+    };
+
+    double cost = cost_of(internal);
+    double lambda = 1e-3;
+    int iteration = 0;
+
+    for (; iteration < settings.maxIterations; ++iteration) {
+        // Normal equations of the weighted residuals in internal parameters
+        external = to_external(internal);
+        std::array<double, 3> chain;
+        for (int k = 0; k < 3; ++k) chain[k] = settings.bounds[k].gradient(internal[k]);
+
+        std::array<std::array<double, 3>, 3> JtJ = {};
+        std::array<double, 3> Jtr = {};
+        for (py::ssize_t i = 0; i < nValid; ++i) {
+            double residual = weight[i] * (poisson_odf(phi[i], external, gradient) - intensity[i]);
+            std::array<double, 3> J;
+            for (int k = 0; k < 3; ++k) J[k] = weight[i] * gradient[k] * chain[k];
+            for (int a = 0; a < 3; ++a) {
+                Jtr[a] += J[a] * residual;
+                for (int b = 0; b < 3; ++b) JtJ[a][b] += J[a] * J[b];
+            }
+        }
+
+        // Increase the damping until the step lowers the cost
+        bool accepted = false, converged = false;
+        while (!accepted && lambda < 1e16) {
+            std::array<std::array<double, 3>, 3> A = JtJ;
+            for (int k = 0; k < 3; ++k) A[k][k] += lambda * std::max(JtJ[k][k], 1e-30);
+            std::array<double, 3> step, minusJtr = {-Jtr[0], -Jtr[1], -Jtr[2]};
+
+            if (!solve3(A, minusJtr, step)) {
+                lambda *= 10.0;
+                continue;
+            }
+
+            std::array<double, 3> trial;
+            double stepNorm = 0.0, paramNorm = 0.0;
+            for (int k = 0; k < 3; ++k) {
+                trial[k] = internal[k] + step[k];
+                stepNorm += step[k] * step[k];
+                paramNorm += internal[k] * internal[k];
+            }
+
+            double trialCost = cost_of(trial);
+            if (std::isfinite(trialCost) && trialCost <= cost) {
+                converged = (cost - trialCost <= ftol * cost)
+                         || (std::sqrt(stepNorm) <= xtol * (std::sqrt(paramNorm) + xtol));
+                internal = trial;
+                cost = trialCost;
+                lambda = std::max(lambda / 10.0, 1e-12);
+                accepted = true;
+            } else {
+                lambda *= 10.0;
+            }
+        }
+
+        if (!accepted || converged) {
+            ++iteration;
+            break;
+        }
+    }
+
+    params = to_external(internal);
+    return iteration;
+}
+
+// Number of consecutive profiles that are warm-started from their
+// neighbor. The first profile of every block starts from its own initial
+// values, which makes blocks independent units of parallel work and keeps
+// the results independent of the number of threads.
+static const py::ssize_t kWarmStartBlockSize = 256;
+
+// A fit is used as the starting point of its neighbor if it did not end on
+// a bound of phi_0 or eta, which usually means it did not converge.
+static bool usable_as_start(const std::array<double, 3>& params, const FitSettings& settings) {
+    for (int k = 0; k < 2; ++k) {
+        const Bounds& bounds = settings.bounds[k];
+        double tolerance = 1e-6 * (bounds.max - bounds.min);
+        if (!std::isfinite(params[k]) || params[k] - bounds.min < tolerance
+            || bounds.max - params[k] < tolerance) {
+            return false;
+        }
+    }
+    return std::isfinite(params[2]);
+}
+
+/// Fits the Poisson ODF to every azimuthal intensity profile.
+py::object fit_poisson_odf(
+    py::array_t<double> aziIntensitiesArray,  // (nProfiles, nPhiBins)
+    py::array_t<double> phiArray,             // (nPhiBins) in radians
+    double weightExponent,                    // weights = intensity**exponent
+    std::tuple<double, double> etaLimits,     // Bounds of eta
+    int maxIterations,                        // Iteration limit per profile
+    int nThreads,                             // Number of threads (0 = all cores)
+    // (nProfiles, 3) initial (phi_0, eta, C) of every profile (optional)
+    std::optional<py::array_t<double>> initialParamsArray,
+    bool warmStart,                           // Start from the previous profile's fit
+    bool returnIterations                     // Also return the iteration counts
+) {
+    py::buffer_info bufIntensities = aziIntensitiesArray.request();
+    py::buffer_info bufPhi = phiArray.request();
+
+    // Data checks
+    if (bufIntensities.ndim != 2) {
+        throw std::runtime_error("Input should be a 2D NumPy array. The shape "
+            "should be (nProfiles, nPhiBins)");
+    }
+    if (bufPhi.ndim != 1 || bufPhi.shape[0] != bufIntensities.shape[1]) {
+        throw std::runtime_error("phi should be a 1D array with one value per phi bin.");
+    }
+    if (!(aziIntensitiesArray.flags() & py::array::c_style)
+        || !(phiArray.flags() & py::array::c_style)) {
+        throw std::runtime_error("Input arrays must be C-contiguous.");
+    }
+
+    py::ssize_t nProfiles = bufIntensities.shape[0];
+    py::ssize_t nPhiBins = bufIntensities.shape[1];
+
+    const double* initialParams = nullptr;
+    if (initialParamsArray) {
+        py::buffer_info bufInitial = initialParamsArray->request();
+        if (bufInitial.ndim != 2 || bufInitial.shape[0] != nProfiles || bufInitial.shape[1] != 3) {
+            throw std::runtime_error("Initial parameters should have shape (nProfiles, 3).");
+        }
+        if (!(initialParamsArray->flags() & py::array::c_style)) {
+            throw std::runtime_error("Input arrays must be C-contiguous.");
+        }
+        initialParams = static_cast<const double*>(bufInitial.ptr);
+    }
+
+    FitSettings settings;
+    settings.bounds = {Bounds{0.0, M_PI},
+                       Bounds{std::get<0>(etaLimits), std::get<1>(etaLimits)},
+                       Bounds{0.0, std::numeric_limits<double>::infinity()}};
+    settings.maxIterations = maxIterations;
+
+    // Initialize the output
+    auto fittingResultsArray
+        = py::array_t<double>(std::vector<py::ssize_t>{nProfiles, 3});
+    auto iterationsArray = py::array_t<int32_t>(std::vector<py::ssize_t>{nProfiles});
+    double* fittingResults = fittingResultsArray.mutable_data();
+    int32_t* iterations = iterationsArray.mutable_data();
+    const double* aziIntensities = static_cast<const double*>(bufIntensities.ptr);
+    const double* phi = static_cast<const double*>(bufPhi.ptr);
+
+    // Warm-started profiles are fitted in order within fixed-size blocks
+    py::ssize_t blockSize = warmStart ? kWarmStartBlockSize : 1;
+    py::ssize_t nBlocks = (nProfiles + blockSize - 1) / blockSize;
+
+    int nWorkers = biosed::resolve_n_threads(nThreads, nBlocks);
+    std::vector<std::vector<double>> scratch(nWorkers, std::vector<double>(3 * nPhiBins));
+
+    // Non-finite bins of all profiles, for the kernel counters
+    std::atomic<int64_t> invalidBins{0};
+
+    auto fitBlocks = [&](int iThread, std::ptrdiff_t blockBegin, std::ptrdiff_t blockEnd) {
+        int64_t blockInvalidBins = 0;
+        double* validPhi = scratch[iThread].data();
+        double* validIntensity = validPhi + nPhiBins;
+        double* validWeight = validIntensity + nPhiBins;
+
+        for (py::ssize_t iBlock = blockBegin; iBlock < blockEnd; ++iBlock) {
+            py::ssize_t profileBegin = iBlock * blockSize;
+            py::ssize_t profileEnd = std::min(profileBegin + blockSize, nProfiles);
+            bool previousUsable = false;
+            std::array<double, 3> previous;
+
+            for (py::ssize_t iProfile = profileBegin; iProfile < profileEnd; ++iProfile) {
+                const double* profile = aziIntensities + iProfile * nPhiBins;
+
+                // Points with non-finite residuals are omitted like nan_policy='omit'
+                py::ssize_t nValid = 0;
+                for (py::ssize_t iPhiBin = 0; iPhiBin < nPhiBins; ++iPhiBin) {
+                    double weight = std::pow(profile[iPhiBin], weightExponent);
+                    if (!std::isfinite(profile[iPhiBin]) || !std::isfinite(weight)) continue;
+                    validPhi[nValid] = phi[iPhiBin];
+                    validIntensity[nValid] = profile[iPhiBin];
+                    validWeight[nValid] = weight;
+                    nValid++;
+                }
+                blockInvalidBins += nPhiBins - nValid;
+
+                std::array<double, 3> params = {M_PI / 2.0, 0.5, 1.0};
+                if (warmStart && previousUsable) {
+                    params = previous;
+                } else if (initialParams) {
+                    std::copy(initialParams + 3 * iProfile, initialParams + 3 * iProfile + 3,
+                              params.begin());
+                }
+
+                double* result = fittingResults + 3 * iProfile;
+                if (nValid < 3) {
+                    result[0] = result[1] = result[2] = std::numeric_limits<double>::quiet_NaN();
+                    iterations[iProfile] = 0;
+                    previousUsable = false;
+                    continue;
+                }
+
+                iterations[iProfile] = fit_profile(validPhi, validIntensity, validWeight,
+                                                   nValid, settings, params);
+                std::copy(params.begin(), params.end(), result);
+
+                previous = params;
+                previousUsable = usable_as_start(params, settings);
+            }
+        }
+        invalidBins += blockInvalidBins;
+    };
+
+    biosed::ParallelStats stats;
+    {
+        py::gil_scoped_release release;
+        biosed::parallel_for(nBlocks, nWorkers, fitBlocks, 1, &stats);
+    }
+    biosed::record_kernel(warmStart ? "fit_poisson_odf_warm_start" : "fit_poisson_odf", stats,
+                          nProfiles, static_cast<int64_t>(nProfiles) * nPhiBins, invalidBins);
+
+    if (returnIterations) {
+        return py::make_tuple(fittingResultsArray, iterationsArray);
+    }
+    return fittingResultsArray;
+}
+
+
+// Pybind11 module definition
+PYBIND11_MODULE(odf_fitting, m) {
+    // Optional docstring for the module
+    m.doc() = "Batched Levenberg-Marquardt fitting of orientation distribution functions.";
+
+    m.def("fit_poisson_odf", &fit_poisson_odf,
+        "Fits the Poisson ODF (phi_0, eta, C) to every azimuthal intensity profile. "
+        "Fits start from initial_params (or phi_0 = pi/2, eta = 0.5), or with "
+        "warm_start from the converged fit of the previous profile.",
+        py::arg("azi_intensities"), py::arg("phi"), py::arg("weight_exponent"),
+        py::arg("eta_limits"), py::arg("max_iterations") = 200,
+        py::arg("n_threads") = 1, py::arg("initial_params") = py::none(),
+        py::arg("warm_start") = false, py::arg("return_iterations") = false);
+    m.def("kernel_counters", &biosed::kernel_counters_dict,
+        "Cumulative counters of the kernels of the module, by kernel name.");
+}
@@ -0,0 +1,136 @@
+/* parallel.h
+ *
+ *
+ * Copyright (C) 2024 Tine Kalac
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Small threading helpers shared by the C++ extensions. None of these touch
+// the Python API, so they can be used while the GIL is released.
+
+#ifndef BIOSED_PARALLEL_H
+#define BIOSED_PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <thread>
+#include <vector>
+
+namespace biosed {
+
+/// Number of worker threads used for nTasks. Values below 1 select all
+/// hardware threads. There is never more than one thread per task.
+inline int resolve_n_threads(int nThreads, std::ptrdiff_t nTasks) {
+    if (nThreads < 1) {
+        nThreads = static_cast<int>(std::thread::hardware_concurrency());
+    }
+    if (nThreads < 1) nThreads = 1;
+    if (nTasks < nThreads) {
+        nThreads = static_cast<int>(std::max<std::ptrdiff_t>(nTasks, 1));
+    }
+    return nThreads;
+}
+
+/// Timing of a parallel_for. busySeconds is the time all workers spent in
+/// body, so busySeconds / (wallSeconds * nThreads) is the thread
+/// utilization.
+struct ParallelStats {
+    int nThreads = 0;
+    double wallSeconds = 0.0;
+    double busySeconds = 0.0;
+};
+
+/// Seconds since start on the steady clock.
+inline double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/// Runs body(iThread, begin, end) over [0, nTasks) on nThreads threads.
+/// The task range is handed out in blocks of grainSize on demand, so a
+/// thread can be called several times with different blocks. iThread is
+/// in [0, resolve_n_threads(nThreads, nTasks)) and can be used to index
+/// per-thread scratch buffers. Exceptions thrown by any worker are rethrown
+/// in the calling thread once all workers have finished. If stats is
+/// given, the wall time and the busy time of the workers are written to it.
+template <typename Body>
+void parallel_for(std::ptrdiff_t nTasks, int nThreads, Body&& body,
+                  std::ptrdiff_t grainSize = 0, ParallelStats* stats = nullptr) {
+    if (nTasks <= 0) return;
+    nThreads = resolve_n_threads(nThreads, nTasks);
+    const auto start = std::chrono::steady_clock::now();
+
+    // The serial path runs in the calling thread without any overhead
+    if (nThreads == 1) {
+        body(0, std::ptrdiff_t(0), nTasks);
+        if (stats) {
+            stats->nThreads = 1;
+            stats->wallSeconds = stats->busySeconds = seconds_since(start);
+        }
+        return;
+    }
+
+    // A few blocks per thread keeps the load balanced without contention
+    if (grainSize < 1) {
+        grainSize = std::max<std::ptrdiff_t>(1, nTasks / (8 * nThreads));
+    }
+
+    std::atomic<std::ptrdiff_t> nextTask(0);
+    std::vector<std::exception_ptr> errors(nThreads);
+    std::vector<double> busySeconds(nThreads, 0.0);
+    std::vector<std::thread> workers;
+    workers.reserve(nThreads);
+
+    for (int iThread = 0; iThread < nThreads; ++iThread) {
+        workers.emplace_back([&, iThread]() {
+            try {
+                while (true) {
+                    std::ptrdiff_t begin = nextTask.fetch_add(grainSize);
+                    if (begin >= nTasks) break;
+                    std::ptrdiff_t end = std::min(begin + grainSize, nTasks);
+                    if (stats) {
+                        const auto blockStart = std::chrono::steady_clock::now();
+                        body(iThread, begin, end);
+                        busySeconds[iThread] += seconds_since(blockStart);
+                    } else {
+                        body(iThread, begin, end);
+                    }
+                }
+            } catch (...) {
+                errors[iThread] = std::current_exception();
+                nextTask.store(nTasks);  // Stops the other workers early
+            }
+        });
+    }
+
+    for (auto& worker : workers) worker.join();
+
+    if (stats) {
+        stats->nThreads = nThreads;
+        stats->wallSeconds = seconds_since(start);
+        stats->busySeconds = 0.0;
+        for (double threadSeconds : busySeconds) stats->busySeconds += threadSeconds;
+    }
+
+    for (auto& error : errors) {
+        if (error) std::rethrow_exception(error);
+    }
+}
+
+}  // namespace biosed
+
+#endif  // BIOSED_PARALLEL_H
@@ -17,8 +17,19 @@
 # You should have received a copy of the GNU General Public License
 # along with this program. If not, see <https://www.gnu.org/licenses/>.
 
-from biosed import io, masking, preprocess, integration, orientation, visualize, utilities
+import os
+import time
+import numpy as np
+
+from biosed import io, preprocess, integration, orientation, visualize, utilities, distributed
 from .config import config
+from .instrumentation import PipelineReport
+from .cache import ResultCache, hash_values
+
+# Bytes of memory needed per detector pixel of a streamed frame: the int16
+# frame and the prefetched int16 frame of the next chunk. The detector mask
+# is applied by the kernels, so no per-frame mask is made.
+_STREAMING_BYTES_PER_PIXEL = 4
 
 
 class AnalysisPipeline:
@@ -29,88 +40,540 @@ class AnalysisPipeline:
         self.data_masked = None
         self.beam_centers = None
         self.valid_frames = None
+        self.frame_indices = None
         self.scan_shape = None
         self.data_trimmed = None
         self.format_shape = None
         self.beam_centers_valid = None
         self.azi_intensity_profiles = None
         self.orientation_image = None
+        self.azi_intensity = None
+        self.phi_values = None
+        self.orientation_map = None
+        self.alignment_map = None
 
         # Analysis parameters
         self.scan_limits = None
         self.orientation_method = config.get("analyze.orientation_method")
         self.azi_resolution = config.get("integration.n_phi_bins")
 
-    def load_data(self, data_directory):
+        # Streaming mode keeps only the beam centers and profiles in memory
+        self.streaming = config.get("analyze.streaming")
+        self.memory_budget = config.get("analyze.memory_budget")
+
+        # Distributed mode splits the frames over processes or MPI ranks
+        self.distributed = config.get("analyze.distributed")
+        self.data_directory = None
+        self._azi_intensity_all = None
+        self._streamed_parameters = None
+
+        # Wall time, memory and throughput of every stage
+        self.report = PipelineReport()
+        self.trace_file = config.get("analyze.trace_file")
+
+        # Beam centers, scan geometry and profiles are kept on disk between
+        # runs if a cache directory is set
+        self.cache_directory = config.get("analyze.cache_directory")
+        self.cache = None
+        self._beam_key = None
+
+        # Results are saved here at the end of map_orientation. Streaming and
+        # live mode append the per-frame results as they are computed.
+        self.output_file = config.get("analyze.output_file")
+
+        # Coarse results of preview, from binned and subsampled frames
+        self.preview_results = None
+
+    def _beam_parameters(self):
+        """
+        Parameters of the beam finding, from the current config.
+        """
+        return {"direct_beam_threshold": config.get("preprocess.direct_beam_threshold"),
+                "window_radius": config.get("preprocess.beam_window_radius"),
+                "detector_mask": config.get("masking.detector_mask"),
+                "backend": config.get("parallel.backend")}
+
+    def _integration_parameters(self):
+        """
+        Parameters of the crown integration, from the current config.
+        """
+        return {"trimming_radius": config.get("preprocess.trim_radius"),
+                "n_phi_bins": self.azi_resolution,
+                "q_range": config.get("integration.q_range"),
+                "q_callibration": config.get("integration.q_callibration"),
+                "detector_mask": config.get("masking.detector_mask"),
+                "subpixel": config.get("integration.subpixel"),
+                "dtype": config.get("integration.dtype"),
+                "background": config.get("integration.background"),
+                "gain": config.get("integration.gain"),
+                "hot_pixel_sigma": config.get("integration.hot_pixel_sigma"),
+                "backend": config.get("parallel.backend")}
+
+    def _cached(self, stage, upstream_key, parameters, names, compute):
+        """
+        Results of a stage as a dict of the given names, loaded from the
+        cache or computed with compute() and stored. Returns (results, key),
+        where key is the cache key of the stage the downstream stages
+        depend on, or None without a cache.
+        """
+        if self.cache is None or not self.cache.enabled:
+            return compute(), None
+
+        key = ResultCache.key(stage, upstream_key, parameters)
+        results = self.cache.load(key, names)
+        if results is None:
+            results = compute()
+            self.cache.save(key, **results)
+        else:
+            print(f"Loaded {stage.replace('_', ' ')} from the cache.")
+        return results, key
+
+    def _load_frames(self):
+        """
+        Loads the frames of data_directory into memory.
+        """
         print("Loading data...")
-        self.data = io.load_data(data_directory)
+        with self.report.stage("load") as record:
+            self.data = io.load_data(self.data_directory)
+            record.update(n_frames = len(self.data), n_bytes = self.data.nbytes)
         print("...done!\n")
 
-        print("Masking data...")
-        self.data = masking.mask_data(self.data)  # Set invalid pixels to -1 and return masked array
-        print("...done!\n")
+    def load_data(self, data_directory):
+        """
+        Loads and finds the beam centers of a scan. data_directory is
+        a directory of detector images, or a stack of frames that is not
+        loaded into memory, such as io.open_raw or io.open_hdf5_stack. Such
+        stacks are always streamed. With a cache directory, the frames are
+        only loaded if a result that needs them is not in the cache.
+        """
+        self.data_directory = data_directory
+        if self.cache_directory is not None:
+            self.cache = ResultCache(self.cache_directory, data_directory)
 
-        print("Finding beam centers...")
-        self.beam_centers = preprocess.find_beam_centers(self.data)
-        print("...done!\n")
+        if self.distributed:
+            self.distribute_data(data_directory)
+            return
+
+        if self.streaming or not isinstance(data_directory, (str, os.PathLike)):
+            self.stream_data(data_directory)
+            return
+
+        # The kernels skip the pixels of the detector mask, the data is not modified
+        beam_parameters = self._beam_parameters()
+
+        def find_beam_centers():
+            if self.data is None:
+                self._load_frames()
+            print("Finding beam centers...")
+            with self.report.stage("beam_centers", n_frames = len(self.data), n_bytes = self.data.nbytes):
+                beam_centers = preprocess.find_beam_centers(self.data, **beam_parameters)
+            print("...done!\n")
+            return {"beam_centers": beam_centers}
+
+        results, self._beam_key = self._cached("beam_centers", self.cache and self.cache.data_key,
+                                               beam_parameters, ["beam_centers"], find_beam_centers)
+        self.beam_centers = results["beam_centers"]
+
+    def stream_data(self, data_directory):
+        """
+        Runs loading, beam finding, trimming and integration over
+        chunks of frames, so that only the beam centers and azimuthal
+        profiles of the scan are kept in memory. The chunk size is chosen
+        from memory_budget. data_directory can also be a stack of frames
+        (see load_data).
+        """
+        if isinstance(data_directory, (str, os.PathLike)):
+            file_paths = io.list_data_files(data_directory)
+            if len(file_paths) == 0:
+                raise Exception(f"No images found in {data_directory}")
+            n_images = len(file_paths)
+            frame_pixels = np.prod(io.load_files(file_paths[:1]).shape[1:])
+        else:
+            n_images = data_directory.shape[0]
+            if n_images == 0:
+                raise Exception(f"No images found in {data_directory}")
+            frame_pixels = np.prod(data_directory.shape[1:])
+
+        chunk_size = max(1, int(self.memory_budget // (frame_pixels * _STREAMING_BYTES_PER_PIXEL)))
+
+        # Memory-mapped and HDF5 stacks are read in whole HDF5 chunks
+        if not isinstance(data_directory, (str, os.PathLike)):
+            chunk_size = io.stack_chunk_size(data_directory, chunk_size)
+
+        beam_parameters = self._beam_parameters()
+        integration_parameters = self._integration_parameters()
+
+        def stream():
+            print(f"Streaming {n_images} frames in chunks of {chunk_size}...")
+            beam_centers = []
+            azi_intensity = []
+            writer = io.HDF5Writer(self.output_file) if self.output_file is not None else None
+            try:
+                # Reading, beam finding and integration overlap, so they are one stage
+                with self.report.stage("stream", n_frames = n_images, n_bytes = 2 * n_images * frame_pixels):
+                    for start, chunk in io.iterate_data_chunks(data_directory, chunk_size):
+                        chunk_beam_centers = preprocess.find_beam_centers(chunk, **beam_parameters)
+                        background = integration.chunk_background(
+                            integration_parameters["background"], chunk.shape[1:],
+                            start, start + len(chunk))
+                        chunk_azi_intensity, phi_values = integration.centered_crown_integration(
+                            chunk, chunk_beam_centers,
+                            **{**integration_parameters, "background": background})
+                        beam_centers.append(chunk_beam_centers)
+                        azi_intensity.append(chunk_azi_intensity)
+                        if writer is not None:
+                            self._append_frames(writer, start, chunk_beam_centers, chunk_azi_intensity)
+                        del chunk
+            finally:
+                if writer is not None:
+                    writer.close()
+            print("...done!\n")
+            return {"beam_centers": np.concatenate(beam_centers),
+                    "azi_intensity": np.concatenate(azi_intensity),
+                    "phi_values": phi_values}
+
+        # The beam centers are part of the streamed results, so they are the
+        # upstream of the scan geometry
+        results, self._beam_key = self._cached("streamed_profiles", self.cache and self.cache.data_key,
+                                               {**beam_parameters, **integration_parameters},
+                                               ["beam_centers", "azi_intensity", "phi_values"], stream)
+
+        self.beam_centers = results["beam_centers"]
+        self._azi_intensity_all = results["azi_intensity"]
+        self.phi_values = results["phi_values"]
+        self._streamed_parameters = hash_values(integration_parameters)
+
+    def distribute_data(self, data_directory):
+        """
+        Runs beam finding and integration of the scan on several worker
+        processes (distributed.backend "processes") or MPI ranks ("mpi"),
+        each on its own range of frames, and gathers the beam centers and
+        profiles of all frames like stream_data. With MPI, every rank runs
+        the pipeline and only rank 0 continues after the gather.
+        """
+        beam_parameters = self._beam_parameters()
+        integration_parameters = self._integration_parameters()
+        backend = config.get("distributed.backend")
+
+        def distribute():
+            print(f"Processing the scan with the {backend} backend...")
+            with self.report.stage("distribute") as record:
+                results = distributed.process_scan(data_directory, beam_parameters,
+                                                   integration_parameters, backend,
+                                                   config.get("distributed.n_workers"),
+                                                   self.memory_budget)
+                if results is not None:
+                    record["n_frames"] = len(results[0])
+            print("...done!\n")
+            if results is None:
+                return None
+            return {"beam_centers": results[0], "azi_intensity": results[1],
+                    "phi_values": results[2]}
+
+        if backend == "mpi":
+            # All ranks have to take part, so rank 0 can not skip the work
+            # on a cache hit
+            results = distribute()
+            if results is None:
+                return
+        else:
+            results, self._beam_key = self._cached("streamed_profiles",
+                                                   self.cache and self.cache.data_key,
+                                                   {**beam_parameters, **integration_parameters},
+                                                   ["beam_centers", "azi_intensity", "phi_values"],
+                                                   distribute)
+
+        self.beam_centers = results["beam_centers"]
+        self._azi_intensity_all = results["azi_intensity"]
+        self.phi_values = results["phi_values"]
+        self._streamed_parameters = hash_values(integration_parameters)
 
     def map_orientation(self, data_directory = None):
 
-        # Step 1: Load and mask data
-        if (self.data is None) and (data_directory is None):
+        # Step 1: Load data
+        if (self.beam_centers is None) and (data_directory is None):
             raise Exception("""Please load data or specify data_directory""")        
-        elif (self.data is None) and (data_directory is not None):
+        elif (self.beam_centers is None) and (data_directory is not None):
             self.load_data(data_directory)
+            # The other MPI ranks than 0 are done after their shard
+            if self.beam_centers is None:
+                return self
         else:
             pass
 
-        # Step 3: Determine the shape of the scan
-        if self.scan_limits is None:
-            raise Exception("""Scan limits not set. They can be determined using .get("beam centers")""")
-
+        # Step 3: Determine the shape of the scan. Unless they are set, the
+        # scan limits are estimated from the beam centers.
         print("Computing scan shape...")
-        self.valid_frames, self.scan_shape = preprocess.get_scan_shape(self.beam_centers,
-                                                                           self.scan_limits)
-        self.format_shape = utilities.FormatDataShape(self.scan_shape)
+        flyback_threshold = config.get("preprocess.flyback_threshold")
+        row_length_tolerance = config.get("preprocess.row_length_tolerance")
+        scan_parameters = {"scan_limits": self.scan_limits,
+                           "flyback_threshold": flyback_threshold,
+                           "row_length_tolerance": row_length_tolerance}
 
-        print("...done!\n")
+        def compute_scan_shape():
+            with self.report.stage("scan_shape", n_frames = len(self.beam_centers)):
+                scan_limits = self.scan_limits
+                if scan_limits is None:
+                    scan_limits = preprocess.find_scan_limits(self.beam_centers, flyback_threshold,
+                                                              row_length_tolerance)
+                    print(f"Estimated scan limits: {scan_limits}")
+
+                valid_frames, _, frame_indices = preprocess.get_scan_shape(
+                    self.beam_centers, scan_limits, flyback_threshold, return_indices = True,
+                    row_length_tolerance = row_length_tolerance)
+            return {"scan_limits": scan_limits, "valid_frames": valid_frames,
+                    "frame_indices": frame_indices}
+
+        results, scan_key = self._cached("scan_shape", self._beam_key, scan_parameters,
+                                         ["scan_limits", "valid_frames", "frame_indices"],
+                                         compute_scan_shape)
+        self.scan_limits = tuple(int(limit) for limit in results["scan_limits"])
+        self.valid_frames = results["valid_frames"]
+        self.frame_indices = results["frame_indices"]
+        self.scan_shape = self.frame_indices.shape
+        self.format_shape = utilities.FormatDataShape(self.scan_shape)
+        valid_indices = self.frame_indices.ravel()
 
-        # Step 5: Trim the data
-        print("Trimming data...")
-        self.data_centered = preprocess.center_images(self.data[self.valid_frames],
-                                                      self.beam_centers[self.valid_frames])
         print("...done!\n")
 
-        # Step 6: Integrate
+        # Step 5 & 6: Trim and integrate. The crowns are integrated around the
+        # beam center of every frame, so the centered copy is never made.
+        # Only the valid frames are integrated, straight from the stack.
+        # The harmonics for harmonic analysis are computed during integration.
         print("Integrating data...")
-        self.azi_intensity, self.phi_values = integration.crown_integration(self.data_centered,
-                                                                            n_phi_bins = self.azi_resolution)
+        harmonics = None
+        if self._azi_intensity_all is not None:
+            # The profiles were computed while streaming the data, with the
+            # integration parameters of that time
+            if hash_values(self._integration_parameters()) != self._streamed_parameters:
+                if self.distributed:
+                    self.distribute_data(self.data_directory)
+                else:
+                    self.stream_data(self.data_directory)
+            self.azi_intensity = self._azi_intensity_all[valid_indices]
+        else:
+            integration_parameters = self._integration_parameters()
+
+            def integrate():
+                nonlocal harmonics
+                if self.data is None:
+                    self._load_frames()
+                frame_bytes = self.data[0].nbytes
+                with self.report.stage("integrate", n_frames = len(valid_indices),
+                                       n_bytes = len(valid_indices) * frame_bytes):
+                    if self.orientation_method == "harmonic_analysis":
+                        azi_intensity, phi_values, harmonics = integration.centered_crown_integration(
+                            self.data, self.beam_centers, harmonic_orders = (0, 2),
+                            frame_indices = valid_indices, **integration_parameters)
+                    else:
+                        azi_intensity, phi_values = integration.centered_crown_integration(
+                            self.data, self.beam_centers, frame_indices = valid_indices,
+                            **integration_parameters)
+                return {"azi_intensity": azi_intensity, "phi_values": phi_values}
+
+            # The harmonics are not cached, they are recomputed from the profiles
+            results, _ = self._cached("profiles", scan_key, integration_parameters,
+                                      ["azi_intensity", "phi_values"], integrate)
+            self.azi_intensity = results["azi_intensity"]
+            self.phi_values = results["phi_values"]
         print("...done!\n")
 
         # Step 7: Fit model
         print("Computing orientation...")
+        orientation_stage = self.report.stage("orientation", n_frames = len(self.azi_intensity),
+                                              n_bytes = self.azi_intensity.nbytes)
         if self.orientation_method == "harmonic_analysis":
-            self.orientation_map = orientation.harmonic_analysis(self.azi_intensity,
-                                                                        self.phi_values)
+            with orientation_stage:
+                if harmonics is None:
+                    self.orientation_map, self.alignment_map = orientation.harmonic_analysis(
+                        self.azi_intensity, self.phi_values, return_alignment = True)
+                else:
+                    self.orientation_map, self.alignment_map = orientation.harmonic_orientation(harmonics)
             print("...done!\n")
             visualize.plot_orientation(self.format_shape.to_2D(self.orientation_map))
 
         elif self.orientation_method == "model_fitting":
-            self.orientation_map = orientation.fit_poisson_odf(self.azi_intensity,
-                                                                        self.phi_values)
+            with orientation_stage:
+                self.orientation_map = orientation.fit_poisson_odf(self.azi_intensity,
+                                                                            self.phi_values)
             print("...done!\n")
             visualize.plot_orientation(self.format_shape.to_2D(self.orientation_map[:,0]))
         
         elif self.orientation_method == "argmax":
-            self.orientation_map = orientation.find_orientation_peaks(self.azi_intensity,
-                                                                        self.phi_values)
+            with orientation_stage:
+                self.orientation_map = orientation.find_orientation_peaks(self.azi_intensity,
+                                                                            self.phi_values)
             print("...done!\n")
             visualize.plot_orientation(self.format_shape.to_2D(self.orientation_map))
         else:
             raise ValueError(f"Unknown orientation method: {self.orientation_method}")
 
+        if self.output_file is not None:
+            self.save(self.output_file)
+
+        if self.trace_file is not None:
+            self.report.write_trace(self.trace_file)
+
+        return self
+
+    def _binned_frames(self, data_directory, binning, frame_step):
+        """
+        The frames of a scan binned by bin_images, loaded chunk by chunk.
+        Of a directory, only the kept files are read. Returns the binned
+        stack and the number of frames of the scan.
+        """
+        detector_mask = config.get("masking.detector_mask")
+        if self.data is not None:
+            return (preprocess.bin_images(self.data, binning, frame_step,
+                                          detector_mask = detector_mask), len(self.data))
+
+        if isinstance(data_directory, (str, os.PathLike)):
+            file_paths = io.list_data_files(data_directory)
+            if len(file_paths) == 0:
+                raise Exception(f"No images found in {data_directory}")
+            chunks = io.iterate_data_chunks(file_paths[::frame_step], config.get("io.chunk_frames"))
+            binned = [preprocess.bin_images(chunk, binning, 1, detector_mask = detector_mask)
+                      for _, chunk in chunks]
+            return np.concatenate(binned), len(file_paths)
+
+        return (preprocess.bin_images(data_directory, binning, frame_step,
+                                      detector_mask = detector_mask), data_directory.shape[0])
+
+    def preview(self, data_directory = None,
+                binning = config.get("preview.binning"),
+                frame_step = config.get("preview.frame_step"),
+                map_step = config.get("preview.map_step")):
+        """
+        Fast preview of a scan, for choosing the scan limits and checking
+        the integration parameters within seconds. The frames are binned in
+        binning x binning blocks by the C++ extension, and only every
+        frame_step-th frame is read. The beam centers of the binned frames
+        give the scan limits and the scan shape at full frame resolution.
+        Every map_step-th scan row and column is integrated with the binned
+        geometry into a coarse harmonic orientation map.
+
+        Unless they are set, the scan limits are estimated. They are kept in
+        scan_limits, so the full resolution run of map_orientation reuses
+        them. scan_limits can be changed and the preview repeated, or set to
+        None to estimate them again in the full run. The beam centers and
+        profiles of the full run are not touched.
+
+        Returns
+        -------
+        AnalysisPipeline
+            self, with the results as a dict in get("preview").
+
+        Examples
+        --------
+        >>> pipeline = AnalysisPipeline().preview(data_directory, binning = 4)
+        >>> pipeline.scan_limits = (120, 65400)
+        >>> pipeline.preview(data_directory).map_orientation(data_directory)
+        """
+        if data_directory is None:
+            data_directory = self.data_directory
+        if data_directory is None and self.data is None:
+            raise Exception("""Please load data or specify data_directory""")
+
+        print("Binning data for the preview...")
+        with self.report.stage("preview_binning") as record:
+            binned, n_images = self._binned_frames(data_directory, binning, frame_step)
+            record.update(n_frames = len(binned), n_bytes = binned.nbytes)
+        print("...done!\n")
+
+        # The binned frames are masked with -1 already
+        print("Computing preview scan shape...")
+        flyback_threshold = config.get("preprocess.flyback_threshold")
+        with self.report.stage("preview_scan_shape", n_frames = len(binned)):
+            binned_centers = preprocess.find_beam_centers(
+                binned, config.get("preprocess.direct_beam_threshold"), window_radius = 0,
+                detector_mask = None, dtype = "float64", backend = "cpu")
+            beam_centers = preprocess.unbin_beam_centers(binned_centers, binning, frame_step, n_images)
+
+            scan_limits = self.scan_limits
+            if scan_limits is None:
+                scan_limits = preprocess.find_scan_limits(beam_centers, flyback_threshold,
+                                                          config.get("preprocess.row_length_tolerance"))
+            _, scan_shape, frame_indices = preprocess.get_scan_shape(
+                beam_centers, scan_limits, flyback_threshold, return_indices = True)
+        self.scan_limits = tuple(int(limit) for limit in scan_limits)
+        print(f"Scan limits: {self.scan_limits}, scan shape: {tuple(scan_shape)}")
+        print("...done!\n")
+
+        # Nearest kept frame of every map position, still in ascending order.
+        # The corrections of the full run have the full detector shape.
+        print("Computing preview orientation...")
+        map_indices = frame_indices[::map_step, ::map_step]
+        binned_indices = np.minimum(np.rint(map_indices / frame_step).astype(np.int64),
+                                    len(binned) - 1)
+        with self.report.stage("preview_orientation", n_frames = map_indices.size):
+            _, _, harmonics = integration.centered_crown_integration(
+                binned, binned_centers,
+                trimming_radius = config.get("preprocess.trim_radius") // binning,
+                n_phi_bins = self.azi_resolution,
+                q_range = config.get("integration.q_range"),
+                q_callibration = config.get("integration.q_callibration") * binning,
+                harmonic_orders = (0, 2), frame_indices = binned_indices,
+                detector_mask = None, subpixel = False, background = None, gain = None,
+                hot_pixel_sigma = 0.0, backend = "cpu")
+            orientation_map, alignment_map = orientation.harmonic_orientation(harmonics)
+        print("...done!\n")
+
+        self.preview_results = {"beam_centers": beam_centers,
+                                "scan_limits": self.scan_limits,
+                                "scan_shape": tuple(scan_shape),
+                                "frame_indices": map_indices,
+                                "orientation_map": orientation_map,
+                                "alignment_map": alignment_map,
+                                "binning": binning, "frame_step": frame_step,
+                                "map_step": map_step}
+        visualize.plot_orientation(orientation_map)
         return self
 
+    @staticmethod
+    def _append_frames(writer, first_frame, beam_centers, azi_intensity):
+        """
+        Appends per-frame results to the "frames" group of an output file.
+        The first frame restarts the datasets.
+        """
+        if first_frame == 0:
+            for dataset_label in ("frames/beam_centers", "frames/azi_intensity"):
+                if dataset_label in writer.h5file:
+                    del writer.h5file[dataset_label]
+        writer.append("frames/beam_centers", beam_centers)
+        writer.append("frames/azi_intensity", azi_intensity)
+        writer.flush()
+
+    def save(self, filename, profiles = True):
+        """
+        Saves the results in scan shape, and the beam centers of all frames,
+        to an HDF5 file in a single open (see io.HDF5Writer). The scan-shaped
+        arrays are chunked by scan rows.
+
+        Parameters
+        ----------
+        filename : string
+            Path of the HDF5 file. Other datasets of the file are kept.
+        profiles : bool, optional
+            Also save the azimuthal profiles, the largest output.
+        """
+        io.save_results(filename, **self._results(profiles))
+
+    def _results(self, profiles = True):
+        """
+        Datasets written by save, None for results that were not computed.
+        """
+        results = {"beam_centers": self.beam_centers,
+                   "scan_limits": None if self.scan_limits is None else np.asarray(self.scan_limits),
+                   "valid_frames": self.valid_frames,
+                   "frame_indices": self.frame_indices,
+                   "phi_values": self.phi_values}
+        if self.format_shape is not None:
+            for label, values in (("orientation_map", self.orientation_map),
+                                  ("alignment_map", self.alignment_map),
+                                  ("azi_intensity", self.azi_intensity if profiles else None)):
+                results[label] = None if values is None else self.format_shape.to_2D(values)
+        return results
+
 
     def get(self, step_name):
         if step_name == "data":
@@ -121,13 +584,384 @@ class AnalysisPipeline:
             return self.scan_limits
         elif step_name == "valid frames":
             return self.valid_frames
+        elif step_name == "frame indices":
+            return self.frame_indices
         elif step_name == "scan shape":
             return self.scan_shape
         elif step_name == "centered data":
-            return self.format_shape.to_2D(self.data_centered)
+            # Only made on request, the pipeline integrates the raw frames.
+            # With cached results, the frames may not have been loaded yet.
+            if self.data is None and self._azi_intensity_all is None and self.data_directory is not None:
+                self._load_frames()
+            if self.data is None:
+                raise ValueError("The data is not kept in memory in streaming mode.")
+            valid_indices = self.frame_indices.ravel()
+            return self.format_shape.to_2D(preprocess.center_images(
+                self.data[valid_indices], self.beam_centers[valid_indices],
+                config.get("preprocess.trim_radius"),
+                detector_mask = config.get("masking.detector_mask")))
+        elif step_name == "alignment map":
+            return self.format_shape.to_2D(self.alignment_map)
         elif step_name == "azint profiles":
             return self.format_shape.to_2D(self.azi_intensity)
         elif step_name == "orientation map":
             return self.format_shape.to_2D(self.orientation_map)
+        elif step_name == "report":
+            return self.report.to_dict()
+        elif step_name == "preview":
+            return self.preview_results
         else:
             raise ValueError(f"Unknown step: {step_name}")
+
+
+class _GrowingArray:
+    """
+    Array of per-frame results that grows along the first axis with
+    amortized constant cost per appended frame.
+    """
+
+    def __init__(self):
+        self._buffer = None
+        self.size = 0
+
+    def append(self, values):
+        values = np.asarray(values)
+        if self._buffer is None:
+            self._buffer = np.empty((max(1024, len(values)), *values.shape[1:]), dtype = values.dtype)
+        elif self.size + len(values) > len(self._buffer):
+            capacity = max(2 * len(self._buffer), self.size + len(values))
+            buffer = np.empty((capacity, *self._buffer.shape[1:]), dtype = self._buffer.dtype)
+            buffer[:self.size] = self._buffer[:self.size]
+            self._buffer = buffer
+        self._buffer[self.size:self.size + len(values)] = values
+        self.size += len(values)
+
+    @property
+    def values(self):
+        """
+        View of the appended values.
+        """
+        return self._buffer[:self.size]
+
+
+class _ScanPositionValues:
+    """
+    Attribute of LiveAnalysisPipeline that is gathered from the per-frame
+    results when it is read, so that an update of the scan geometry does
+    not copy the results of all frames.
+    """
+
+    def __init__(self, gather):
+        self.gather = gather
+
+    def __set_name__(self, owner, name):
+        self.name = name
+
+    def __get__(self, pipeline, owner = None):
+        if pipeline is None:
+            return self
+        if pipeline.frame_indices is None:
+            return None
+        return self.gather(pipeline)
+
+    def __set__(self, pipeline, value):
+        # Only the reset in AnalysisPipeline.__init__
+        if value is not None:
+            raise AttributeError(f"{self.name} of a live scan follows from its frames.")
+
+
+def _valid_frames(pipeline):
+    valid_frames = np.zeros(pipeline._scan_end, dtype = 'bool')
+    valid_frames[pipeline.frame_indices.ravel()] = True
+    return valid_frames
+
+
+class LiveAnalysisPipeline(AnalysisPipeline):
+    """
+    Orientation mapping of a scan while it is being recorded. Frames are
+    pushed in batches (push_frames) or read from a directory as they appear
+    (watch). Every batch is integrated straight away with a cached
+    integration plan. The scan geometry and the orientation map are
+    updated whenever a scan row is completed, so only the frames of new
+    rows are analysed.
+
+    Examples
+    --------
+    >>> live = LiveAnalysisPipeline()
+    >>> live.watch(data_directory, callback = lambda live: print(live.scan_shape))
+    >>> orientation_map = live.get("orientation map")
+    """
+
+    # Results of the scan positions, gathered from the per-frame results
+    valid_frames = _ScanPositionValues(_valid_frames)
+    azi_intensity = _ScanPositionValues(
+        lambda live: live._profiles.values[live.frame_indices.ravel()])
+    orientation_map = _ScanPositionValues(
+        lambda live: live._orientation.values[live.frame_indices.ravel()])
+    alignment_map = _ScanPositionValues(
+        lambda live: live._alignment.values[live.frame_indices.ravel()]
+                     if live._alignment.size > 0 else None)
+
+    def __init__(self):
+        super().__init__()
+        self.poll_interval = config.get("analyze.live_poll_interval")
+        self.idle_timeout = config.get("analyze.live_idle_timeout")
+
+        # The plan depends only on the trimmed image shape and the ring
+        trimmed_edge_width = 2 * config.get("preprocess.trim_radius") + 1
+        self.plan = integration.get_integration_plan((trimmed_edge_width, trimmed_edge_width),
+                                                     self.azi_resolution,
+                                                     config.get("integration.q_range"),
+                                                     config.get("integration.q_callibration"))
+        self.phi_values = integration._phi_values(self.plan)
+
+        # Per-frame results in acquisition order
+        self._beam_centers = _GrowingArray()
+        self._profiles = _GrowingArray()
+        self._harmonics = _GrowingArray()
+        self._orientation = _GrowingArray()
+        self._alignment = _GrowingArray()
+        # Completed scan rows, and the frame after the last of them
+        self._row_starts = _GrowingArray()
+        self._row_lengths = _GrowingArray()
+        self._rows_end = 0
+        # Frame indices of the scan rows, extended as rows are completed
+        self._frame_indices = _GrowingArray()
+        self._scan_end = 0
+        # Output file, open from the first pushed batch until close
+        self._writer = None
+
+    @property
+    def n_frames(self):
+        """
+        Number of frames pushed so far.
+        """
+        return self._beam_centers.size
+
+    def push_frames(self, frames):
+        """
+        Adds a batch of frames of the running scan, in acquisition order.
+
+        Parameters
+        ----------
+        frames : NumPy Array (3D)
+            int16 detector images. Indexing: (image_index, QY, QX)
+
+        Returns
+        -------
+        bool
+            True if the batch completed at least one scan row, i.e. the
+            scan shape and the orientation map were updated.
+        """
+        frames = np.asarray(frames)
+        if frames.ndim == 2:
+            frames = frames[np.newaxis]
+
+        with self.report.stage("live_batch", n_frames = len(frames), n_bytes = frames.nbytes):
+            first_frame = self.n_frames
+            beam_centers = preprocess.find_beam_centers(frames, **self._beam_parameters())
+            # The geometry is fixed by the plan
+            integration_parameters = {key: value for key, value in self._integration_parameters().items()
+                                      if key not in ("trimming_radius", "n_phi_bins",
+                                                     "q_range", "q_callibration")}
+            integration_parameters["background"] = integration.chunk_background(
+                integration_parameters["background"], frames.shape[1:],
+                first_frame, first_frame + len(frames))
+            if self.orientation_method == "harmonic_analysis":
+                profiles, _, harmonics = integration.centered_crown_integration(
+                    frames, beam_centers, plan = self.plan, harmonic_orders = (0, 2),
+                    **integration_parameters)
+                self._harmonics.append(harmonics)
+            else:
+                profiles, _ = integration.centered_crown_integration(frames, beam_centers,
+                                                                     plan = self.plan,
+                                                                     **integration_parameters)
+            self._beam_centers.append(beam_centers)
+            self._profiles.append(profiles)
+
+            updated = self._update_scan()
+
+            if self.output_file is not None:
+                if self._writer is None:
+                    self._writer = io.HDF5Writer(self.output_file)
+                # The maps are small, they are rewritten when rows are added,
+                # before _append_frames flushes the file
+                if updated:
+                    self._writer.write_results(**self._results(profiles = False))
+                self._append_frames(self._writer, first_frame, beam_centers, profiles)
+
+        return updated
+
+    def close(self):
+        """
+        Closes the output file. A later push_frames opens it again and
+        keeps appending to it.
+        """
+        if self._writer is not None:
+            self._writer.close()
+            self._writer = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exception):
+        self.close()
+
+    def watch(self, data_directory, callback = None, poll_interval = None, idle_timeout = None):
+        """
+        Processes the frames of a directory as they are written, until no
+        new frame has appeared for idle_timeout seconds.
+
+        Parameters
+        ----------
+        data_directory : string
+            Directory the detector images are written to. Images are taken
+            in the order of their sorted file names.
+        callback : callable, optional
+            Called with the pipeline after every update of the orientation
+            map, e.g. to plot it.
+        poll_interval : float, optional
+            Seconds between two listings of the directory.
+        idle_timeout : float, optional
+            Seconds without new frames after which the scan is finished.
+
+        Returns
+        -------
+        LiveAnalysisPipeline
+            The pipeline, with the map of all completed rows.
+        """
+        poll_interval = self.poll_interval if poll_interval is None else poll_interval
+        idle_timeout = self.idle_timeout if idle_timeout is None else idle_timeout
+        self.data_directory = data_directory
+
+        n_read = 0
+        last_frame_time = time.monotonic()
+        try:
+            while True:
+                file_paths = io.list_data_files(data_directory)
+                idle = time.monotonic() - last_frame_time > idle_timeout
+
+                # The newest file may still be written. It is read once a newer
+                # file exists, or at the end of the scan.
+                n_ready = len(file_paths) if idle else len(file_paths) - 1
+                if n_ready > n_read:
+                    if self.push_frames(io.load_files(file_paths[n_read:n_ready])) and callback:
+                        callback(self)
+                    n_read = n_ready
+                    last_frame_time = time.monotonic()
+                elif idle:
+                    break
+                else:
+                    time.sleep(poll_interval)
+        finally:
+            # The output file is complete, or the scan was interrupted
+            self.close()
+
+        print(f"Processed {self.n_frames} frames, {self._row_starts.size} rows.\n")
+        return self
+
+    def map_orientation(self, data_directory = None):
+        """
+        Watches data_directory (see watch) and returns the pipeline with
+        the orientation map of the scan.
+        """
+        if data_directory is not None:
+            self.watch(data_directory)
+        if self.orientation_map is None:
+            raise Exception("""No complete scan row found, please push frames or specify data_directory""")
+        return self
+
+    def _update_scan(self):
+        """
+        Updates the scan shape and the maps if new rows were completed.
+        Only the frames after the last completed row are segmented, and
+        the frame indices of new rows are appended while the first row and
+        the row length of the scan stay the same.
+        """
+        n_frames = self.n_frames
+        if n_frames < 3:
+            return False
+        beam_centers = self._beam_centers.values
+
+        # The gradient of the last frame changes with the next frame. A row
+        # is complete once a flyback frame with a final gradient follows it.
+        # The frame before the first one is needed for its gradient.
+        flyback_threshold = config.get("preprocess.flyback_threshold")
+        first = self._rows_end
+        margin = min(first, 1)
+        CoM_gradient = np.gradient(beam_centers[first - margin:, 1])[margin:n_frames - 1 - first + margin]
+        starts, lengths = preprocess._row_segments(CoM_gradient <= flyback_threshold)
+        completed = starts + lengths < len(CoM_gradient)
+        if not np.any(completed):
+            return False
+        self._row_starts.append(first + starts[completed])
+        self._row_lengths.append(lengths[completed])
+        self._rows_end = first + int(starts[completed][-1] + lengths[completed][-1])
+
+        # Same geometry as find_scan_limits and get_scan_shape, on the rows
+        starts, lengths = self._scan_rows(self._row_starts.values, self._row_lengths.values)
+        if len(starts) == 0:
+            # No regular row within the scan limits yet
+            return False
+        row_length = int(lengths.min())
+        n_rows = self._frame_indices.size
+        if (n_rows == 0 or n_rows > len(starts) or self._frame_indices.values[0, 0] != starts[0]
+                or self._frame_indices.values.shape[1] != row_length):
+            self._frame_indices = _GrowingArray()
+            n_rows = 0
+        self._frame_indices.append(starts[n_rows:, np.newaxis] + np.arange(row_length, dtype = np.int64))
+        self._scan_end = self._rows_end
+
+        # Only the frames of the new rows are analysed
+        self._analyze_frames(self._orientation.size, self._scan_end)
+
+        self.beam_centers = beam_centers
+        self.frame_indices = self._frame_indices.values
+        self.scan_shape = self.frame_indices.shape
+        self.format_shape = utilities.FormatDataShape(self.scan_shape)
+        return True
+
+    def _scan_rows(self, row_starts, row_lengths):
+        """
+        First frames and lengths of the completed rows that are part of the
+        scan: the rows between the first and the last regular row, or the
+        rows cut to the scan limits if they are set.
+        """
+        if self.scan_limits is not None:
+            ends = np.minimum(row_starts + row_lengths, self.scan_limits[1])
+            starts = np.maximum(row_starts, self.scan_limits[0])
+            inside = ends > starts
+            return starts[inside], (ends - starts)[inside]
+
+        # Runs of a single frame are noise within the flybacks
+        rows = row_lengths > 1
+        if not np.any(rows):
+            return row_starts[:0], row_lengths[:0]
+        row_length = np.median(row_lengths[rows])
+        regular_rows = np.flatnonzero(np.abs(row_lengths - row_length)
+                                      <= config.get("preprocess.row_length_tolerance") * row_length)
+        if len(regular_rows) == 0:
+            return row_starts[:0], row_lengths[:0]
+        scan_rows = slice(regular_rows[0], regular_rows[-1] + 1)
+        return row_starts[scan_rows], row_lengths[scan_rows]
+
+    def _analyze_frames(self, first, last):
+        """
+        Orientation of the frames [first, last).
+        """
+        if last <= first:
+            return
+        profiles = self._profiles.values[first:last]
+
+        if self.orientation_method == "harmonic_analysis":
+            orientation_values, alignment = orientation.harmonic_orientation(
+                self._harmonics.values[first:last])
+            self._alignment.append(alignment)
+        elif self.orientation_method == "model_fitting":
+            orientation_values = orientation.fit_poisson_odf(profiles, self.phi_values)
+        elif self.orientation_method == "argmax":
+            orientation_values = orientation.find_orientation_peaks(profiles, self.phi_values)
+        else:
+            raise ValueError(f"Unknown orientation method: {self.orientation_method}")
+
+        self._orientation.append(orientation_values)
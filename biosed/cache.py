@@ -0,0 +1,158 @@
+# /biosed/cache.py
+# On-disk cache of the intermediate results of the analysis pipeline.
+#
+#
+# Copyright (C) 2024 Tine Kalac
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+import hashlib
+import os
+
+import numpy as np
+import h5py
+
+from . import io
+
+
+def _update_hash(digest, value):
+    """
+    Adds a parameter value to a hash. Arrays are hashed by their type,
+    shape and contents, containers element by element.
+    """
+    if isinstance(value, np.ndarray):
+        digest.update(f"ndarray{value.dtype.str}{value.shape}".encode())
+        digest.update(np.ascontiguousarray(value).tobytes())
+    elif isinstance(value, dict):
+        digest.update(b"dict")
+        for key in sorted(value):
+            _update_hash(digest, key)
+            _update_hash(digest, value[key])
+    elif isinstance(value, (list, tuple)):
+        digest.update(f"{type(value).__name__}{len(value)}".encode())
+        for item in value:
+            _update_hash(digest, item)
+    else:
+        digest.update(repr(value).encode())
+    digest.update(b";")
+
+
+def hash_values(*values):
+    """
+    Short hex digest of the given values, see _update_hash.
+    """
+    digest = hashlib.sha256()
+    for value in values:
+        _update_hash(digest, value)
+    return digest.hexdigest()[:24]
+
+
+def data_source_key(data_source):
+    """
+    Key of the frames of a data source, or None if the source cannot be
+    identified on disk. A directory is identified by its path and the
+    names, sizes and modification times of its files, so the key changes
+    whenever a file is added or rewritten. Memory-mapped files (io.open_raw)
+    and HDF5 datasets (io.open_hdf5_stack) are identified by their file,
+    position and shape.
+    """
+    if isinstance(data_source, (str, os.PathLike)):
+        files = []
+        for file_path in io.list_data_files(data_source):
+            status = os.stat(file_path)
+            files.append((os.path.basename(file_path), status.st_size, status.st_mtime_ns))
+        return hash_values("directory", os.path.abspath(data_source), files)
+
+    if isinstance(data_source, np.memmap) and data_source.filename is not None:
+        status = os.stat(data_source.filename)
+        return hash_values("raw", os.path.abspath(data_source.filename), status.st_size,
+                           status.st_mtime_ns, data_source.offset, data_source.shape,
+                           data_source.dtype.str)
+
+    if isinstance(data_source, h5py.Dataset):
+        file_path = data_source.file.filename
+        status = os.stat(file_path)
+        return hash_values("hdf5", os.path.abspath(file_path), status.st_size,
+                           status.st_mtime_ns, data_source.name, data_source.shape)
+
+    return None
+
+
+class ResultCache:
+    """
+    Intermediate results of the pipeline for one data source, stored in an
+    HDF5 file of the cache directory with io.HDF5Writer. Every result is
+    stored under the key of its stage, which is the hash of the key of the
+    stage it depends on and of its parameters. Changing a parameter therefore only invalidates
+    its stage and the stages that depend on it.
+
+    Examples
+    --------
+    >>> cache = ResultCache("/tmp/biosed_cache", data_directory)
+    >>> key = cache.key("beam_centers", cache.data_key, {"threshold": 100})
+    >>> result = cache.load(key, ["beam_centers"])
+    >>> if result is None:
+    ...     cache.save(key, beam_centers = find_beam_centers(data))
+    """
+
+    def __init__(self, cache_directory, data_source):
+        self.data_key = data_source_key(data_source)
+        self.filename = None
+        if self.data_key is not None:
+            os.makedirs(cache_directory, exist_ok = True)
+            self.filename = os.path.join(cache_directory, f"{self.data_key}.h5")
+
+    @property
+    def enabled(self):
+        """
+        False if the data source cannot be cached.
+        """
+        return self.filename is not None
+
+    @staticmethod
+    def key(stage, upstream_key, parameters):
+        """
+        Key of a stage from the key of the stage it depends on and its
+        parameters (a dict).
+        """
+        return f"{stage}/{hash_values(upstream_key, parameters)}"
+
+    def load(self, key, names):
+        """
+        Returns the named results of a key as a dict, or None if any of them
+        is not in the cache.
+        """
+        if not self.enabled or not os.path.exists(self.filename):
+            return None
+        with h5py.File(self.filename, "r") as h5file:
+            if not all(f"{key}/{name}" in h5file for name in names):
+                return None
+            return {name: h5file[f"{key}/{name}"][...] for name in names}
+
+    def save(self, key, **results):
+        """
+        Stores the results of a key.
+        """
+        if not self.enabled:
+            return
+        with io.HDF5Writer(self.filename) as writer:
+            for name, result in results.items():
+                writer.write(f"{key}/{name}", result)
+
+    def clear(self):
+        """
+        Deletes all cached results of the data source.
+        """
+        if self.enabled and os.path.exists(self.filename):
+            os.remove(self.filename)
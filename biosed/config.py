@@ -39,9 +39,30 @@ class Config:
     """
 
     _defaults = {
+        "parallel": {
+            "n_threads": 0,                 # Threads used by the C++ kernels (0 = all cores)
+            "backend": "cpu",               # Beam finding and integration kernels ("cpu" or "gpu", needs CuPy)
+        },
+
+        "gpu": {
+            "chunk_frames": 512,            # Frames per upload, two chunks are in pinned memory at once
+        },
+
+        "io": {
+            "n_threads": 8,                 # Image reader threads (0 = one per core)
+            "prefetch": True,               # Read the next chunk while processing in streaming mode
+            "chunk_frames": 1024,           # Frames read at once from memory-mapped or HDF5 stacks
+            "compression": None,            # HDF5 compression of saved results (None, "gzip", "lzf", "blosc" or "lz4"), only gzip is readable everywhere
+            "chunk_bytes": 1024**2,         # Approximate HDF5 chunk size, chunks hold whole scan rows
+        },
+
         "preprocess": {
             "direct_beam_threshold": 100,
+            "beam_window_radius": 0,        # Track the beam in a window of this radius (0 = full detector)
             "trim_radius": 100,
+            "flyback_threshold": 2,         # Beam position gradient of the flyback frames
+            "row_length_tolerance": 0.1,    # Rows this much shorter/longer are not part of the scan
+            "dtype": "float64",             # Output type of the beam centers ("float64" or "float32")
         },
 
         "masking": {
@@ -52,15 +73,35 @@ class Config:
         "integration": {
             "n_phi_bins": 120,              # Binning factor for radial/sector integration
             "q_range": (1.2, 2.7),			# Q range of the crown integration
-            "q_callibration": 2.55/70		# nm⁻1/pixel
+            "q_callibration": 2.55/70,		# nm⁻1/pixel
+            "subpixel": False,              # Interpolate at the fractional beam centers
+            "n_q_bins": 30,                 # q bins of the (q, phi) cake
+            "dtype": "float64",             # Output type of the profiles ("float64" or "float32")
+            "background": None,             # (QY, QX) background image subtracted while integrating
+            "gain": None,                   # (QY, QX) flat-field gain applied while integrating
+            "hot_pixel_sigma": 0.0,         # Reject pixels this many sigma above their bin median (0 = off)
         },
 
         "orientation": {
             "weighing_exponent": 1.0,
             "fit_eta_limits": (0.005, 0.95),
+            "fit_backend": "native",        # "native" (C++, multithreaded) or "lmfit"
+            "fit_max_iterations": 200,      # Iteration limit of the native fitter
+            "fit_initial_guess": "fixed",   # "fixed", "harmonic" or "neighbor"
             "method": "harmonic_analysis",
         },
 
+        "preview": {
+            "binning": 4,                   # Detector binning of the preview (1, 2, 4, ...)
+            "frame_step": 1,                # Keep every frame_step-th frame for the preview beam centers
+            "map_step": 4,                  # Keep every map_step-th scan row and column of the preview map
+        },
+
+        "distributed": {
+            "backend": "processes",         # "processes" (local worker pool) or "mpi" (mpi4py ranks)
+            "n_workers": 0,                 # Worker processes of the "processes" backend (0 = one per core)
+        },
+
         "visualize": {
             "detector_plot_norm": Normalize(vmin=0, vmax=40),
             "detector_plot_cmap": "turbo",
@@ -77,6 +118,14 @@ class Config:
 
         "analyze": {
             "orientation_method" : "harmonic_analysis",  # "harmonic_analysis", "argmax", "model_fitting"
+            "streaming": False,             # Process the scan in chunks instead of loading it at once
+            "memory_budget": 4 * 1024**3,   # Bytes of frame data held in memory when streaming
+            "trace_file": None,             # Chrome trace of the pipeline stages, written by map_orientation
+            "live_poll_interval": 1.0,      # Seconds between directory listings in live mode
+            "live_idle_timeout": 30.0,      # Seconds without new frames that end a live scan
+            "cache_directory": None,        # Directory of the on-disk result cache (None = no cache)
+            "output_file": None,            # HDF5 file the results are saved to (None = not saved)
+            "distributed": False,           # Split the frames over workers (see "distributed")
         },
     }
 
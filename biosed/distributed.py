@@ -0,0 +1,235 @@
+# /biosed/distributed.py
+# Beam finding and integration of a scan split over processes or MPI ranks.
+#
+#
+# Copyright (C) 2024 Tine Kalac
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+import multiprocessing
+import os
+from concurrent.futures import ProcessPoolExecutor
+
+import numpy as np
+import h5py
+
+from . import io, preprocess, integration
+from .config import config
+
+
+class _StackShard:
+    """
+    Frames [start, stop) of a stack, read only when sliced.
+    """
+
+    def __init__(self, stack, start, stop):
+        self.stack = stack
+        self.start = start
+        self.shape = (stop - start, *stack.shape[1:])
+
+    def __getitem__(self, frames):
+        return self.stack[self.start + frames.start:self.start + min(frames.stop, self.shape[0])]
+
+
+def describe_source(data_source):
+    """
+    Picklable description of a data source, from which every worker opens
+    its own shard, and the number of frames of the source.
+
+    Parameters
+    ----------
+    data_source : string or array-like
+        Directory of the detector images, a memory-mapped raw file
+        (io.open_raw) or an HDF5 dataset (io.open_hdf5_stack).
+
+    Returns
+    -------
+    tuple
+        (description, n_images)
+    """
+    if isinstance(data_source, (str, os.PathLike)):
+        file_paths = io.list_data_files(data_source)
+        return ("files", file_paths), len(file_paths)
+    if isinstance(data_source, np.memmap) and data_source.filename is not None:
+        return (("raw", data_source.filename, data_source.offset, data_source.shape,
+                 data_source.dtype.str), data_source.shape[0])
+    if isinstance(data_source, h5py.Dataset):
+        return ("hdf5", data_source.file.filename, data_source.name), data_source.shape[0]
+    raise ValueError("Distributed processing needs a directory, a raw file or an HDF5 dataset "
+                     "that every worker can open.")
+
+
+def _open_shard(description, start, stop):
+    """
+    Frames [start, stop) of a described data source, see
+    io.iterate_data_chunks for the supported sources.
+    """
+    kind = description[0]
+    if kind == "files":
+        return description[1][start:stop]
+    if kind == "raw":
+        _, filename, offset, shape, dtype = description
+        return np.memmap(filename, dtype = dtype, mode = 'r', offset = offset, shape = shape)[start:stop]
+    _, filename, dataset_label = description
+    return _StackShard(io.open_hdf5_stack(filename, dataset_label), start, stop)
+
+
+def shard_bounds(n_images, n_shards):
+    """
+    First and last frame of n_shards shards of nearly equal size.
+    """
+    bounds = np.linspace(0, n_images, n_shards + 1).round().astype(np.int64)
+    return list(zip(bounds[:-1].tolist(), bounds[1:].tolist()))
+
+
+def process_shard(description, start, stop, chunk_size, n_threads,
+                  beam_parameters, integration_parameters):
+    """
+    Beam centers and azimuthal profiles of the frames [start, stop) of a
+    data source, computed chunk by chunk with the C++ kernels. Runs in the
+    worker processes.
+
+    Returns
+    -------
+    tuple
+        (start, beam_centers, azi_intensity, phi_values)
+    """
+    beam_centers = []
+    azi_intensity = []
+    phi_values = None
+    if stop > start:
+        chunks = io.iterate_data_chunks(_open_shard(description, start, stop), chunk_size)
+    else:
+        # With more shards than frames, the kernels give the shaped empty outputs
+        chunks = [(0, np.empty((0, *_frame_shape(description)), dtype = 'int16'))]
+    for chunk_start, chunk in chunks:
+        chunk_beam_centers = preprocess.find_beam_centers(chunk, n_threads = n_threads,
+                                                          **beam_parameters)
+        # Per-frame backgrounds are given for the whole scan
+        chunk_parameters = dict(integration_parameters)
+        if "background" in chunk_parameters:
+            chunk_parameters["background"] = integration.chunk_background(
+                chunk_parameters["background"], chunk.shape[1:],
+                start + chunk_start, start + chunk_start + len(chunk))
+        chunk_azi_intensity, phi_values = integration.centered_crown_integration(
+            chunk, chunk_beam_centers, n_threads = n_threads, **chunk_parameters)
+        beam_centers.append(chunk_beam_centers)
+        azi_intensity.append(chunk_azi_intensity)
+        del chunk
+    return start, np.concatenate(beam_centers), np.concatenate(azi_intensity), phi_values
+
+
+def _gather(shard_results):
+    """
+    Concatenates the shard results in frame order, without the empty shards.
+    """
+    shard_results = sorted((result for result in shard_results if len(result[1]) > 0),
+                           key = lambda result: result[0])
+    return (np.concatenate([result[1] for result in shard_results]),
+            np.concatenate([result[2] for result in shard_results]),
+            shard_results[0][3])
+
+
+def process_scan(data_source, beam_parameters, integration_parameters,
+                 backend = config.get("distributed.backend"),
+                 n_workers = config.get("distributed.n_workers"),
+                 memory_budget = config.get("analyze.memory_budget")):
+    """
+    Finds the beam centers and integrates every frame of a scan, with the
+    frame range split into one shard per worker.
+
+    Parameters
+    ----------
+    data_source : string or array-like
+        See describe_source. Every worker reads its own frames.
+    beam_parameters : dict
+        Keyword arguments of preprocess.find_beam_centers.
+    integration_parameters : dict
+        Keyword arguments of integration.centered_crown_integration.
+    backend : string, optional
+        "processes" runs the workers in a pool of local processes, "mpi"
+        runs one shard per MPI rank (mpi4py). With MPI, every rank has to
+        call process_scan, and the results are gathered on rank 0.
+    n_workers : int, optional
+        Worker processes of the "processes" backend. 0 uses one per core.
+        The C++ kernels of every worker share the cores of the node.
+    memory_budget : int, optional
+        Bytes of frame data held in memory by all workers of a node.
+
+    Returns
+    -------
+    tuple or None
+        (beam_centers, azi_intensity, phi_values) of all frames in scan
+        order. None on the other MPI ranks than 0.
+
+    Examples
+    --------
+    >>> beam_centers, azi_intensity, phi_values = process_scan(
+            data_directory, {}, {"n_phi_bins": 120}, n_workers = 8)
+    """
+    description, n_images = describe_source(data_source)
+    if n_images == 0:
+        raise Exception(f"No images found in {data_source}")
+    frame_pixels = np.prod(_frame_shape(description))
+
+    if backend == "mpi":
+        try:
+            from mpi4py import MPI
+        except ImportError:
+            raise ValueError("The mpi backend needs the mpi4py package.")
+        comm = MPI.COMM_WORLD
+        start, stop = shard_bounds(n_images, comm.Get_size())[comm.Get_rank()]
+        # Every rank holds two chunks: the processed one and the prefetched one
+        chunk_size = max(1, int(memory_budget // (4 * frame_pixels)))
+        # Every rank has to reach the gather, a failed shard sends its exception
+        try:
+            result = process_shard(description, start, stop, chunk_size,
+                                   config.get("parallel.n_threads"),
+                                   beam_parameters, integration_parameters)
+        except Exception as error:
+            result = error
+        shard_results = comm.gather(result, root = 0)
+        if isinstance(result, Exception):
+            raise result
+        if comm.Get_rank() != 0:
+            return None
+        for shard_result in shard_results:
+            if isinstance(shard_result, Exception):
+                raise shard_result
+        return _gather(shard_results)
+
+    if backend != "processes":
+        raise ValueError(f"Unknown distributed backend: {backend}")
+
+    n_cores = os.cpu_count() or 1
+    n_workers = min(n_workers if n_workers > 0 else n_cores, n_images)
+    n_threads = max(1, n_cores // n_workers)
+    chunk_size = max(1, int(memory_budget // (4 * frame_pixels * n_workers)))
+
+    # Spawned workers do not inherit the threads of the parent process
+    context = multiprocessing.get_context("spawn")
+    with ProcessPoolExecutor(max_workers = n_workers, mp_context = context) as pool:
+        futures = [pool.submit(process_shard, description, start, stop, chunk_size, n_threads,
+                               beam_parameters, integration_parameters)
+                   for start, stop in shard_bounds(n_images, n_workers)]
+        return _gather([future.result() for future in futures])
+
+
+def _frame_shape(description):
+    """
+    (QY, QX) of the frames of a described data source.
+    """
+    if description[0] == "files":
+        return io.load_files(description[1][:1]).shape[1:]
+    return tuple(_open_shard(description, 0, 1).shape[1:])
@@ -0,0 +1,389 @@
+# /biosed/gpu.py
+# CUDA backend of the beam finding and crown integration kernels (CuPy).
+#
+#
+# Copyright (C) 2024 Tine Kalac
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+"""
+GPU versions of compute_centers_of_mass and CrownIntegrationPlan.
+integrate_centered, selected with config "parallel.backend" = "gpu". CuPy
+is only imported when the backend is used, and the kernels give the same
+results as the C++ kernels: the sums are exact int64 sums on both.
+
+Frames are uploaded in chunks through two pinned host buffers and two
+CUDA streams, so the copy of one chunk into pinned memory overlaps with
+the upload and the kernels of the other. The beam centers and profiles
+of a stack can stay on the device (keep_on_device), e.g. for harmonics.
+"""
+
+import numpy as np
+
+from .config import config
+
+try:
+    import cupy as cp
+except ImportError:
+    cp = None
+
+
+_BLOCK_SIZE = 128
+
+_KERNEL_SOURCE = r"""
+#define BLOCK 128
+
+// Sums of a block in shared memory, the result is in values[0]
+template <typename T>
+__device__ void block_sum(T* values) {
+    __syncthreads();
+    for (int stride = BLOCK / 2; stride > 0; stride /= 2) {
+        if (threadIdx.x < stride) values[threadIdx.x] += values[threadIdx.x + stride];
+        __syncthreads();
+    }
+}
+
+// Thresholded center of mass of every image, one block per image. Like
+// the C++ kernel, pixels below the threshold and masked pixels are skipped
+// and (-1, -1) marks images without such pixels.
+extern "C" __global__ void centers_of_mass(const short* images, const bool* mask, int hasMask,
+                                           int nQY, int nQX, short threshold,
+                                           double* centers) {
+    __shared__ long long sums[BLOCK], sumsQY[BLOCK], sumsQX[BLOCK];
+    const long long nPixels = (long long)nQY * nQX;
+    const short* image = images + (long long)blockIdx.x * nPixels;
+
+    long long sum = 0, sumQY = 0, sumQX = 0;
+    for (long long iPixel = threadIdx.x; iPixel < nPixels; iPixel += BLOCK) {
+        short pixel = image[iPixel];
+        if (pixel < threshold || (hasMask && mask[iPixel])) continue;
+        sum += pixel;
+        sumQY += (long long)pixel * (iPixel / nQX);
+        sumQX += (long long)pixel * (iPixel % nQX);
+    }
+    sums[threadIdx.x] = sum;
+    sumsQY[threadIdx.x] = sumQY;
+    sumsQX[threadIdx.x] = sumQX;
+    block_sum(sums);
+    block_sum(sumsQY);
+    block_sum(sumsQX);
+
+    if (threadIdx.x == 0) {
+        bool found = sums[0] != 0;
+        centers[2 * blockIdx.x] = found ? (double)sumsQY[0] / (double)sums[0] : -1.0;
+        centers[2 * blockIdx.x + 1] = found ? (double)sumsQX[0] / (double)sums[0] : -1.0;
+    }
+}
+
+// Corner of a crop around a beam center coordinate like crop_corner of the
+// C++ kernel: truncated, or off the detector for centers that are not
+// finite or lie further off the detector than the crop size.
+__device__ int crop_corner(double beamCenter, int cropSize, int detectorSize) {
+    if (!(fabs(beamCenter) <= (double)(detectorSize + cropSize))) {
+        return -cropSize - 1;
+    }
+    return (int)beamCenter - cropSize / 2;
+}
+
+// Crown integration of uncentered images around their beam centers, one
+// block per (bin, frame). The crop is placed like in the C++ kernel, with
+// the beam center truncated. Pixels off the detector, masked or negative
+// pixels are skipped.
+extern "C" __global__ void integrate_centered(const short* images, const double* beamCenters,
+                                              const long long* frameIndices, int hasFrameIndices,
+                                              const long long* binStarts, const int* pixelsQY,
+                                              const int* pixelsQX, const int* binSlots,
+                                              const bool* mask, int hasMask,
+                                              int nDetY, int nDetX, int nQY, int nQX,
+                                              int profileSize, double* profiles) {
+    __shared__ long long sums[BLOCK];
+    __shared__ int counts[BLOCK];
+    const int iBin = blockIdx.x;
+    const long long iFrame = blockIdx.y;
+    const long long iImage = hasFrameIndices ? frameIndices[iFrame] : iFrame;
+    const short* image = images + iImage * nDetY * nDetX;
+    const int cropQY = crop_corner(beamCenters[2 * iImage], nQY, nDetY);
+    const int cropQX = crop_corner(beamCenters[2 * iImage + 1], nQX, nDetX);
+
+    long long sum = 0;
+    int count = 0;
+    for (long long iPixel = binStarts[iBin] + threadIdx.x; iPixel < binStarts[iBin + 1];
+         iPixel += BLOCK) {
+        int QY = cropQY + pixelsQY[iPixel];
+        int QX = cropQX + pixelsQX[iPixel];
+        if (QY < 0 || QY >= nDetY || QX < 0 || QX >= nDetX) continue;
+        long long offset = (long long)QY * nDetX + QX;
+        if (hasMask && mask[offset]) continue;
+        short pixel = image[offset];
+        if (pixel < 0) continue;
+        sum += pixel;
+        count++;
+    }
+    sums[threadIdx.x] = sum;
+    counts[threadIdx.x] = count;
+    block_sum(sums);
+    block_sum(counts);
+
+    if (threadIdx.x == 0) {
+        profiles[iFrame * profileSize + binSlots[iBin]]
+            = counts[0] > 0 ? (double)sums[0] / counts[0] : 0.0;
+    }
+}
+"""
+
+_kernels = None
+
+
+def available():
+    """
+    True if CuPy is installed and a CUDA device is present.
+    """
+    if cp is None:
+        return False
+    try:
+        return cp.cuda.runtime.getDeviceCount() > 0
+    except cp.cuda.runtime.CUDARuntimeError:
+        return False
+
+
+def _kernel(name):
+    """
+    Compiled kernel of _KERNEL_SOURCE, compiled on the first use.
+    """
+    global _kernels
+    if not available():
+        raise RuntimeError("The gpu backend needs CuPy and a CUDA device.")
+    if _kernels is None:
+        _kernels = cp.RawModule(code = _KERNEL_SOURCE, options = ("-std=c++11",))
+    return _kernels.get_function(name)
+
+
+def _device_mask(detector_mask, image_shape):
+    """
+    (mask, has_mask) kernel arguments of a detector mask or None.
+    """
+    if detector_mask is None:
+        return cp.zeros(1, dtype = cp.bool_), np.int32(0)
+    detector_mask = np.ascontiguousarray(detector_mask, dtype = bool)
+    if detector_mask.shape != tuple(image_shape):
+        raise ValueError(f"The detector mask has shape {detector_mask.shape}, "
+                         f"but the images have shape {tuple(image_shape)}.")
+    return cp.asarray(detector_mask), np.int32(1)
+
+
+def _upload_chunks(sed_data, chunk_frames):
+    """
+    Uploads a stack chunk by chunk with double buffering. Yields (start,
+    chunk, stream), with chunk the int16 frames on the device. The kernels
+    of a chunk have to be launched on its stream. The buffer of a chunk is
+    reused two chunks later, after its stream is synchronized, so arrays
+    used by the kernels of a chunk have to be kept until then.
+
+    The streams do not wait for the default stream, so everything queued
+    there (output allocations, fills, uploads) is finished first.
+    """
+    n_images = sed_data.shape[0]
+    frame_shape = tuple(sed_data.shape[1:])
+    chunk_frames = max(1, min(chunk_frames, n_images))
+    chunk_pixels = chunk_frames * int(np.prod(frame_shape))
+
+    streams = [cp.cuda.Stream(non_blocking = True) for _ in range(2)]
+    pinned = [cp.cuda.alloc_pinned_memory(2 * chunk_pixels) for _ in range(2)]
+    host = [np.frombuffer(memory, np.int16, chunk_pixels).reshape(chunk_frames, *frame_shape)
+            for memory in pinned]
+    device = [cp.empty((chunk_frames, *frame_shape), dtype = cp.int16) for _ in range(2)]
+    cp.cuda.Stream.null.synchronize()
+
+    for i_chunk, start in enumerate(range(0, n_images, chunk_frames)):
+        buffer = i_chunk % 2
+        streams[buffer].synchronize()
+        n_chunk = min(chunk_frames, n_images - start)
+        # Also reads memory-mapped and HDF5 stacks
+        host[buffer][:n_chunk] = sed_data[start:start + n_chunk]
+        device[buffer][:n_chunk].set(host[buffer][:n_chunk], stream = streams[buffer])
+        yield start, device[buffer][:n_chunk], streams[buffer]
+
+    for stream in streams:
+        stream.synchronize()
+
+
+class GPUIntegrationPlan:
+    """
+    The pixel list of a CrownIntegrationPlan on the device.
+
+    Parameters
+    ----------
+    plan : CrownIntegrationPlan
+        Integration geometry, e.g. from integration.get_integration_plan.
+    """
+
+    def __init__(self, plan):
+        bin_starts, pixel_offsets, bin_slots = plan.csr_arrays()
+        n_QY, n_QX = plan.shape
+        self.plan = plan
+        self.shape = (n_QY, n_QX)
+        self.n_bins = len(bin_slots)
+        self.profile_size = plan.profile_size
+        self.bin_starts = cp.asarray(bin_starts)
+        self.pixels_QY = cp.asarray((pixel_offsets // n_QX).astype(np.int32))
+        self.pixels_QX = cp.asarray((pixel_offsets % n_QX).astype(np.int32))
+        self.bin_slots = cp.asarray(bin_slots)
+
+    def profile_shape(self, n_images):
+        """
+        Shape of the profiles of n_images images, as returned by the plan.
+        """
+        if self.plan.multi_ring:
+            return (n_images, len(self.plan.ring_phi_bins), self.plan.n_phi_bins)
+        return (n_images, self.plan.n_phi_bins)
+
+
+def find_beam_centers(sed_data,
+                      direct_beam_threshold = config.get("preprocess.direct_beam_threshold"),
+                      detector_mask = None,
+                      chunk_frames = config.get("gpu.chunk_frames"),
+                      keep_on_device = False):
+    """
+    preprocess.find_beam_centers on the GPU. The full detector is always
+    scanned, the window tracking of the C++ kernel is not needed here.
+
+    Returns
+    -------
+    NumPy or CuPy Array
+        (n_images, 2) beam centers, on the device with keep_on_device.
+    """
+    centers_of_mass = _kernel("centers_of_mass")
+    n_images, n_QY, n_QX = sed_data.shape
+    mask, has_mask = _device_mask(detector_mask, (n_QY, n_QX))
+    beam_centers = cp.empty((n_images, 2), dtype = cp.float64)
+
+    for start, chunk, stream in _upload_chunks(sed_data, chunk_frames):
+        with stream:
+            centers_of_mass((len(chunk),), (_BLOCK_SIZE,),
+                            (chunk, mask, has_mask, np.int32(n_QY), np.int32(n_QX),
+                             np.int16(direct_beam_threshold), beam_centers[start:start + len(chunk)]))
+
+    return beam_centers if keep_on_device else cp.asnumpy(beam_centers)
+
+
+def _integrate_chunk(gpu_plan, chunk, chunk_beam_centers, chunk_frame_indices, mask, has_mask,
+                     profiles, stream):
+    """
+    Launches the integration of the selected frames of an uploaded chunk.
+    Returns the frame index array of the kernel, which has to be kept until
+    the stream is synchronized.
+    """
+    n_frames = len(chunk) if chunk_frame_indices is None else len(chunk_frame_indices)
+    if n_frames == 0:
+        return chunk_frame_indices
+    has_frame_indices = np.int32(chunk_frame_indices is not None)
+    n_QY, n_QX = gpu_plan.shape
+    with stream:
+        if chunk_frame_indices is None:
+            chunk_frame_indices = cp.zeros(1, dtype = cp.int64)
+        _kernel("integrate_centered")(
+            (gpu_plan.n_bins, n_frames), (_BLOCK_SIZE,),
+            (chunk, chunk_beam_centers, chunk_frame_indices, has_frame_indices,
+             gpu_plan.bin_starts, gpu_plan.pixels_QY, gpu_plan.pixels_QX, gpu_plan.bin_slots,
+             mask, has_mask, np.int32(chunk.shape[1]), np.int32(chunk.shape[2]),
+             np.int32(n_QY), np.int32(n_QX), np.int32(gpu_plan.profile_size), profiles))
+    return chunk_frame_indices
+
+
+def centered_crown_integration(sed_data, beam_centers, plan,
+                               frame_indices = None,
+                               detector_mask = None,
+                               chunk_frames = config.get("gpu.chunk_frames"),
+                               keep_on_device = False):
+    """
+    CrownIntegrationPlan.integrate_centered on the GPU.
+
+    Parameters
+    ----------
+    sed_data : array-like (3D)
+        (n_images, QY, QX) int16 stack, a NumPy array, memory map or HDF5
+        dataset.
+    beam_centers : NumPy or CuPy Array
+        (n_images, 2) beam centers.
+    plan : CrownIntegrationPlan or GPUIntegrationPlan
+        Integration geometry.
+    frame_indices : NumPy Array (1D, int64), optional
+        Ascending indices of the frames to integrate.
+    detector_mask : NumPy Array (2D, bool), optional
+        Pixels of the raw images that are True are skipped.
+    chunk_frames : int, optional
+        Frames per upload.
+    keep_on_device : bool, optional
+        Return the profiles as a CuPy array, e.g. for harmonics.
+
+    Returns
+    -------
+    NumPy or CuPy Array
+        float64 profiles in the shape of the profiles of the plan.
+    """
+    gpu_plan = plan if isinstance(plan, GPUIntegrationPlan) else GPUIntegrationPlan(plan)
+    n_images = sed_data.shape[0]
+    mask, has_mask = _device_mask(detector_mask, sed_data.shape[1:])
+    beam_centers = cp.ascontiguousarray(cp.asarray(beam_centers, dtype = cp.float64))
+
+    n_frames = n_images if frame_indices is None else len(frame_indices)
+    profiles = cp.zeros((n_frames, gpu_plan.profile_size), dtype = cp.float64)
+    # Bins of rings with fewer phi bins than the plan
+    if gpu_plan.n_bins < gpu_plan.profile_size:
+        profiles[:] = cp.nan
+
+    if frame_indices is not None:
+        frame_indices = np.asarray(frame_indices, dtype = np.int64)
+        if np.any(frame_indices < 0) or np.any(frame_indices >= n_images):
+            raise IndexError("Frame index out of range.")
+
+    # The indices of a chunk are kept until its buffer is reused
+    chunk_indices = [None, None]
+    for i_chunk, (start, chunk, stream) in enumerate(_upload_chunks(sed_data, chunk_frames)):
+        stop = start + len(chunk)
+        if frame_indices is None:
+            first, last, chunk_frame_indices = start, stop, None
+        else:
+            first, last = np.searchsorted(frame_indices, (start, stop))
+            with stream:
+                chunk_frame_indices = cp.asarray(frame_indices[first:last] - start)
+        chunk_indices[i_chunk % 2] = _integrate_chunk(
+            gpu_plan, chunk, beam_centers[start:stop], chunk_frame_indices,
+            mask, has_mask, profiles[first:last], stream)
+
+    profiles = profiles.reshape(gpu_plan.profile_shape(n_frames))
+    return profiles if keep_on_device else cp.asnumpy(profiles)
+
+
+def harmonics(profiles, orders = (0, 2)):
+    """
+    Fourier coefficients (np.fft.fft convention) of profiles on the device,
+    like harmonics.compute_harmonics.
+
+    Parameters
+    ----------
+    profiles : CuPy Array (2D)
+        (n_profiles, n_phi_bins) profiles, e.g. from
+        centered_crown_integration with keep_on_device.
+    orders : list of int, optional
+        Harmonic orders.
+
+    Returns
+    -------
+    CuPy Array
+        (n_profiles, len(orders)) complex coefficients.
+    """
+    n_phi_bins = profiles.shape[-1]
+    phases = -2j * np.pi * np.outer(np.arange(n_phi_bins), orders) / n_phi_bins
+    return cp.asarray(profiles, dtype = cp.float64) @ cp.asarray(np.exp(phases))
@@ -0,0 +1,238 @@
+# /biosed/instrumentation.py
+# Timing and throughput report of the analysis pipeline.
+#
+#
+# Copyright (C) 2024 Tine Kalac
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+import contextlib
+import json
+import os
+import sys
+import threading
+import time
+
+from ._cpp import center_of_mass, crown_integration, odf_fitting, harmonics
+
+try:
+    import resource
+except ImportError:  # Windows
+    resource = None
+
+
+_KERNEL_MODULES = (center_of_mass, crown_integration, odf_fitting, harmonics)
+
+
+def kernel_counters():
+    """
+    Cumulative counters of all C++ kernels since the start of the process.
+
+    Returns
+    -------
+    dict
+        {kernel name: counters}. The counters of a kernel are "calls",
+        "frames", "pixels_visited", "pixels_skipped" (masked, off the
+        detector, outside of the beam tracking window or rejected as hot
+        pixels), "full_scans" (of the beam finding), "wall_seconds",
+        "busy_seconds" (summed over the threads) and "thread_seconds"
+        (wall_seconds times the threads).
+    """
+    counters = {}
+    for module in _KERNEL_MODULES:
+        counters.update(module.kernel_counters())
+    return counters
+
+
+def peak_rss():
+    """
+    Peak resident set size of the process since its start in bytes, or
+    None where the resource module is not available.
+    """
+    if resource is None:
+        return None
+    peak = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    # Kilobytes on Linux, bytes on macOS
+    return peak if sys.platform == "darwin" else peak * 1024
+
+
+def current_rss():
+    """
+    Current resident set size of the process in bytes, or None where
+    /proc/self/statm is not available.
+    """
+    try:
+        with open("/proc/self/statm") as statm:
+            return int(statm.read().split()[1]) * os.sysconf("SC_PAGE_SIZE")
+    except (OSError, ValueError, AttributeError):
+        return None
+
+
+class _RSSSampler:
+    """
+    Samples current_rss on a background thread, for the peak of a stage.
+    Peaks shorter than the interval can be missed.
+    """
+
+    def __init__(self, interval = 0.01):
+        self.interval = interval
+        self.peak = current_rss()
+        self._stop = threading.Event()
+        self._thread = None
+        if self.peak is not None:
+            self._thread = threading.Thread(target = self._sample, daemon = True)
+            self._thread.start()
+
+    def _sample(self):
+        while not self._stop.wait(self.interval):
+            self.peak = max(self.peak, current_rss() or 0)
+
+    def stop(self):
+        """
+        Stops sampling and returns the peak, or None without /proc.
+        """
+        if self._thread is None:
+            return None
+        self._stop.set()
+        self._thread.join()
+        self.peak = max(self.peak, current_rss() or 0)
+        return self.peak
+
+
+def _counter_deltas(before, after):
+    """
+    Counters of the kernels called between two kernel_counters
+    snapshots, with the derived skipped fraction and thread utilization.
+    """
+    deltas = {}
+    for kernel, counters in after.items():
+        previous = before.get(kernel, {})
+        delta = {key: value - previous.get(key, 0) for key, value in counters.items()}
+        if delta["calls"] == 0:
+            continue
+        if delta["pixels_visited"] > 0:
+            delta["skipped_fraction"] = delta["pixels_skipped"] / delta["pixels_visited"]
+        if delta["thread_seconds"] > 0:
+            delta["thread_utilization"] = delta["busy_seconds"] / delta["thread_seconds"]
+        deltas[kernel] = delta
+    return deltas
+
+
+class PipelineReport:
+    """
+    Per-stage wall time, peak memory and throughput of a pipeline run,
+    with the counters of the C++ kernels that ran in every stage. The
+    memory of a stage is its own sampled peak RSS and the growth of the
+    RSS over the stage, next to the high-water mark of the process.
+
+    Examples
+    --------
+    >>> report = PipelineReport()
+    >>> with report.stage("integration", n_frames = len(frames), n_bytes = frames.nbytes):
+    ...     profiles, phi = centered_crown_integration(frames, beam_centers)
+    >>> print(report.summary())
+    >>> report.write_trace("trace.json")
+    """
+
+    def __init__(self):
+        self.stages = []
+        self._origin = time.perf_counter()
+
+    @contextlib.contextmanager
+    def stage(self, name, n_frames = None, n_bytes = None):
+        """
+        Records the stage run in the with block. The yielded record can be
+        updated inside the block, e.g. with n_frames once it is known.
+
+        Parameters
+        ----------
+        name : str
+            Name of the stage.
+        n_frames : int, optional
+            Frames processed by the stage, for frames/s.
+        n_bytes : int, optional
+            Input bytes of the stage, for GB/s.
+        """
+        record = {"name": name, "n_frames": n_frames, "n_bytes": n_bytes}
+        counters_before = kernel_counters()
+        rss_before = current_rss()
+        sampler = _RSSSampler()
+        start = time.perf_counter()
+        try:
+            yield record
+        finally:
+            seconds = time.perf_counter() - start
+            stage_peak = sampler.stop()
+            record["start_seconds"] = start - self._origin
+            record["wall_seconds"] = seconds
+            record["peak_rss_bytes"] = stage_peak
+            record["rss_delta_bytes"] = (None if stage_peak is None or rss_before is None
+                                         else stage_peak - rss_before)
+            record["process_peak_rss_bytes"] = peak_rss()
+            if record["n_frames"] is not None and seconds > 0:
+                record["frames_per_s"] = record["n_frames"] / seconds
+            if record["n_bytes"] is not None and seconds > 0:
+                record["gb_per_s"] = record["n_bytes"] / seconds / 1e9
+            record["kernels"] = _counter_deltas(counters_before, kernel_counters())
+            self.stages.append(record)
+
+    def to_dict(self):
+        """
+        The report as a dict that can be stored as JSON.
+        """
+        return {"stages": self.stages,
+                "total_seconds": sum(record["wall_seconds"] for record in self.stages),
+                "process_peak_rss_bytes": peak_rss()}
+
+    def summary(self):
+        """
+        The report as a table with one line per stage and kernel.
+        """
+        lines = [f"{'stage':28s} {'seconds':>9s} {'frames/s':>11s} {'GB/s':>7s}"
+                 f" {'peak RSS':>9s} {'RSS delta':>10s}"]
+        for record in self.stages:
+            frames_per_s = record.get("frames_per_s")
+            gb_per_s = record.get("gb_per_s")
+            rss = record["peak_rss_bytes"]
+            rss_delta = record["rss_delta_bytes"]
+            lines.append(f"{record['name']:28s} {record['wall_seconds']:9.3f}"
+                         f" {'' if frames_per_s is None else f'{frames_per_s:.1f}':>11s}"
+                         f" {'' if gb_per_s is None else f'{gb_per_s:.3f}':>7s}"
+                         f" {'' if rss is None else f'{rss / 1024**3:.2f} GB':>9s}"
+                         f" {'' if rss_delta is None else f'{rss_delta / 1024**3:+.2f} GB':>10s}")
+            for kernel, counters in record["kernels"].items():
+                skipped = counters.get("skipped_fraction")
+                utilization = counters.get("thread_utilization")
+                lines.append(f"  {kernel:26s} {counters['wall_seconds']:9.3f}"
+                             f" calls={counters['calls']}"
+                             f"{'' if skipped is None else f' skipped={skipped:.1%}'}"
+                             f"{'' if utilization is None else f' threads={utilization:.1%}'}")
+        return "\n".join(lines)
+
+    def write_trace(self, file_path):
+        """
+        Writes the stages as a Chrome trace event file, which can be
+        opened in chrome://tracing or Perfetto.
+        """
+        events = []
+        for record in self.stages:
+            args = {key: value for key, value in record.items()
+                    if key not in ("name", "start_seconds", "wall_seconds") and value is not None}
+            events.append({"name": record["name"], "cat": "stage", "ph": "X",
+                           "ts": 1e6 * record["start_seconds"],
+                           "dur": 1e6 * record["wall_seconds"],
+                           "pid": os.getpid(), "tid": 0, "args": args})
+
+        with open(file_path, "w") as file:
+            json.dump({"traceEvents": events, "displayTimeUnit": "ms"}, file, indent = 1)
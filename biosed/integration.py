@@ -7,37 +7,213 @@ Created on Fri Nov 15 09:40:24 2024
 
 @author: Tine Kalac
 """
+import functools
 import numpy as np
 
+from biosed import io
 from .config import config
 from biosed.utilities import FormatDataShape
-from ._cpp.crown_integration import compute_crown_integral
+from ._cpp.crown_integration import compute_crown_integral, CrownIntegrationPlan
+
+
+@functools.lru_cache(maxsize = 16)
+def _cached_integration_plan(shape, n_phi_bins, q_range, q_callibration):
+    return CrownIntegrationPlan(shape, n_phi_bins, q_range, q_callibration)
+
+
+@functools.lru_cache(maxsize = 16)
+def _cached_multi_ring_plan(shape, ring_phi_bins, q_ranges, q_callibration):
+    return CrownIntegrationPlan(shape, list(ring_phi_bins), list(q_ranges), q_callibration)
+
+
+def _plan_parameters(n_phi_bins, q_range):
+    """
+    Hashable plan parameters. A list of q ranges makes a multi-ring plan,
+    with n_phi_bins given per ring or shared by all rings.
+    """
+    if np.ndim(q_range) == 1:
+        return int(n_phi_bins), (float(q_range[0]), float(q_range[1]))
+
+    q_ranges = tuple((float(q_min), float(q_max)) for q_min, q_max in q_range)
+    ring_phi_bins = tuple(int(n) for n in np.broadcast_to(n_phi_bins, len(q_ranges)))
+    return list(ring_phi_bins), list(q_ranges)
+
+
+def _phi_values(plan):
+    """
+    Centers of the phi bins of a plan. For multi-ring plans, an
+    (n_rings, n_phi_bins) array which is NaN where a ring has fewer bins.
+    """
+    def bin_centers(n_phi_bins):
+        phi_bin_edges = np.linspace(0, 360, n_phi_bins + 1)
+        return np.array([0.5*(phi_bin_edges[i] + phi_bin_edges[i+1]) for i in range(n_phi_bins)])
+
+    if not plan.multi_ring:
+        return bin_centers(plan.n_phi_bins)
+
+    phi_vals = np.full((len(plan.ring_phi_bins), plan.n_phi_bins), np.nan)
+    for ring_index, n_phi_bins in enumerate(plan.ring_phi_bins):
+        phi_vals[ring_index, :n_phi_bins] = bin_centers(n_phi_bins)
+    return phi_vals
+
+
+def _background_arrays(background, image_shape, n_images):
+    """
+    Splits a background into an image shared by all frames and one value per
+    frame, see crown_integration. Returns (image_background, frame_backgrounds),
+    with None for the one that is not given.
+    """
+    if background is None:
+        return None, None
+    background = np.asarray(background, dtype = np.float32)
+    if background.shape == tuple(image_shape):
+        return np.ascontiguousarray(background), None
+    frame_backgrounds = np.broadcast_to(np.ravel(background) if background.ndim else background,
+                                        (n_images,))
+    return None, np.ascontiguousarray(frame_backgrounds)
+
+
+def chunk_background(background, image_shape, start, stop):
+    """
+    The background of the frames [start, stop) of a scan that is integrated
+    chunk by chunk. Per-frame backgrounds are sliced, a background image or
+    a single value is shared by all chunks.
+    """
+    if background is None or np.ndim(background) == 0:
+        return background
+    background = np.asarray(background)
+    if background.shape == tuple(image_shape):
+        return background
+    return np.ravel(background)[start:stop]
+
+
+def _correction_kwargs(image_background, chunk_arrays, frame_backgrounds, gain, hot_pixel_sigma):
+    """
+    Correction arguments of the C++ kernels for a chunk. The per-frame
+    backgrounds of the chunk are the first of its chunk_arrays.
+    """
+    background = chunk_arrays[0] if frame_backgrounds is not None else image_background
+    return {"background": background, "gain": gain, "hot_pixel_sigma": hot_pixel_sigma}
+
+
+def get_integration_plan(shape,
+    n_phi_bins = config.get("integration.n_phi_bins"),
+    q_range = config.get("integration.q_range"),
+    q_callibration = config.get("integration.q_callibration"),
+    mask = None):
+    """
+    Returns the crown integration geometry for centered images of a given
+    shape. Plans are cached, so the geometry is only computed once for each
+    combination of parameters.
+
+    Parameters
+    ----------
+    shape : tuple
+        Shape of a single detector image (QY, QX).
+    n_phi_bins : int or list of int, optional
+        The number of phi bins in the crown, or of every ring.
+    q_range : tuple or list of tuples, optional
+        The q range of the studied Bragg reflection. A list of q ranges
+        makes a plan of several rings, e.g. for the 200 and 004
+        reflections, integrated in a single pass over the images.
+    q_callibration : float, optional
+        Units: nm-1 / pixel.
+    mask : NumPy Array (2D, bool), optional
+        Pixels of the centered images that are left out of the crown. Plans
+        with a mask are not cached.
+
+    Returns
+    -------
+    CrownIntegrationPlan
+        Object with an integrate(sed_data) method for (n_images, QY, QX)
+        stacks of the given shape. Multi-ring plans return
+        (n_images, n_rings, n_phi_bins) profiles.
+
+    Examples
+    --------
+    >>> plan = get_integration_plan(data_centered.shape[-2:], n_phi_bins = 60)
+    >>> data_azi_intensities, data_phi_vals = crown_integration(data_centered,
+                                                                plan = plan)
+    """
+    shape = (int(shape[0]), int(shape[1]))
+    n_phi_bins, q_range = _plan_parameters(n_phi_bins, q_range)
+    if mask is not None:
+        return CrownIntegrationPlan(shape, n_phi_bins, q_range, float(q_callibration),
+                                    np.ascontiguousarray(mask, dtype = bool))
+    if isinstance(q_range, list):
+        # Lists are not hashable
+        return _cached_multi_ring_plan(shape, tuple(n_phi_bins), tuple(q_range),
+                                       float(q_callibration))
+    return _cached_integration_plan(shape, n_phi_bins, q_range, float(q_callibration))
+
 
 def crown_integration(sed_data,
     n_phi_bins = config.get("integration.n_phi_bins"),
     q_range = config.get("integration.q_range"),
-    q_callibration = config.get("integration.q_callibration")):
+    q_callibration = config.get("integration.q_callibration"),
+    plan = None,
+    n_threads = config.get("parallel.n_threads"),
+    harmonic_orders = None,
+    dtype = config.get("integration.dtype"),
+    background = config.get("integration.background"),
+    gain = config.get("integration.gain"),
+    hot_pixel_sigma = config.get("integration.hot_pixel_sigma")):
     """
     Performs crown reduction on a detector image array.
 
     Parameters
     ----------
     sed_data : NumPy Array (3D or 4D)
-        Detector image array. Beams should be centered.
-    n_phi_bins : int, optional
+        Detector image array. Beams should be centered. Memory-mapped arrays
+        and HDF5 datasets are processed chunk by chunk.
+    n_phi_bins : int or list of int, optional
         The number of phi bins in the crown. A higher number means
         better angular resolution but slows processing time.
-    q_range : tuple, optional
-        The q range of the studied Bragg reflection.
+    q_range : tuple or list of tuples, optional
+        The q range of the studied Bragg reflection. With a list of q
+        ranges, all rings are integrated in one pass (see
+        get_integration_plan).
     q_callibration : float, optional
         Units: nm-1 / pixel.
+    plan : CrownIntegrationPlan, optional
+        Precomputed integration geometry. If given, n_phi_bins, q_range and
+        q_callibration are taken from the plan. Otherwise a cached plan is
+        used (see get_integration_plan).
+    n_threads : int, optional
+        Number of threads used by the C++ extension. 0 uses all available
+        cores. The result does not depend on the number of threads.
+    harmonic_orders : list of int, optional
+        If given, these Fourier coefficients (np.fft.fft convention) of every
+        profile are computed during integration and returned as well, e.g.
+        (0, 2) for orientation.harmonic_orientation.
+    dtype : str or NumPy dtype, optional
+        Type of the azimuthal intensity profiles, float64 or float32.
+        float32 halves the memory of the profiles. The bin sums are exact
+        integers either way.
+    background : float or NumPy Array, optional
+        Subtracted from every pixel before it is added to its bin. An array
+        in the shape of an image is shared by all images, otherwise it is
+        one value per image (or a single value for all). Negative corrected
+        values are kept.
+    gain : NumPy Array (2D), optional
+        Flat-field gain of every pixel, multiplied with the background
+        subtracted value.
+    hot_pixel_sigma : float, optional
+        If above 0, pixels more than hot_pixel_sigma standard deviations
+        above the median of their bin are rejected, which removes hot pixels
+        and zingers. The standard deviation is estimated from the median
+        absolute deviation, so a hot pixel is rejected in bins of 3 or more
+        pixels. 0 keeps all pixels.
 
     Returns
     -------
     tuple
         (azi_intensities, phi_vals) - the azimuthal intensity arrays and
         corresponding phi values. The azimuthal intensity profiles are returned
-        in the same shape as the input data.
+        in the same shape as the input data, with a ring axis before the phi
+        axis for several q ranges. With harmonic_orders,
+        (azi_intensities, phi_vals, harmonics), where the last axis of
+        harmonics follows harmonic_orders.
 
     Raises
     ------
@@ -47,7 +223,12 @@ def crown_integration(sed_data,
     Notes
     -----
     The function uses a C++ extension. Computation mostly scales with number of
-    images and is not affected much by the other parameters.
+    images and is not affected much by the other parameters. The detector
+    geometry is computed once per image shape and parameter set and reused
+    between calls. The images are integrated in parallel with the GIL
+    released. The background, gain and hot pixel corrections are applied
+    while the bins are summed, so the stack is not copied. Without them,
+    the pixels are summed as exact integers.
 
     Examples
     --------
@@ -60,20 +241,353 @@ def crown_integration(sed_data,
     if (sed_data.ndim < 3):
         raise Exception("""The data should be a 3D or 4D array, corresponding
             to the shape (image_indicies, QY, QX)""")
-        
+
+    if isinstance(sed_data, np.ma.MaskedArray):
+        sed_data = sed_data.data
+
     # The image array is linearized so the c++ extension can work with it.
-    # It is reshaped again in the return statement.
+    # It is reshaped again in the return statement. Stacks that are not in
+    # memory (HDF5 datasets) are already linear.
+    format_shape = FormatDataShape(sed_data.shape[:-2])
+    if isinstance(sed_data, np.ndarray):
+        sed_data = format_shape.to_1D(sed_data)
+
+    if plan is None:
+        plan = get_integration_plan(sed_data.shape[-2:], n_phi_bins, q_range, q_callibration)
+
+    # The centers of each bin is returned
+    phi_vals = _phi_values(plan)
+    dtype = np.dtype(dtype).name
+
+    # Per-frame backgrounds are sliced along with the chunks
+    image_background, frame_backgrounds = _background_arrays(background, sed_data.shape[-2:],
+                                                             sed_data.shape[0])
+    frame_arrays = () if frame_backgrounds is None else (frame_backgrounds,)
+    if gain is not None:
+        gain = np.ascontiguousarray(gain, dtype = np.float32)
+    corrections = lambda chunk_arrays: _correction_kwargs(image_background, chunk_arrays,
+                                                          frame_backgrounds, gain, hot_pixel_sigma)
+
+    if harmonic_orders is not None:
+        azi_intensities, harmonics = io.map_stack_chunks(
+            lambda chunk, *chunk_arrays: plan.integrate_harmonics(chunk, list(harmonic_orders),
+                                                                  n_threads, dtype,
+                                                                  **corrections(chunk_arrays)),
+            sed_data, *frame_arrays)
+        return format_shape.to_2D(azi_intensities), phi_vals, format_shape.to_2D(harmonics)
+
+    azi_intensities = io.map_stack_chunks(
+        lambda chunk, *chunk_arrays: plan.integrate(chunk, n_threads, dtype,
+                                                    **corrections(chunk_arrays)),
+        sed_data, *frame_arrays)
+
+    return format_shape.to_2D(azi_intensities), phi_vals
+
+
+def centered_crown_integration(sed_data, beam_centers,
+    trimming_radius = config.get("preprocess.trim_radius"),
+    n_phi_bins = config.get("integration.n_phi_bins"),
+    q_range = config.get("integration.q_range"),
+    q_callibration = config.get("integration.q_callibration"),
+    plan = None,
+    n_threads = config.get("parallel.n_threads"),
+    harmonic_orders = None,
+    frame_indices = None,
+    detector_mask = None,
+    subpixel = config.get("integration.subpixel"),
+    dtype = config.get("integration.dtype"),
+    background = config.get("integration.background"),
+    gain = config.get("integration.gain"),
+    hot_pixel_sigma = config.get("integration.hot_pixel_sigma"),
+    backend = config.get("parallel.backend")):
+    """
+    Performs crown reduction on uncentered detector images, with each crown
+    placed around the beam center of its image. The result is the same as
+    calling crown_integration on the output of preprocess.center_images,
+    but the centered copy of the data is never made.
+
+    Parameters
+    ----------
+    sed_data : NumPy Array (3D or 4D)
+        Raw detector image array. Indexing: (image_index, QY, QX)
+        Memory-mapped arrays and HDF5 datasets are processed chunk by chunk.
+    beam_centers : NumPy Array (2D or 3D)
+        Beam center coordinates of every image, e.g. from find_beam_centers.
+    trimming_radius : int, optional
+        Radius of the crop around the beam center used by center_images.
+    n_phi_bins : int or list of int, optional
+        The number of phi bins in the crown.
+    q_range : tuple or list of tuples, optional
+        The q range of the studied Bragg reflection, or of every ring.
+    q_callibration : float, optional
+        Units: nm-1 / pixel.
+    plan : CrownIntegrationPlan, optional
+        Precomputed integration geometry for (2 * trimming_radius + 1)
+        square images. Overrides the other geometry parameters.
+    n_threads : int, optional
+        Number of threads used by the C++ extension. 0 uses all available
+        cores.
+    harmonic_orders : list of int, optional
+        If given, these Fourier coefficients (np.fft.fft convention) of every
+        profile are computed during integration and returned as well, e.g.
+        (0, 2) for orientation.harmonic_orientation.
+    frame_indices : NumPy Array (int), optional
+        Indices of the images to integrate in the linear image stack, in
+        ascending order, e.g. from preprocess.get_scan_shape. Only these
+        images are read and integrated. The output takes the shape of
+        frame_indices instead of the shape of the input data.
+    detector_mask : NumPy Array (2D, bool), optional
+        Pixels of the raw images that are True are skipped, like pixels
+        that are masked by masking.mask_data. None uses all pixels.
+    subpixel : bool, optional
+        If True, the crowns are placed at the fractional beam centers
+        instead of the truncated ones. Every pixel of the crown is
+        interpolated bilinearly from the four surrounding detector pixels,
+        so its q and phi are exact. The result then differs from
+        integrating the output of center_images, and the rings are sharper.
+    dtype : str or NumPy dtype, optional
+        Type of the azimuthal intensity profiles, float64 or float32.
+    background, gain, hot_pixel_sigma : optional
+        Corrections applied while the bins are summed, see crown_integration.
+        The background and gain images have the shape of the raw detector
+        images, per-frame backgrounds one value per image of sed_data. Not
+        available with subpixel.
+    backend : str, optional
+        "cpu" runs the C++ extension, "gpu" the CUDA kernels of biosed.gpu
+        (needs CuPy). The GPU backend does not support subpixel or the
+        corrections.
+
+    Returns
+    -------
+    tuple
+        (azi_intensities, phi_vals) - the azimuthal intensity arrays and
+        corresponding phi values, in the same shape as the input data. With
+        harmonic_orders, (azi_intensities, phi_vals, harmonics).
+
+    Raises
+    ------
+    Exception
+        Is raised when the number of images and beam centers do not match.
+
+    Examples
+    --------
+    >>> beam_centers = find_beam_centers(data)
+    >>> data_azi_intensities, data_phi_vals = centered_crown_integration(data,
+                                                                         beam_centers)
+    """
+
+    # Sanity checks
+    if (sed_data.ndim < 3):
+        raise Exception("""The data should be a 3D or 4D array, corresponding
+            to the shape (image_indicies, QY, QX)""")
+
+    if isinstance(sed_data, np.ma.MaskedArray):
+        sed_data = sed_data.data
+
     format_shape = FormatDataShape(sed_data.shape[:-2])
-    sed_data = format_shape.to_1D(sed_data)
+    if isinstance(sed_data, np.ndarray):
+        sed_data = format_shape.to_1D(sed_data)
+    beam_centers = FormatDataShape(beam_centers.shape[:-1]).to_1D(beam_centers)
+
+    if sed_data.shape[0] != beam_centers.shape[0]:
+        raise Exception("Number of images does not match number of beam center coordinates.")
+
+    if plan is None:
+        trimmed_edge_width = 2 * trimming_radius + 1
+        plan = get_integration_plan((trimmed_edge_width, trimmed_edge_width),
+                                    n_phi_bins, q_range, q_callibration)
 
     # The centers of each bin is returned
-    phi_bin_edges = np.linspace(0, 360, n_phi_bins + 1)
-    phi_vals = np.array([0.5*(phi_bin_edges[i] + phi_bin_edges[i+1]) for i in range(n_phi_bins)])
+    phi_vals = _phi_values(plan)
+
+    beam_centers = np.ascontiguousarray(beam_centers, dtype = np.float64)
+    if detector_mask is not None:
+        detector_mask = np.ascontiguousarray(detector_mask, dtype = bool)
+    dtype = np.dtype(dtype).name
+
+    # The kernels skip the frames that are not selected
+    if frame_indices is not None:
+        format_shape = FormatDataShape(np.shape(frame_indices))
+        frame_indices = np.ascontiguousarray(np.ravel(frame_indices), dtype = np.int64)
+
+    if backend == "gpu":
+        if background is not None or gain is not None or hot_pixel_sigma > 0:
+            raise ValueError("The corrections are not available on the gpu backend.")
+        return _gpu_centered_crown_integration(sed_data, beam_centers, plan, harmonic_orders,
+                                               frame_indices, detector_mask, subpixel,
+                                               dtype, format_shape, phi_vals)
+    if backend != "cpu":
+        raise ValueError(f"Unknown backend: {backend}")
+
+    # Per-frame backgrounds are sliced along with the beam centers. The
+    # chunk frame indices, if any, follow them.
+    image_background, frame_backgrounds = _background_arrays(background, sed_data.shape[-2:],
+                                                             sed_data.shape[0])
+    frame_arrays = (beam_centers,) if frame_backgrounds is None else (beam_centers,
+                                                                      frame_backgrounds)
+    if gain is not None:
+        gain = np.ascontiguousarray(gain, dtype = np.float32)
+
+    def kernel_kwargs(chunk_arrays):
+        chunk_frame_indices = chunk_arrays[-1] if frame_indices is not None else None
+        return {"frame_indices": chunk_frame_indices, "detector_mask": detector_mask,
+                "subpixel": subpixel, "dtype": dtype,
+                **_correction_kwargs(image_background, chunk_arrays, frame_backgrounds,
+                                     gain, hot_pixel_sigma)}
+
+    if harmonic_orders is not None:
+        azi_intensities, harmonics = io.map_stack_chunks(
+            lambda chunk, chunk_beam_centers, *chunk_arrays:
+                plan.integrate_centered_harmonics(chunk, chunk_beam_centers,
+                                                  list(harmonic_orders), n_threads,
+                                                  **kernel_kwargs(chunk_arrays)),
+            sed_data, *frame_arrays, frame_indices = frame_indices)
+        return format_shape.to_2D(azi_intensities), phi_vals, format_shape.to_2D(harmonics)
+
+    azi_intensities = io.map_stack_chunks(lambda chunk, chunk_beam_centers, *chunk_arrays:
+                                              plan.integrate_centered(chunk,
+                                                                      chunk_beam_centers,
+                                                                      n_threads,
+                                                                      **kernel_kwargs(chunk_arrays)),
+                                          sed_data, *frame_arrays,
+                                          frame_indices = frame_indices)
+
+    return format_shape.to_2D(azi_intensities), phi_vals
+
+
+def _gpu_centered_crown_integration(sed_data, beam_centers, plan, harmonic_orders,
+                                    frame_indices, detector_mask, subpixel, dtype,
+                                    format_shape, phi_vals):
+    """
+    centered_crown_integration with the CUDA kernels. The harmonics are
+    computed from the profiles while they are still on the device.
+    """
+    from biosed import gpu
+
+    if subpixel:
+        raise ValueError("Subpixel integration is not available on the gpu backend.")
+    if harmonic_orders is not None and plan.multi_ring:
+        raise ValueError("Harmonics need a single ring plan.")
+
+    azi_intensities = gpu.centered_crown_integration(sed_data, beam_centers, plan,
+                                                     frame_indices, detector_mask,
+                                                     keep_on_device = True)
+    if harmonic_orders is not None:
+        harmonics = gpu.cp.asnumpy(gpu.harmonics(azi_intensities, list(harmonic_orders)))
+    azi_intensities = gpu.cp.asnumpy(azi_intensities).astype(dtype, copy = False)
+
+    if harmonic_orders is not None:
+        return format_shape.to_2D(azi_intensities), phi_vals, format_shape.to_2D(harmonics)
+    return format_shape.to_2D(azi_intensities), phi_vals
+
+
+def cake_integration(sed_data,
+    beam_centers = None,
+    n_q_bins = config.get("integration.n_q_bins"),
+    n_phi_bins = config.get("integration.n_phi_bins"),
+    q_range = config.get("integration.q_range"),
+    q_callibration = config.get("integration.q_callibration"),
+    trimming_radius = config.get("preprocess.trim_radius"),
+    n_threads = config.get("parallel.n_threads"),
+    frame_indices = None,
+    detector_mask = None,
+    subpixel = config.get("integration.subpixel")):
+    """
+    Computes the (q, phi) cake of every detector image in a single pass:
+    the sum and the number of pixels of every q and phi bin, for ring
+    finding and background subtraction.
+
+    Parameters
+    ----------
+    sed_data : NumPy Array (3D or 4D)
+        Centered detector images, or raw images if beam_centers is given.
+        Memory-mapped arrays and HDF5 datasets are processed chunk by chunk.
+    beam_centers : NumPy Array (2D or 3D), optional
+        Beam centers of uncentered images, see centered_crown_integration.
+    n_q_bins : int, optional
+        The number of q bins between the limits of q_range.
+    n_phi_bins : int, optional
+        The number of phi bins.
+    q_range : tuple, optional
+        The q range of the cake.
+    q_callibration : float, optional
+        Units: nm-1 / pixel.
+    trimming_radius : int, optional
+        Radius of the crop around the beam center, used with beam_centers.
+    n_threads : int, optional
+        Number of threads used by the C++ extension. 0 uses all available
+        cores.
+    frame_indices : NumPy Array (int), optional
+        Images to process, used with beam_centers. See
+        centered_crown_integration.
+    detector_mask : NumPy Array (2D, bool), optional
+        Pixels of the raw images that are skipped, used with beam_centers.
+    subpixel : bool, optional
+        Place the cake at the fractional beam centers, used with
+        beam_centers.
+
+    Returns
+    -------
+    tuple
+        (sums, counts, q_vals, phi_vals). sums (float32) and counts (int32)
+        have the shape (..., n_q_bins, n_phi_bins), q_vals and phi_vals are
+        the bin centers. sums / counts is the mean intensity of a bin.
+
+    Notes
+    -----
+    The q bins are the rings of a multi-ring CrownIntegrationPlan, with
+    half-open q ranges so that every pixel is in a single bin. The plan is
+    cached like in get_integration_plan.
+
+    Examples
+    --------
+    >>> sums, counts, q_vals, phi_vals = cake_integration(data, data_beamCenters)
+    >>> plt.imshow((sums / counts)[0], extent = (0, 360, q_vals[-1], q_vals[0]))
+    """
+
+    # Sanity checks
+    if (sed_data.ndim < 3):
+        raise Exception("""The data should be a 3D or 4D array, corresponding
+            to the shape (image_indicies, QY, QX)""")
 
     if isinstance(sed_data, np.ma.MaskedArray):
-        azi_intensities = compute_crown_integral(sed_data.data, n_phi_bins, q_range, q_callibration)
+        sed_data = sed_data.data
+
+    format_shape = FormatDataShape(sed_data.shape[:-2])
+    if isinstance(sed_data, np.ndarray):
+        sed_data = format_shape.to_1D(sed_data)
+
+    # The upper limit of every q bin but the last is excluded
+    q_edges = np.linspace(q_range[0], q_range[1], n_q_bins + 1)
+    q_ranges = [(q_edges[i], q_edges[i+1] if i == n_q_bins - 1 else np.nextafter(q_edges[i+1], -np.inf))
+                for i in range(n_q_bins)]
+    q_vals = 0.5 * (q_edges[:-1] + q_edges[1:])
+
+    if beam_centers is None:
+        plan = get_integration_plan(sed_data.shape[-2:], n_phi_bins, q_ranges, q_callibration)
+        sums, counts = io.map_stack_chunks(lambda chunk: plan.cake(chunk, n_threads), sed_data)
     else:
-        azi_intensities = compute_crown_integral(sed_data, n_phi_bins, q_range, q_callibration)
+        trimmed_edge_width = 2 * trimming_radius + 1
+        plan = get_integration_plan((trimmed_edge_width, trimmed_edge_width),
+                                    n_phi_bins, q_ranges, q_callibration)
 
-    return format_shape.to_2D(azi_intensities), phi_vals
-    
\ No newline at end of file
+        beam_centers = FormatDataShape(beam_centers.shape[:-1]).to_1D(beam_centers)
+        if sed_data.shape[0] != beam_centers.shape[0]:
+            raise Exception("Number of images does not match number of beam center coordinates.")
+        beam_centers = np.ascontiguousarray(beam_centers, dtype = np.float64)
+        if detector_mask is not None:
+            detector_mask = np.ascontiguousarray(detector_mask, dtype = bool)
+
+        if frame_indices is not None:
+            format_shape = FormatDataShape(np.shape(frame_indices))
+            frame_indices = np.ascontiguousarray(np.ravel(frame_indices), dtype = np.int64)
+
+        sums, counts = io.map_stack_chunks(
+            lambda chunk, chunk_beam_centers, *chunk_frame_indices:
+                plan.cake_centered(chunk, chunk_beam_centers, n_threads, *chunk_frame_indices,
+                                   detector_mask = detector_mask, subpixel = subpixel),
+            sed_data, beam_centers, frame_indices = frame_indices)
+
+    phi_vals = _phi_values(plan)[0]
+
+    return format_shape.to_2D(sums), format_shape.to_2D(counts), q_vals, phi_vals
@@ -22,6 +22,310 @@ import numpy as np
 import h5py
 import cv2 as cv
 import os
+from concurrent.futures import ThreadPoolExecutor
+
+from .config import config
+
+def list_data_files(image_directory):
+    """
+    Lists the detector image files of a directory in loading order.
+
+    Parameters
+    ----------
+    image_directory : string
+        Directory of the detector images.
+
+    Returns
+    -------
+    list
+        Sorted full paths of the image files.
+    """
+    file_names = os.listdir(image_directory)
+    file_names.sort()
+    return [os.path.join(image_directory, i) for i in file_names]
+
+
+def _read_frame(file_path):
+    frame = cv.imread(file_path, cv.IMREAD_UNCHANGED)
+    if frame is None:
+        raise IOError(f"Could not read detector image {file_path}")
+    return frame
+
+
+def load_files(file_paths, n_threads = config.get("io.n_threads"), frame_shape = None):
+    """
+    Loads a list of detector images using OpenCV. The images are decoded on
+    a thread pool (OpenCV releases the GIL while reading) and written
+    straight into a preallocated int16 stack.
+
+    Parameters
+    ----------
+    file_paths : list
+        Paths of the detector images.
+    n_threads : int, optional
+        Number of reader threads, 0 uses one per core. Reading is mostly
+        I/O bound, so more threads than cores can help on network
+        filesystems.
+    frame_shape : tuple, optional
+        (QY, QX) of the stack returned for an empty list of paths.
+
+    Returns
+    -------
+    return_type
+        Array containing the raw image data stack.
+
+    Raises
+    ------
+    ValueError
+        Is raised for an empty list of paths without frame_shape.
+    """
+    if len(file_paths) == 0:
+        if frame_shape is None:
+            raise ValueError("No detector images to load, and no frame shape for an empty stack.")
+        return np.empty((0, *frame_shape), dtype = 'int16')
+
+    first_frame = _read_frame(file_paths[0])
+    image_stack = np.empty((len(file_paths), *first_frame.shape), dtype = 'int16')
+    image_stack[0] = first_frame
+
+    def read_into_stack(index):
+        frame = _read_frame(file_paths[index])
+        if frame.shape != first_frame.shape:
+            raise ValueError(f"Detector image {file_paths[index]} has shape {frame.shape}, "
+                             f"expected {first_frame.shape}")
+        image_stack[index] = frame
+
+    n_threads = n_threads if n_threads > 0 else os.cpu_count() or 1
+    with ThreadPoolExecutor(max_workers = n_threads) as pool:
+        # list() propagates the exceptions of the reader threads
+        list(pool.map(read_into_stack, range(1, len(file_paths))))
+
+    return image_stack
+
+
+def open_raw(filename, frame_shape = (512, 512), dtype = 'int16', offset = 0):
+    """
+    Memory-maps a raw file of detector frames without reading it. Frames
+    are only read from disk when they are accessed.
+
+    Parameters
+    ----------
+    filename : string
+        Path of the raw file.
+    frame_shape : tuple, optional
+        Shape of a single detector frame (QY, QX).
+    dtype : string or NumPy dtype, optional
+        Data type of the pixels in the file.
+    offset : int, optional
+        Size of the file header in bytes.
+
+    Returns
+    -------
+    numpy.memmap
+        Read-only (n_images, QY, QX) stack of the frames in the file.
+
+    Examples
+    --------
+    >>> data = biosed.io.open_raw("/home/tine/test_data/scan_01.raw")
+    >>> beam_centers = biosed.find_beam_centers(data)
+    """
+    frame_bytes = int(np.prod(frame_shape)) * np.dtype(dtype).itemsize
+    n_images = (os.path.getsize(filename) - offset) // frame_bytes
+    return np.memmap(filename, dtype = dtype, mode = 'r', offset = offset,
+                     shape = (n_images, *frame_shape))
+
+
+def open_hdf5_stack(filename, dataset_label):
+    """
+    Opens a (n_images, QY, QX) dataset of an HDF5 file without reading it.
+    The file stays open for as long as the returned dataset is used.
+
+    Parameters
+    ----------
+    filename : string
+        Path of the HDF5 file.
+    dataset_label : string
+        Label of the frame stack in the file.
+
+    Returns
+    -------
+    h5py.Dataset
+        The frame stack. Frames are read chunk by chunk when processed.
+
+    Examples
+    --------
+    >>> data = biosed.io.open_hdf5_stack("scan_01.h5", "frames")
+    >>> beam_centers = biosed.find_beam_centers(data)
+    """
+    dataset = h5py.File(filename, 'r')[dataset_label]
+    if dataset.ndim != 3:
+        raise ValueError(f"Dataset '{dataset_label}' should have the shape (n_images, QY, QX).")
+    return dataset
+
+
+def is_native_stack(sed_data):
+    """
+    Returns True if the C++ extensions can use sed_data without a copy,
+    i.e. it is a C-contiguous int16 NumPy array (memory-mapped or not).
+    """
+    return (isinstance(sed_data, np.ndarray) and sed_data.dtype == np.int16
+            and sed_data.flags['C_CONTIGUOUS'])
+
+
+def stack_chunk_size(sed_data, chunk_frames = config.get("io.chunk_frames")):
+    """
+    Number of frames read at once from a stack that is not in memory. For
+    chunked HDF5 datasets it is rounded up to whole HDF5 chunks.
+    """
+    hdf5_chunks = getattr(sed_data, "chunks", None)
+    if isinstance(hdf5_chunks, tuple) and hdf5_chunks[0] > 0:
+        chunk_frames = -(-chunk_frames // hdf5_chunks[0]) * hdf5_chunks[0]
+    return max(1, chunk_frames)
+
+
+def iterate_stack_chunks(sed_data, chunk_size = None):
+    """
+    Iterates over a stack of frames in chunks that the C++ extensions can
+    use directly. Native stacks (see is_native_stack) are returned as views
+    without copying, other stacks such as HDF5 datasets or memory maps of
+    other data types are read and converted chunk by chunk.
+
+    Parameters
+    ----------
+    sed_data : array-like (3D)
+        Stack of frames, e.g. a NumPy array, numpy.memmap or h5py.Dataset.
+    chunk_size : int, optional
+        Maximum number of frames per chunk. Defaults to stack_chunk_size.
+
+    Yields
+    ------
+    tuple
+        (first_frame_index, chunk) - with chunk a C-contiguous int16 array.
+    """
+    if chunk_size is None:
+        chunk_size = stack_chunk_size(sed_data)
+    for start in range(0, sed_data.shape[0], chunk_size):
+        chunk = sed_data[start:start + chunk_size]
+        if not is_native_stack(chunk):
+            chunk = np.ascontiguousarray(chunk, dtype = 'int16')
+        yield start, chunk
+
+
+def map_stack_chunks(function, sed_data, *frame_arrays, frame_indices = None):
+    """
+    Applies a C++ kernel to a stack of frames. Native stacks are passed in
+    one call, other stacks chunk by chunk (see iterate_stack_chunks) and the
+    results are concatenated along the first axis. Kernels that return a
+    tuple of arrays have every array concatenated separately.
+
+    Parameters
+    ----------
+    function : callable
+        Called as function(chunk, *frame_array_chunks), or with frame_indices
+        as function(chunk, *frame_array_chunks, chunk_frame_indices).
+    sed_data : array-like (3D)
+        Stack of frames.
+    *frame_arrays : NumPy Array
+        Per-frame arrays (e.g. beam centers) sliced along with the chunks.
+    frame_indices : NumPy Array (1D), optional
+        Ascending indices of the frames the kernel processes. They are
+        passed relative to the chunk, and chunks without selected frames
+        are not read.
+    """
+    if is_native_stack(sed_data):
+        if frame_indices is None:
+            return function(sed_data, *frame_arrays)
+        return function(sed_data, *frame_arrays, frame_indices)
+
+    if frame_indices is None:
+        results = [function(chunk, *[i[start:start + chunk.shape[0]] for i in frame_arrays])
+                   for start, chunk in iterate_stack_chunks(sed_data)]
+    else:
+        results = []
+        chunk_size = stack_chunk_size(sed_data)
+        bounds = np.searchsorted(frame_indices,
+                                 np.arange(0, sed_data.shape[0] + chunk_size, chunk_size))
+        for i_chunk, (first, last) in enumerate(zip(bounds[:-1], bounds[1:])):
+            # The last chunk is used for an empty result if nothing is selected
+            if first == last and (results or i_chunk < len(bounds) - 2):
+                continue
+            start = i_chunk * chunk_size
+            chunk = np.ascontiguousarray(sed_data[start:start + chunk_size], dtype = 'int16')
+            results.append(function(chunk, *[i[start:start + chunk.shape[0]] for i in frame_arrays],
+                                    frame_indices[first:last] - start))
+
+    # An empty stack gives the correctly shaped empty output of the kernel
+    if not results:
+        chunk = np.empty((0, *sed_data.shape[1:]), dtype = 'int16')
+        chunk_arrays = [i[:0] for i in frame_arrays]
+        if frame_indices is None:
+            return function(chunk, *chunk_arrays)
+        return function(chunk, *chunk_arrays, frame_indices[:0])
+
+    if isinstance(results[0], tuple):
+        return tuple(np.concatenate(result) for result in zip(*results))
+    return np.concatenate(results)
+
+
+def iterate_data_chunks(data_source, chunk_size,
+                        prefetch = config.get("io.prefetch")):
+    """
+    Loads the image data in chunks of frames, so that scans larger than
+    the memory can be processed. Every chunk is a new array, so it can be
+    modified (e.g. masked) without touching the data source.
+
+    Parameters
+    ----------
+    data_source : string, list or array-like
+        Directory of the detector images, a list of image files, or a stack
+        of frames such as a memory-mapped raw file (open_raw) or an HDF5
+        dataset (open_hdf5_stack).
+    chunk_size : int
+        Maximum number of frames per chunk.
+    prefetch : bool, optional
+        Read the next chunk in the background while the current one is
+        being processed. Needs memory for two chunks.
+
+    Yields
+    ------
+    tuple
+        (first_frame_index, chunk) - index of the first frame of the chunk
+        in the scan and the raw image data stack of the chunk.
+
+    Examples
+    --------
+    >>> for start, chunk in biosed.io.iterate_data_chunks(data_directory, 1000):
+    ...     beam_centers[start:start + len(chunk)] = biosed.find_beam_centers(chunk)
+    """
+    if isinstance(data_source, (str, os.PathLike, list)):
+        file_paths = list_data_files(data_source) if not isinstance(data_source, list) else data_source
+        n_images = len(file_paths)
+
+        def load_chunk(start):
+            return load_files(file_paths[start:start + chunk_size])
+    else:
+        n_images = data_source.shape[0]
+
+        def load_chunk(start):
+            return np.array(data_source[start:start + chunk_size], dtype = 'int16')
+
+    starts = range(0, n_images, chunk_size)
+
+    if not prefetch:
+        for start in starts:
+            yield start, load_chunk(start)
+        return
+
+    with ThreadPoolExecutor(max_workers = 1) as reader:
+        pending = None
+        for start in starts:
+            if pending is None:
+                pending = reader.submit(load_chunk, start)
+            chunk = pending.result()
+            next_start = start + chunk_size
+            pending = reader.submit(load_chunk, next_start) if next_start < n_images else None
+            yield start, chunk
+
 
 def load_data(image_directory):
     """
@@ -41,15 +345,166 @@ def load_data(image_directory):
     >>> data_directory = r"/home/tine/test_data/scan_01"
     >>> data = biosed.load_data(data_directory)
     """
-    file_names = os.listdir(image_directory)
-    file_names.sort()
-    return np.array([cv.imread(os.path.join(image_directory, i),
-        cv.IMREAD_UNCHANGED) for i in file_names], dtype = 'int16')
+    file_paths = list_data_files(image_directory)
+    if len(file_paths) == 0:
+        raise ValueError(f"No detector images found in {image_directory}")
+    return load_files(file_paths)
+
+
+def _compression_options(compression):
+    """
+    Keyword arguments of h5py create_dataset for a compression name.
+    "lzf" and "gzip" are built into h5py, "blosc" (LZ4 with byte shuffle)
+    and "lz4" need the hdf5plugin package.
+    """
+    if compression is None:
+        return {}
+    if compression in ("lzf", "gzip"):
+        return {"compression": compression}
+    if compression in ("blosc", "lz4"):
+        try:
+            import hdf5plugin
+        except ImportError:
+            raise ValueError(f"{compression} compression needs the hdf5plugin package.")
+        if compression == "blosc":
+            return dict(hdf5plugin.Blosc(cname = "lz4", clevel = 5, shuffle = hdf5plugin.Blosc.SHUFFLE))
+        return dict(hdf5plugin.LZ4())
+    raise ValueError(f"Unknown compression {compression}, use lzf, gzip, blosc, lz4 or None.")
+
+
+def _row_chunks(row_shape, itemsize, n_rows, chunk_bytes):
+    """
+    HDF5 chunk shape of whole rows along the first axis. A row is one
+    scan row of a scan-shaped array, or one frame of a linear stack.
+    """
+    row_bytes = max(1, int(np.prod(row_shape)) * itemsize)
+    rows_per_chunk = max(1, min(n_rows, chunk_bytes // row_bytes))
+    return (rows_per_chunk, *row_shape)
+
+
+class HDF5Writer:
+    """
+    Writes many datasets to an HDF5 file that is opened only once. Datasets
+    are stored in chunks of whole rows along their first axis, so that
+    reading a scan row (or a range of frames) touches as few chunks as
+    possible, and compressed with io.compression if it is set.
+
+    Parameters
+    ----------
+    filename : string
+        Path of the HDF5 file. Existing datasets of other labels are kept.
+    compression : string, optional
+        None, "gzip", "lzf", "blosc" or "lz4" (see _compression_options).
+        Only gzip files can be read without h5py or the HDF5 filter plugins.
+    chunk_bytes : int, optional
+        Approximate size of a chunk. Chunks always hold whole rows.
+
+    Examples
+    --------
+    >>> with biosed.io.HDF5Writer("results.h5") as writer:
+    ...     writer.write("orientation_map", orientation_map)
+    ...     writer.write("beam_centers", beam_centers)
+    >>> with biosed.io.HDF5Writer("streamed.h5") as writer:
+    ...     for chunk_profiles in profiles_of_chunks:
+    ...         writer.append("azi_intensity", chunk_profiles)
+    """
+
+    def __init__(self, filename,
+                 compression = config.get("io.compression"),
+                 chunk_bytes = config.get("io.chunk_bytes")):
+        self.filename = filename
+        self._options = _compression_options(compression)
+        self.chunk_bytes = chunk_bytes
+        self.h5file = h5py.File(filename, 'a')
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exception):
+        self.close()
+
+    def close(self):
+        self.h5file.close()
+
+    def _create(self, dataset_label, data, maxshape = None):
+        data = np.asarray(data)
+        if dataset_label in self.h5file:
+            del self.h5file[dataset_label]
+        # Scalars and empty arrays can not be chunked
+        if data.ndim == 0 or (data.size == 0 and maxshape is None):
+            return self.h5file.create_dataset(dataset_label, data = data)
+        chunks = _row_chunks(data.shape[1:], data.dtype.itemsize, max(1, data.shape[0]),
+                             self.chunk_bytes)
+        return self.h5file.create_dataset(dataset_label, data = data, chunks = chunks,
+                                          maxshape = maxshape, **self._options)
+
+    def write(self, dataset_label, data):
+        """
+        Writes data as dataset_label, replacing an existing dataset.
+        """
+        self._create(dataset_label, data)
+
+    def append(self, dataset_label, rows):
+        """
+        Appends rows along the first axis of dataset_label, creating it on
+        the first call. Used to store the results of streaming and live
+        analysis as they are computed.
+        """
+        rows = np.asarray(rows)
+        # A dataset that can not grow is replaced
+        if dataset_label not in self.h5file or self.h5file[dataset_label].maxshape[0] is not None:
+            # The chunks of a growing dataset are sized for a large number of rows
+            n_chunk_rows = _row_chunks(rows.shape[1:], rows.dtype.itemsize, np.iinfo(np.int64).max,
+                                       self.chunk_bytes)[0]
+            if dataset_label in self.h5file:
+                del self.h5file[dataset_label]
+            self.h5file.create_dataset(dataset_label, data = rows,
+                                       chunks = (n_chunk_rows, *rows.shape[1:]),
+                                       maxshape = (None, *rows.shape[1:]), **self._options)
+            return
+        dataset = self.h5file[dataset_label]
+        if dataset.shape[1:] != rows.shape[1:]:
+            raise ValueError(f"Rows of shape {rows.shape[1:]} can not be appended to "
+                             f"'{dataset_label}' of shape {dataset.shape}.")
+        n_rows = dataset.shape[0]
+        dataset.resize(n_rows + rows.shape[0], axis = 0)
+        dataset[n_rows:] = rows
+
+    def write_results(self, **datasets):
+        """
+        Writes every dataset given as a keyword argument, see write. None
+        values are skipped.
+        """
+        for dataset_label, data in datasets.items():
+            if data is not None:
+                self.write(dataset_label, data)
+
+    def flush(self):
+        """
+        Writes the buffered data to disk, e.g. after every row in live mode.
+        """
+        self.h5file.flush()
+
+
+def save_results(filename, **datasets):
+    """
+    Saves several datasets to an HDF5 file in a single open, see HDF5Writer.
+    None values are skipped.
+
+    Examples
+    --------
+    >>> biosed.io.save_results("scan_01.h5", orientation_map = orientation_map,
+                               beam_centers = beam_centers)
+    """
+    with HDF5Writer(filename) as writer:
+        writer.write_results(**datasets)
 
 
 def save_to_hdf5(dataset, dataset_label, filename):
     """
     Save a dataset to an HDF5 file. If the file already exists, the dataset will be added.
+    To save several datasets, use save_results or HDF5Writer, which open
+    the file only once.
 
     Parameters:
         dataset (numpy.ndarray): The data to save.
@@ -63,13 +518,9 @@ def save_to_hdf5(dataset, dataset_label, filename):
     >>> plt.plot(phi, intensity)
     """
 
-    with h5py.File(filename, 'a') as h5file:
-        if dataset_label in h5file:
-            print(f"Dataset '{dataset_label}' already exists in {filename}. Overwriting it.")
-            del h5file[dataset_label]  # Delete existing dataset with the same label
-        # Create the dataset with the given label
-        h5file.create_dataset(dataset_label, data=dataset)
-        print(f"Dataset '{dataset_label}' saved to {filename}.")
+    # An existing dataset with the same label is overwritten
+    with HDF5Writer(filename) as writer:
+        writer.write(dataset_label, dataset)
 
 
 def load_from_hdf5(filename, dataset_label = None):
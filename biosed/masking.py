@@ -28,8 +28,34 @@ default_mask[255:257,:] = True
 default_mask[:,255:257] = True
 
 
-def mask_data(sed_data):
-    full_mask = np.tile(config.get("masking.detector_mask")[np.newaxis, :], (sed_data.shape[0], 1, 1))
-    sed_data[full_mask] = config.get("masking.masking_value")
-    sed_data = np.ma.masked_array(sed_data, full_mask)
-    return sed_data
+def mask_data(sed_data,
+              detector_mask = config.get("masking.detector_mask"),
+              masking_value = config.get("masking.masking_value")):
+    """
+    Sets the masked detector pixels of every image to masking_value, in
+    place, and returns the images as a masked array. The 2D mask is
+    broadcast over the images, so no per-image copy of the mask is made.
+
+    Parameters
+    ----------
+    sed_data : NumPy Array (3D or 4D)
+        Detector image array. Indexing: (image_index, QY, QX)
+    detector_mask : NumPy Array (2D, bool), optional
+        True for the pixels to mask.
+    masking_value : int, optional
+        Value written to the masked pixels.
+
+    Returns
+    -------
+    NumPy MaskedArray
+        sed_data, with the masked pixels set, masked by a read-only
+        broadcast view of the detector mask.
+
+    Notes
+    -----
+    The C++ kernels (beam finding, centered integration) accept the
+    detector mask directly, so the pipeline does not need this function.
+    """
+    detector_mask = np.asarray(detector_mask, dtype = bool)
+    sed_data[..., detector_mask] = masking_value
+    return np.ma.masked_array(sed_data, np.broadcast_to(detector_mask, sed_data.shape))
@@ -19,10 +19,14 @@
 
 from biosed.config import config
 from biosed.utilities import FormatDataShape
+from biosed.integration import get_integration_plan
 
 import numpy as np
 from lmfit import Model, Parameters
 
+from ._cpp.odf_fitting import fit_poisson_odf as compute_poisson_odf_fits    # C++ extension
+from ._cpp.harmonics import compute_harmonics    # C++ extension
+
 def poisson_odf(phi, phi_0, eta, C):
     """
     Orientation distribution function model based on the Poisson kernel.
@@ -73,6 +77,9 @@ poisson_odf_params.add('C', value=1.0, min=0)
 def fit_poisson_odf(azi_intensities,
                     phi,
                     weight_exponent = config.get("orientation.weighing_exponent"),
+                    backend = config.get("orientation.fit_backend"),
+                    n_threads = config.get("parallel.n_threads"),
+                    initial_guess = config.get("orientation.fit_initial_guess"),
                     ):
     """
     Fits the Poisson model to azimuthal intensity data array.
@@ -85,6 +92,21 @@ def fit_poisson_odf(azi_intensities,
     phi : NumPy Array (1D)
         phi values corresponding to the third dimension of the
         intensities array. In degrees.
+    weight_exponent : float, optional
+        The fit is weighted with intensity**weight_exponent.
+    backend : str, optional
+        "native" fits all profiles with the C++ Levenberg-Marquardt fitter
+        in parallel. "lmfit" fits the profiles one by one with lmfit. Both
+        use the bounds of poisson_odf_params and omit NaN points.
+    n_threads : int, optional
+        Number of threads of the native backend. 0 uses all available cores.
+    initial_guess : str, optional
+        Starting point of the fits. "fixed" starts every fit from the
+        initial values of poisson_odf_params. "harmonic" starts phi_0 from
+        the phase of the second harmonic of each profile. "neighbor" starts
+        each fit from the converged fit of the previous scan point (in
+        raster order), and falls back to the harmonic start after fits that
+        ended on a bound.
 
     Returns
     -------
@@ -92,6 +114,18 @@ def fit_poisson_odf(azi_intensities,
         Array containing the fitting results. Shape is (image_index, fitted_params).
         The fitted parameters (2nd dimension) are indexed [phi_0, eta, C].
 
+    Notes
+    -----
+    The native backend maps the bounds the same way as lmfit, but starts
+    from the least-squares optimal C for the initial phi_0 and eta. This
+    makes it converge more reliably; fits that lmfit gets right agree to
+    within the fit tolerance.
+
+    Neighboring scan points usually have similar orientations, so warm
+    starts need fewer iterations and are less likely to end in a local
+    minimum. The native backend restarts the neighbor chain every 256
+    profiles, so the results do not depend on the number of threads.
+
     Examples
     --------
     >>> fits = biosed.fit_poisson_model(data_azi_intensities, phi_vals)
@@ -101,11 +135,43 @@ def fit_poisson_odf(azi_intensities,
     format_shape = FormatDataShape(azi_intensities.shape[:-1])
     azi_intensities = format_shape.to_1D(azi_intensities)
 
+    if initial_guess not in ("fixed", "harmonic", "neighbor"):
+        raise ValueError(f"Unknown initial guess: {initial_guess}")
+
+    if initial_guess == "fixed":
+        initial_params = None
+    else:
+        initial_params = _harmonic_initial_params(azi_intensities, phi)
+
+    if backend == "native":
+        fitting_results = compute_poisson_odf_fits(
+            np.ascontiguousarray(azi_intensities, dtype = np.float64),
+            np.ascontiguousarray(phi * (np.pi/180), dtype = np.float64),
+            weight_exponent,
+            (poisson_odf_params['eta'].min, poisson_odf_params['eta'].max),
+            config.get("orientation.fit_max_iterations"),
+            n_threads,
+            initial_params = initial_params,
+            warm_start = initial_guess == "neighbor")
+        return format_shape.to_2D(fitting_results)
+    elif backend != "lmfit":
+        raise ValueError(f"Unknown fitting backend: {backend}")
+
     fitting_results = np.zeros((*format_shape.get_shape_1D, 3))
+    params = poisson_odf_params.copy()
+    previous_converged = False
 
     for index, azi_int in enumerate(azi_intensities):
+        if initial_guess == "neighbor" and previous_converged:
+            fit_params = params
+        elif initial_params is not None:
+            fit_params = poisson_odf_params.copy()
+            fit_params['phi_0'].value = initial_params[index, 0]
+        else:
+            fit_params = poisson_odf_params
+
         fit_i = poisson_odf_model.fit(azi_int, phi = phi * (np.pi/180),
-            params = poisson_odf_params,
+            params = fit_params,
             weights = azi_int**weight_exponent,
             nan_policy = 'omit')
         
@@ -113,12 +179,46 @@ def fit_poisson_odf(azi_intensities,
                                   fit_i.params['eta'].value,
                                   fit_i.params['C'].value]
 
+        params = fit_i.params
+        previous_converged = not any(_at_bound(params[name]) for name in ('phi_0', 'eta'))
+
     #print(fitting_results.shape)
 
     return format_shape.to_2D(fitting_results)
 
 
 
+def _harmonic_initial_params(azi_intensities, phi):
+    """
+    Initial Poisson ODF parameters with phi_0 taken from the phase of the
+    second harmonic of each profile. NaN points do not contribute. Eta and
+    C start from the values of poisson_odf_params.
+    """
+
+    phi_rad = phi * (np.pi/180)
+    azi_intensities = np.nan_to_num(azi_intensities, nan = 0.0)
+    phase = np.arctan2(-(azi_intensities @ np.sin(2 * phi_rad)),
+                       azi_intensities @ np.cos(2 * phi_rad))
+
+    initial_params = np.empty((azi_intensities.shape[0], 3))
+    initial_params[:, 0] = (-0.5 * phase) % np.pi
+    initial_params[:, 1] = poisson_odf_params['eta'].value
+    initial_params[:, 2] = poisson_odf_params['C'].value
+
+    return initial_params
+
+
+def _at_bound(parameter):
+    """
+    Whether a fitted lmfit parameter is not finite or at one of its bounds.
+    """
+
+    tolerance = 1e-6 * (parameter.max - parameter.min)
+    return (not np.isfinite(parameter.value)
+            or parameter.value - parameter.min < tolerance
+            or parameter.max - parameter.value < tolerance)
+
+
 def find_orientation_peaks(azi_intensities, phi):
     """
     Determines the preferential orientation from an azimuthal intensity
@@ -163,10 +263,13 @@ def find_orientation_peaks(azi_intensities, phi):
     return format_shape.to_2D(peaks)
 
 
-def harmonic_analysis(azi_intensities, phi):
+def harmonic_analysis(azi_intensities, phi,
+    n_threads = config.get("parallel.n_threads"),
+    return_alignment = False):
     """
     Determines the preferential orientation from the phase of the second
-    harmonic, computed from the DFS of the azimuthal intensity data.
+    harmonic of the azimuthal intensity data. Only the needed Fourier
+    coefficients are computed, with a C++ extension.
 
     Parameters
     ----------
@@ -176,12 +279,18 @@ def harmonic_analysis(azi_intensities, phi):
     phi : NumPy Array (1D)
         phi values corresponding to the third dimension of the
         intensities array. In degrees.
+    n_threads : int, optional
+        Number of threads used by the C++ extension. 0 uses all available
+        cores.
+    return_alignment : bool, optional
+        Also return the degree of alignment (see harmonic_orientation).
 
     Returns
     -------
     NumPy NDArray
         Array with the phi values of the highest intensity
-        (between 0 and 180 degrees).
+        (between 0 and 180 degrees). With return_alignment, a tuple
+        (orientation, alignment).
 
     Examples
     --------
@@ -194,81 +303,129 @@ def harmonic_analysis(azi_intensities, phi):
  
     azi_intensities = format_shape.to_1D(azi_intensities)
 
-    azi_intensities_fft = np.fft.fft(azi_intensities)
-    phase = np.angle(azi_intensities_fft[:,2])
-    orientation = (-0.5 * phase) %np.pi
-    
+    harmonics = compute_harmonics(np.ascontiguousarray(azi_intensities, dtype = np.float64),
+                                  [0, 2], n_threads)
+    orientation, alignment = harmonic_orientation(harmonics)
+
+    if return_alignment:
+        return format_shape.to_2D(orientation), format_shape.to_2D(alignment)
     return format_shape.to_2D(orientation)
 
 
-def find_principal_components(sed_data,
-    q_range = config.get("integration.q_range"),
-    q_callibration = config.get("integration.q_callibration")):
+def harmonic_orientation(harmonics):
+    """
+    Orientation and degree of alignment from the 0th and 2nd Fourier
+    coefficients of the azimuthal intensity profiles, as returned by
+    crown_integration with harmonic_orders = (0, 2).
 
+    Parameters
+    ----------
+    harmonics : NumPy Array (complex)
+        Fourier coefficients with the last axis indexed [0th, 2nd].
 
-    # Formatting
-    format_shape = FormatDataShape(sed_data.shape[:-2])
-    sed_data = format_shape.to_1D(sed_data)
+    Returns
+    -------
+    tuple
+        (orientation, alignment). The orientation is the phase of the 2nd
+        harmonic (between 0 and pi), as in harmonic_analysis. The alignment
+        is 2 * |F2| / F0, the amplitude of the cos(2 phi) modulation
+        relative to the mean intensity. It is 0 for isotropic profiles.
 
-    # Make the meshgrid  
-    n_images, nQY, nQX = sed_data.shape
-    det_axis = np.linspace(- q_callibration * nQY/2, q_callibration * nQY/2, nQY)
+    Examples
+    --------
+    >>> azi_intensities, phi_vals, harmonics = biosed.crown_integration(
+            data_centered, harmonic_orders = (0, 2))
+    >>> orientation, alignment = biosed.harmonic_orientation(harmonics)
+    """
 
-    QY, QX = np.meshgrid(det_axis, det_axis, indexing = "ij")
+    orientation = (-0.5 * np.angle(harmonics[..., 1])) % np.pi
 
-    # Flatten qy and qz
-    QY_flat = QY.ravel()
-    QX_flat = QX.ravel()
+    with np.errstate(divide = 'ignore', invalid = 'ignore'):
+        alignment = 2 * np.abs(harmonics[..., 1]) / harmonics[..., 0].real
 
-    # Initialize result arrays
-    orientation = np.zeros(n_images)
-    anisotropy = np.zeros(n_images)
-    aspect_ratio = np.zeros(n_images)
+    return orientation, alignment
 
-    for i in range(n_images):
-        I = np.ma.copy(sed_data[i])
-        mask_i = I.mask
 
-        pca_mask = np.copy(mask_i).ravel()
-        pca_mask[np.sqrt(QY_flat**2 + QX_flat**2) < q_range[0]] = True
-        pca_mask[np.sqrt(QY_flat**2 + QX_flat**2) > q_range[1]] = True
+def find_principal_components(sed_data,
+    q_range = config.get("integration.q_range"),
+    q_callibration = config.get("integration.q_callibration"),
+    beam_centers = None,
+    trimming_radius = config.get("preprocess.trim_radius"),
+    plan = None,
+    n_threads = config.get("parallel.n_threads"),
+    detector_mask = None):
+    """
+    Determines the preferential orientation from the intensity-weighted
+    principal components of the pixels inside the q range.
 
-        # Mask I, qy, and qz
-        I.mask = pca_mask
-        I_masked = I.compressed()
-        QY_masked = np.ma.array(QY_flat, mask=pca_mask.ravel()).compressed()
-        QX_masked = np.ma.array(QX_flat, mask=pca_mask.ravel()).compressed()
+    Parameters
+    ----------
+    sed_data : NumPy Array (3D or 4D)
+        Centered (masked) detector image array, or raw images if
+        beam_centers is given. Indexing: (image_index, QY, QX)
+    q_range : tuple, optional
+        The q range of the studied Bragg reflection.
+    q_callibration : float, optional
+        Units: nm-1 / pixel.
+    beam_centers : NumPy Array (2D or 3D), optional
+        Beam centers of uncentered images. The q range is then placed
+        around the beam center of every image, like in
+        integration.centered_crown_integration.
+    trimming_radius : int, optional
+        Radius of the crop around the beam center, used with beam_centers.
+    plan : CrownIntegrationPlan, optional
+        Precomputed geometry, see integration.get_integration_plan. Only
+        its pixel list is used, so the number of phi bins does not matter.
+    n_threads : int, optional
+        Number of threads used by the C++ extension. 0 uses all available
+        cores.
+    detector_mask : NumPy Array (2D, bool), optional
+        Pixels of the raw images that are skipped, used with beam_centers.
+        None uses all pixels.
 
-        # Compute mean and centered arrays
-        total_intensity = np.sum(I_masked)
-        QY_mean = np.sum(I_masked * QY_masked) / total_intensity
-        QX_mean = np.sum(I_masked * QX_masked) / total_intensity
-        
-        QY_centered = QY_masked - QY_mean
-        QX_centered = QX_masked - QX_mean
+    Returns
+    -------
+    tuple
+        (orientation, anisotropy, aspect_ratio). The orientation of the
+        major axis is between 0 and pi. The anisotropy is
+        (l1 - l2) / (l1 + l2) and the aspect ratio sqrt(l1 / l2), with
+        l1 > l2 the eigenvalues of the covariance matrix.
+
+    Notes
+    -----
+    The images are processed in parallel by the C++ extension, using the
+    same pixels as crown integration. Masked (negative) pixels are skipped.
+
+    Examples
+    --------
+    >>> orientation, anisotropy, aspect_ratio = biosed.find_principal_components(data_centered)
+    >>> biosed.orientation_plot(orientation)
+    """
+
+    if isinstance(sed_data, np.ma.MaskedArray):
+        sed_data = sed_data.data
+
+    # Formatting
+    format_shape = FormatDataShape(sed_data.shape[:-2])
+    sed_data = np.ascontiguousarray(format_shape.to_1D(sed_data), dtype = np.int16)
+
+    if beam_centers is None:
+        if plan is None:
+            plan = get_integration_plan(sed_data.shape[-2:], q_range = q_range,
+                                        q_callibration = q_callibration)
+        components = plan.principal_components(sed_data, n_threads)
+    else:
+        if plan is None:
+            trimmed_edge_width = 2 * trimming_radius + 1
+            plan = get_integration_plan((trimmed_edge_width, trimmed_edge_width),
+                                        q_range = q_range, q_callibration = q_callibration)
+        beam_centers = FormatDataShape(beam_centers.shape[:-1]).to_1D(beam_centers)
+        if detector_mask is not None:
+            detector_mask = np.ascontiguousarray(detector_mask, dtype = bool)
+        components = plan.principal_components_centered(
+            sed_data, np.ascontiguousarray(beam_centers, dtype = np.float64), n_threads,
+            detector_mask = detector_mask)
+
+    orientation, anisotropy, aspect_ratio = components.T
 
-        # Calculate and construct covariance matrix
-        cov_YY = np.sum(I_masked * QY_centered**2) / total_intensity
-        cov_XX = np.sum(I_masked * QX_centered**2) / total_intensity
-        cov_YX = np.sum(I_masked * QY_centered * QX_centered) / total_intensity
-        
-        C = np.array([[cov_YY, cov_YX], [cov_YX, cov_XX]])
-        
-        # Get eigenvalues
-        eigenvalues, eigenvectors = np.linalg.eigh(C)
-        
-        # Sort eigenvalues and eigenvectors (in descending order)
-        idx = eigenvalues.argsort()[::-1]
-        eigenvalues = eigenvalues[idx]
-        eigenvectors = eigenvectors[:, idx]
-        
-        # Calculate structure orientation angle
-        orientation[i] = np.arctan2(eigenvectors[0, 0], eigenvectors[1, 0]) % np.pi
-        
-        # Calculate anisotropy parameter
-        anisotropy[i] = (eigenvalues[0] - eigenvalues[1]) / np.sum(eigenvalues)
-        
-        # Calculate aspect ratio
-        aspect_ratio[i] = np.sqrt(eigenvalues[0] / eigenvalues[1])
-    
     return format_shape.to_2D(orientation), format_shape.to_2D(anisotropy), format_shape.to_2D(aspect_ratio)
@@ -20,12 +20,19 @@
 
 import numpy as np
 
+from biosed import io
 from biosed.config import config
 from biosed.utilities import FormatDataShape
 from ._cpp.center_of_mass import compute_centers_of_mass    # C++ extension
+from ._cpp.center_of_mass import bin_images as compute_binned_images
 
 def find_beam_centers(sed_data,
-					  direct_beam_threshold = config.get("preprocess.direct_beam_threshold")):
+					  direct_beam_threshold = config.get("preprocess.direct_beam_threshold"),
+					  n_threads = config.get("parallel.n_threads"),
+					  window_radius = config.get("preprocess.beam_window_radius"),
+					  detector_mask = None,
+					  dtype = config.get("preprocess.dtype"),
+					  backend = config.get("parallel.backend")):
     """
     Find the beam centers for each detector image in a 1D stack.
 
@@ -33,10 +40,31 @@ def find_beam_centers(sed_data,
     ----------
     sed_data : NumPy NDArray.
         1D stack of detector images (NumPy array). The shape is taken as
-        (n_images, detector_QY, detector_QX).
+        (n_images, detector_QY, detector_QX). Memory-mapped arrays and HDF5
+        datasets (see io.open_raw and io.open_hdf5_stack) are processed
+        chunk by chunk without loading the full stack.
     direct_beam_threshold : int, optional.
         Only pixels with intensity above this threshold will be considered
         for the calculation of the beam centers.
+    n_threads : int, optional.
+        Number of threads used by the C++ extension. 0 uses all available
+        cores. The result does not depend on the number of threads.
+    window_radius : int, optional.
+        If above 0, the beam is located with a full detector scan and then
+        tracked from frame to frame in a square window of this radius around
+        the previous center. Pixels above the threshold outside the window
+        are ignored. A full scan is repeated whenever the window loses the
+        beam. 0 always scans the full detector.
+    detector_mask : NumPy Array (2D, bool), optional.
+        Pixels that are True are skipped. The mask is applied inside the
+        C++ extension, so the data is not modified. None uses all pixels.
+    dtype : str or NumPy dtype, optional.
+        Output type, float64 or float32. The centers are computed from exact
+        integer sums either way.
+    backend : str, optional.
+        "cpu" runs the C++ extension, "gpu" the CUDA kernel of biosed.gpu
+        (needs CuPy). The GPU always scans the full detector, window_radius
+        is ignored there.
 
     Returns
     -------
@@ -46,14 +74,15 @@ def find_beam_centers(sed_data,
 
     Raises
     ------
-    ExceptionType
-        Description of conditions when this exception is raised.
+    ValueError
+        Is raised when the mask does not have the shape of a detector image.
 
     Notes
     -----
     The function calls the C++ extension for calculating the centers of mass
     of the stack of images for memory and speed efficiency. If the mask is
-    not set, all pixel values will be used in the calculation.
+    not set, all pixel values will be used in the calculation. The GIL is
+    released while the extension runs.
 
     Examples
     --------
@@ -62,12 +91,198 @@ def find_beam_centers(sed_data,
     """
 
     if isinstance(sed_data, np.ma.MaskedArray):
-        return compute_centers_of_mass(sed_data.data, direct_beam_threshold)
-    else:
-        return compute_centers_of_mass(sed_data, direct_beam_threshold)
+        sed_data = sed_data.data
+
+    detector_mask = _check_detector_mask(detector_mask, sed_data.shape[-2:])
+
+    if backend == "gpu":
+        from biosed import gpu
+        return gpu.find_beam_centers(sed_data, direct_beam_threshold,
+                                     detector_mask).astype(dtype, copy = False)
+    if backend != "cpu":
+        raise ValueError(f"Unknown backend: {backend}")
+
+    return io.map_stack_chunks(lambda chunk: compute_centers_of_mass(chunk,
+                                                                     direct_beam_threshold,
+                                                                     n_threads,
+                                                                     window_radius,
+                                                                     detector_mask,
+                                                                     np.dtype(dtype).name),
+                               sed_data)
+
+
+def bin_images(sed_data,
+               binning = config.get("preview.binning"),
+               frame_step = config.get("preview.frame_step"),
+               n_threads = config.get("parallel.n_threads"),
+               detector_mask = None):
+    """
+    Bins the detector images of a 1D stack for a fast preview of a scan.
+
+    Parameters
+    ----------
+    sed_data : NumPy NDArray
+        1D stack of detector images. Memory-mapped arrays and HDF5 datasets
+        are read chunk by chunk, and only the frames that are kept are read.
+    binning : int, optional
+        Edge length of the square blocks of pixels that are averaged, e.g.
+        2 or 4. Rows and columns after the last whole block are dropped.
+    frame_step : int, optional
+        Only every frame_step-th frame is kept.
+    n_threads : int, optional
+        Number of threads used by the C++ extension. 0 uses all cores.
+    detector_mask : NumPy Array (2D, bool), optional
+        Pixels that are True are left out of the averages. None uses all
+        pixels.
+
+    Returns
+    -------
+    NumPy NDArray
+        (ceil(n_images / frame_step), QY // binning, QX // binning) int16
+        stack. Every pixel is the rounded mean of the unmasked, non-negative
+        pixels of its block, or -1 where there are none, so the stack can be
+        used like masked data by the other functions.
+
+    Examples
+    --------
+    >>> preview_data = bin_images(data, binning = 4, frame_step = 2)
+    """
+
+    if isinstance(sed_data, np.ma.MaskedArray):
+        sed_data = sed_data.data
+
+    detector_mask = _check_detector_mask(detector_mask, sed_data.shape[-2:])
+
+    if io.is_native_stack(sed_data):
+        return compute_binned_images(sed_data, binning, frame_step, n_threads, detector_mask)
+
+    # Whole steps per chunk, so every chunk starts with a kept frame
+    chunk_size = io.stack_chunk_size(sed_data) * frame_step
+    binned = [compute_binned_images(np.ascontiguousarray(sed_data[start:start + chunk_size:frame_step],
+                                                         dtype = 'int16'),
+                                    binning, 1, n_threads, detector_mask)
+              for start in range(0, sed_data.shape[0], chunk_size)]
+    return np.concatenate(binned)
+
+
+def unbin_beam_centers(beam_centers, binning = config.get("preview.binning"),
+                       frame_step = config.get("preview.frame_step"), n_images = None):
+    """
+    Beam centers of binned images (see bin_images) in the pixels of the full
+    detector, i.e. the centers of their blocks. With frame_step, the centers
+    of the frames that were left out are interpolated linearly between the
+    kept frames, so the result can be used like the beam centers of the full
+    stack, e.g. for find_scan_limits. Images without a beam (-1) stay -1.
+
+    Parameters
+    ----------
+    beam_centers : NumPy Array (2D)
+        (n_binned_images, 2) beam centers of the binned images.
+    binning : int, optional
+        Binning of the images.
+    frame_step : int, optional
+        Frame step of the binned images.
+    n_images : int, optional
+        Number of images of the full stack. Defaults to the frames up to the
+        last kept frame.
+
+    Returns
+    -------
+    NumPy Array (2D)
+        (n_images, 2) beam centers.
+    """
+    beam_centers = np.asarray(beam_centers, dtype = np.float64)
+    found = np.all(beam_centers >= 0, axis = 1)
+    full_centers = np.where(found[:, None], beam_centers * binning + 0.5 * (binning - 1), -1.0)
+
+    if n_images is None:
+        n_images = (len(beam_centers) - 1) * frame_step + 1
+    if frame_step == 1 and n_images == len(beam_centers):
+        return full_centers
+
+    kept_frames = np.arange(len(beam_centers)) * frame_step
+    frames = np.arange(n_images)
+    if not np.any(found):
+        return np.full((n_images, 2), -1.0)
+    return np.stack([np.interp(frames, kept_frames[found], full_centers[found, axis])
+                     for axis in range(2)], axis = 1)
+
+
+def _check_detector_mask(detector_mask, image_shape):
+    """
+    Returns the detector mask as a contiguous boolean array, or None.
+    """
+    if detector_mask is None:
+        return None
+    detector_mask = np.ascontiguousarray(detector_mask, dtype = bool)
+    if detector_mask.shape != tuple(image_shape):
+        raise ValueError(f"The detector mask has shape {detector_mask.shape}, "
+                         f"but the images have shape {tuple(image_shape)}.")
+    return detector_mask
+
+
+def _row_segments(moving_frames):
+    """
+    First indices and lengths of the runs of True in a boolean array.
+    """
+    changes = np.diff(np.concatenate(([False], moving_frames, [False])).astype(np.int8))
+    starts = np.flatnonzero(changes == 1)
+    ends = np.flatnonzero(changes == -1)
+    return starts, ends - starts
 
 
-def get_scan_shape(beam_centers, scan_limits = None):
+def find_scan_limits(beam_centers,
+                     flyback_threshold = config.get("preprocess.flyback_threshold"),
+                     row_length_tolerance = config.get("preprocess.row_length_tolerance")):
+    """
+    Estimates the scan limits from the beam positions, so that they do not
+    have to be read off a plot of the beam centers.
+
+    Parameters
+    ----------
+    beam_centers : NumPy Array (2D)
+        A stack of beam position coordinates. Size is (n_images, 2).
+    flyback_threshold : float, optional
+        Frames where the gradient of the beam position (QX) is above this
+        value are flyback frames between the scan rows.
+    row_length_tolerance : float, optional
+        Rows whose length differs from the median row length by more than
+        this fraction are not part of the scan (e.g. frames recorded before
+        the scan started).
+
+    Returns
+    -------
+    tuple
+        (first, last) - scan limits for get_scan_shape.
+
+    Examples
+    --------
+    >>> scan_limits = find_scan_limits(data_beamCenters)
+    >>> valid_frames, scan_shape = get_scan_shape(data_beamCenters, scan_limits)
+    """
+
+    CoM_gradient = np.gradient(beam_centers[:,1])
+    starts, lengths = _row_segments(CoM_gradient <= flyback_threshold)
+
+    # Runs of a single frame are noise within the flybacks
+    rows = lengths > 1
+    if not np.any(rows):
+        raise ValueError("No scan rows found in the beam positions.")
+
+    row_length = np.median(lengths[rows])
+    regular_rows = np.flatnonzero(np.abs(lengths - row_length) <= row_length_tolerance * row_length)
+    # The median of an even number of rows need not be a row length
+    if len(regular_rows) == 0:
+        raise ValueError("No scan rows found in the beam positions.")
+
+    first_row, last_row = regular_rows[0], regular_rows[-1]
+    return int(starts[first_row]), int(starts[last_row] + lengths[last_row])
+
+
+def get_scan_shape(beam_centers, scan_limits = None,
+                   flyback_threshold = config.get("preprocess.flyback_threshold"),
+                   return_indices = False,
+                   row_length_tolerance = config.get("preprocess.row_length_tolerance")):
     """
     Function accepts the beam center data, computes which images are valid parts
     of the scan and determines the usable size of the scan. The outputs are used
@@ -79,21 +294,35 @@ def get_scan_shape(beam_centers, scan_limits = None):
     beam_centers : NumPy Array (2D)
         A stack of beam position coordinates. Size is
         (n_images, 2).
-    set_scan_limits : tuple
-        Tuple of the first and last indicies of the scan. This is determined 
-        by plotting the beam positions.
+    scan_limits : tuple, optional
+        Tuple of the first and last indicies of the scan. This can be
+        determined by plotting the beam positions. If None, the limits are
+        estimated with find_scan_limits.
+    flyback_threshold : float, optional
+        Frames where the gradient of the beam position is above this value
+        are excluded.
+    return_indices : bool, optional
+        Also return the frame index of every scan position.
+    row_length_tolerance : float, optional
+        Tolerance of the row lengths of find_scan_limits, used when the
+        scan limits are estimated.
 
     Returns
     -------
     tuple (valid_frames, scan_shape)
         Returns a boolean array valid_frames, which specifies
         the indicies of the valid scan frames, and the scan_shape of the final
-        indexed as (scan_dimension_Y, scan_dimension_X).
+        indexed as (scan_dimension_Y, scan_dimension_X). With return_indices,
+        (valid_frames, scan_shape, frame_indices), where frame_indices is an
+        int64 array of shape scan_shape holding the frame index of every
+        scan position.
 
     Notes
     -----
     It determines which frames are valid from the gradient of the beam position.
-
+    The frame indices can be passed to the C++ kernels (e.g.
+    integration.centered_crown_integration), which then only process the valid
+    frames without copying them out of the stack.
 
     Examples
     --------
@@ -105,14 +334,14 @@ def get_scan_shape(beam_centers, scan_limits = None):
     """
     
     # Sanity checks
-    if (scan_limits == None):
-        raise ValueError("Please specify scan_limits.")
+    if (beam_centers.ndim != 2) or (beam_centers.shape[1] != 2):
+        raise ValueError("""beam_centers should be an array of beam center coordinates. 
+            Indexing is [image_index, coordinate]. Coordinate is (center_y, center_x)""")
+    elif (scan_limits is None):
+        scan_limits = find_scan_limits(beam_centers, flyback_threshold, row_length_tolerance)
     elif (len(scan_limits) != 2):
         raise ValueError("""scan_limits should be a tuple of length 2 
             (indicies of the first and last valid frame).""")
-    elif (beam_centers.ndim != 2) or (beam_centers.shape[1] != 2):
-        raise ValueError("""beam_centers should be an array of beam center coordinates. 
-            Indexing is [image_index, coordinate]. Coordinate is (center_y, center_x)""")
 
     valid_frames = np.zeros(len(beam_centers), dtype = 'bool')
     valid_frames[scan_limits[0]:scan_limits[1]] = True
@@ -121,40 +350,29 @@ def get_scan_shape(beam_centers, scan_limits = None):
     CoM_gradient = np.gradient(beam_centers[:,1])
 
     # We want to exclude the points where the beam is going backwards. The
-    # threshold is 0.5 instead of 0 bc there is some noise.
-    valid_frames[np.where(CoM_gradient > 2)[0]] = False
+    # threshold is above 0 bc there is some noise.
+    valid_frames[CoM_gradient > flyback_threshold] = False
 
-    # The next part determines the lengths of the consecutive valid frames
-    # which count as one row of scan images.
-    changes = np.diff(valid_frames.astype(int))
+    # The consecutive valid frames count as one row of scan images.
+    starts, lengths = _row_segments(valid_frames)
+    if len(lengths) == 0:
+        raise ValueError("No valid frames within the scan limits.")
 
-    # Start indices of True segments (+1 accounts for the shift due to diff)
-    starts = np.where(changes == 1)[0] + 1  
-    # End indices of True segments (directly where changes go -1)
-    ends = np.where(changes == -1)[0] + 1
-
-    # Handle if the array starts or ends with True
-    if valid_frames[0]:
-        starts = np.insert(starts, 0, 0)
-    if valid_frames[-1]:
-        ends = np.append(ends, len(valid_frames))
-
-    # Compute lengths of True segments
-    lengths = ends - starts
-
-    # Determine the minimum length of True segments
+    # All rows are truncated to the shortest one
     min_length = lengths.min()
+    frame_indices = starts[:, np.newaxis].astype(np.int64) + np.arange(min_length, dtype = np.int64)
 
-    # Truncate segments longer than the minimum length
-    for start, end in zip(starts, ends):
-        if end - start > min_length:
-            valid_frames[start + min_length:end] = False
+    valid_frames[:] = False
+    valid_frames[frame_indices] = True
 
-    return valid_frames, (len(lengths), int(min_length))
+    if return_indices:
+        return valid_frames, frame_indices.shape, frame_indices
+    return valid_frames, frame_indices.shape
 
 
 def center_images(sed_data, beam_centers,
-				trimming_radius = config.get("preprocess.trim_radius")):
+				trimming_radius = config.get("preprocess.trim_radius"),
+				detector_mask = None):
     """
     Function that trims the data array around the beam centres.
 
@@ -164,11 +382,15 @@ def center_images(sed_data, beam_centers,
         Detector image stack. Indexing: (image_index, QY, QX)
     beam_centers : NumPy Array (2D or 3D)
         Array with beam center coordinates.
+    detector_mask : NumPy Array (2D, bool), optional
+        Pixels that are True are masked (set to -1) in the trimmed images,
+        in addition to the mask of a masked array. None masks nothing.
 
     Returns
     -------
-    return_type
-        Description of the returned value(s).
+    NumPy masked array
+        The trimmed images. Pixels that are masked or outside of the
+        detector are -1 and masked.
 
     Raises
     ------
@@ -206,6 +428,10 @@ def center_images(sed_data, beam_centers,
     trimmed_data = np.full((sed_data.shape[0], trimmed_edge_width, trimmed_edge_width), -1, dtype=np.int16)
     trimmed_data_mask = np.ones_like(trimmed_data, dtype=bool)
 
+    if detector_mask is None:
+        detector_mask = np.zeros(sed_data.shape[-2:], dtype = bool)
+    detector_mask = _check_detector_mask(detector_mask, sed_data.shape[-2:])
+
     for image_index, img in enumerate(sed_data):
         beam_center_QY, beam_center_QX = beam_centers[image_index].astype(int)
         
@@ -223,8 +449,11 @@ def center_images(sed_data, beam_centers,
         
         # Crop and place the data
         cropped_data = img[crop_QY_lower:crop_QY_upper, crop_QX_lower:crop_QX_upper]
-        trimmed_data[image_index, place_QY_lower:place_QY_upper, place_QX_lower:place_QX_upper] = cropped_data.data
-        trimmed_data_mask[image_index, place_QY_lower:place_QY_upper, place_QX_lower:place_QX_upper] = cropped_data.mask
+        cropped_mask = (np.ma.getmaskarray(cropped_data)
+                        | detector_mask[crop_QY_lower:crop_QY_upper, crop_QX_lower:crop_QX_upper])
+        trimmed_data[image_index, place_QY_lower:place_QY_upper, place_QX_lower:place_QX_upper] = np.where(
+            cropped_mask, -1, np.ma.getdata(cropped_data))
+        trimmed_data_mask[image_index, place_QY_lower:place_QY_upper, place_QX_lower:place_QX_upper] = cropped_mask
 
     return format_data_shape.to_2D(np.ma.masked_array(trimmed_data, trimmed_data_mask))
     
\ No newline at end of file
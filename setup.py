@@ -32,13 +32,19 @@ except ImportError:
 
 from pybind11.setup_helpers import Pybind11Extension, build_ext
 
+# The kernels use std::thread, which needs pthreads on POSIX systems
+thread_args = [] if sys.platform == "win32" else ["-pthread"]
+
 # C++ extensions
 ext_modules = [
     # Center of mass extension
     Pybind11Extension(
         "biosed._cpp.center_of_mass",
         ["biosed/_cpp/center_of_mass.cpp"],
+        depends=["biosed/_cpp/parallel.h", "biosed/_cpp/kernel_stats.h"],
         include_dirs=[pybind11.get_include()],
+        extra_compile_args=thread_args,
+        extra_link_args=thread_args,
         language="c++"
     ),
     
@@ -46,7 +52,32 @@ ext_modules = [
     Pybind11Extension(
         "biosed._cpp.crown_integration",
         ["biosed/_cpp/crown_integration.cpp"],
+        depends=["biosed/_cpp/parallel.h", "biosed/_cpp/kernel_stats.h", "biosed/_cpp/harmonics.h"],
+        include_dirs=[pybind11.get_include()],
+        extra_compile_args=thread_args,
+        extra_link_args=thread_args,
+        language="c++"
+    ),
+
+    # ODF fitting extension
+    Pybind11Extension(
+        "biosed._cpp.odf_fitting",
+        ["biosed/_cpp/odf_fitting.cpp"],
+        depends=["biosed/_cpp/parallel.h", "biosed/_cpp/kernel_stats.h"],
+        include_dirs=[pybind11.get_include()],
+        extra_compile_args=thread_args,
+        extra_link_args=thread_args,
+        language="c++"
+    ),
+
+    # Harmonic analysis extension
+    Pybind11Extension(
+        "biosed._cpp.harmonics",
+        ["biosed/_cpp/harmonics.cpp"],
+        depends=["biosed/_cpp/parallel.h", "biosed/_cpp/kernel_stats.h", "biosed/_cpp/harmonics.h"],
         include_dirs=[pybind11.get_include()],
+        extra_compile_args=thread_args,
+        extra_link_args=thread_args,
         language="c++"
     ),
 ]
@@ -0,0 +1,61 @@
+# /tests/conftest.py
+# Fixtures shared by the tests.
+#
+#
+# Copyright (C) 2024 Tine Kalac
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+import cv2 as cv
+import numpy as np
+import pytest
+
+from biosed import io
+from biosed.config import config
+from reference import random_stack
+
+
+@pytest.fixture(autouse = True)
+def default_config():
+    # Every test starts from the default configuration
+    yield
+    config.reset()
+
+
+@pytest.fixture
+def frame_directory(tmp_path):
+    """
+    Writes stacks of images as 16 bit PNG detector frames. Returns a function
+    of (images, name) that gives the directory of the frames.
+    """
+    def write_frames(images, name = "frames"):
+        directory = tmp_path / name
+        directory.mkdir()
+        for index, image in enumerate(images):
+            cv.imwrite(str(directory / f"frame_{index:05d}.png"), image.astype(np.uint16))
+        return directory
+    return write_frames
+
+
+@pytest.fixture
+def raw_scan(tmp_path):
+    """
+    A raw int16 file of 5 frames of 32 x 32 pixels with a direct beam.
+    Returns (images, memory map of the file).
+    """
+    images = random_stack(5, (32, 32))
+    images[:, 14:18, 14:18] = 3000
+    filename = tmp_path / "scan.raw"
+    images.tofile(filename)
+    return images, io.open_raw(filename, frame_shape = (32, 32))
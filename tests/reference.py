@@ -0,0 +1,201 @@
+# /tests/reference.py
+# NumPy reference implementations of the kernels, for the tests.
+#
+#
+# Copyright (C) 2024 Tine Kalac
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+import numpy as np
+
+
+def random_stack(n_images, shape, low = 0, high = 300, seed = 0):
+    """
+    Reproducible int16 (n_images, QY, QX) stack of uniform random counts.
+    """
+    rng = np.random.default_rng(seed)
+    return rng.integers(low, high, size = (n_images, *shape)).astype(np.int16)
+
+
+def beam_stack(beam_centers, shape, seed = 0):
+    """
+    Stack of noise below the default beam threshold with a 3 x 3 direct
+    beam of 1000 counts around each (integer) beam center.
+    """
+    images = random_stack(len(beam_centers), shape, high = 50, seed = seed)
+    for image, (center_QY, center_QX) in zip(images, np.asarray(beam_centers, dtype = int)):
+        image[center_QY - 1:center_QY + 2, center_QX - 1:center_QX + 2] = 1000
+    return images
+
+
+def centers_of_mass(images, threshold, detector_mask = None):
+    """
+    Thresholded centers of mass (QY, QX) of every image, (-1, -1) for
+    images without an unmasked pixel at or above the threshold.
+    """
+    weights = np.where(images >= threshold, images, 0).astype(np.int64)
+    if detector_mask is not None:
+        weights[:, detector_mask] = 0
+    total = weights.sum(axis = (1, 2))
+    sums_QY = weights.sum(axis = 2) @ np.arange(images.shape[1])
+    sums_QX = weights.sum(axis = 1) @ np.arange(images.shape[2])
+    centers = np.full((len(images), 2), -1.0)
+    found = total > 0
+    centers[found, 0] = sums_QY[found] / total[found]
+    centers[found, 1] = sums_QX[found] / total[found]
+    return centers
+
+
+def crop(images, beam_centers, trimming_radius):
+    """
+    The (2 * trimming_radius + 1) square crops around the truncated beam
+    centers, -1 outside of the detector, like preprocess.center_images.
+    """
+    edge = 2 * trimming_radius + 1
+    crops = np.full((len(images), edge, edge), -1.0)
+    for index, (image, center) in enumerate(zip(images, beam_centers)):
+        center_QY, center_QX = np.asarray(center).astype(int)
+        for iQY in range(edge):
+            for iQX in range(edge):
+                QY = center_QY - trimming_radius + iQY
+                QX = center_QX - trimming_radius + iQX
+                if 0 <= QY < image.shape[0] and 0 <= QX < image.shape[1]:
+                    crops[index, iQY, iQX] = image[QY, QX]
+    return crops
+
+
+def subpixel_crop(images, beam_centers, trimming_radius):
+    """
+    The crops sampled bilinearly at the fractional beam centers. A sample is
+    -1 if one of its weighted neighbors is negative or off the detector.
+    """
+    edge = 2 * trimming_radius + 1
+    crops = np.full((len(images), edge, edge), -1.0)
+    for index, (image, center) in enumerate(zip(images, beam_centers)):
+        floor_QY, floor_QX = np.floor(center)
+        frac_QY, frac_QX = center[0] - floor_QY, center[1] - floor_QX
+        taps = [(0, 0, (1 - frac_QY) * (1 - frac_QX)), (0, 1, (1 - frac_QY) * frac_QX),
+                (1, 0, frac_QY * (1 - frac_QX)), (1, 1, frac_QY * frac_QX)]
+        for iQY in range(edge):
+            for iQX in range(edge):
+                QY = int(floor_QY) - trimming_radius + iQY
+                QX = int(floor_QX) - trimming_radius + iQX
+                value = 0.0
+                for dQY, dQX, weight in taps:
+                    if weight == 0.0:
+                        continue
+                    if not (0 <= QY + dQY < image.shape[0] and 0 <= QX + dQX < image.shape[1]) \
+                            or image[QY + dQY, QX + dQX] < 0:
+                        value = -1.0
+                        break
+                    value += weight * image[QY + dQY, QX + dQX]
+                crops[index, iQY, iQX] = value
+    return crops
+
+
+def bin_means(images, bin_indices, profile_size, background = None, gain = None):
+    """
+    Mean of the non-negative pixels of every bin of a plan (bin_indices),
+    after the background and gain corrections, 0 for bins without pixels.
+    Returns (means, sums, counts), each (n_images, profile_size).
+    """
+    images = np.asarray(images, dtype = np.float64)
+    # The kernels take the corrections as float32
+    if background is not None:
+        background = np.asarray(background, dtype = np.float32).astype(np.float64)
+        if background.ndim != 2:
+            background = np.broadcast_to(np.ravel(background), (len(images),))
+    if gain is not None:
+        gain = np.asarray(gain, dtype = np.float32).astype(np.float64)
+
+    means = np.zeros((len(images), profile_size))
+    sums = np.zeros((len(images), profile_size))
+    counts = np.zeros((len(images), profile_size), dtype = np.int64)
+    for index, image in enumerate(images):
+        valid = (bin_indices >= 0) & (image >= 0)
+        values = image.copy()
+        if background is not None:
+            values -= background if background.ndim == 2 else background[index]
+        if gain is not None:
+            values *= gain
+        sums[index] = np.bincount(bin_indices[valid], values[valid], minlength = profile_size)
+        counts[index] = np.bincount(bin_indices[valid], minlength = profile_size)
+    np.divide(sums, counts, out = means, where = counts > 0)
+    return means, sums, counts
+
+
+def clipped_bin_means(images, bin_indices, profile_size, hot_pixel_sigma):
+    """
+    bin_means with the hot pixel rejection of the C++ kernels: pixels above
+    median + hot_pixel_sigma * 1.4826 * MAD of their bin are left out, with
+    the upper median for even bins, and mean + hot_pixel_sigma * std where
+    the MAD is 0. Bins of fewer than 3 pixels are not clipped.
+    """
+    images = np.asarray(images, dtype = np.float64)
+    means = np.zeros((len(images), profile_size))
+    for index, image in enumerate(images):
+        for slot in range(profile_size):
+            values = image[(bin_indices == slot) & (image >= 0)]
+            if len(values) == 0:
+                continue
+            if len(values) > 2:
+                middle = len(values) // 2
+                median = np.partition(values, middle)[middle]
+                sigma = 1.4826 * np.partition(np.abs(values - median), middle)[middle]
+                limit = (median + hot_pixel_sigma * sigma if sigma > 0
+                         else values.mean() + hot_pixel_sigma * values.std())
+                values = values[values <= limit]
+            means[index, slot] = values.mean()
+    return means
+
+
+def principal_components(images, bin_indices):
+    """
+    Orientation, anisotropy and aspect ratio of the intensity-weighted
+    covariance of the non-negative pixels of a plan (bin_indices), with the
+    positions relative to the center pixel. NaN for images without
+    intensity.
+    """
+    n_QY, n_QX = bin_indices.shape
+    QY, QX = np.nonzero(bin_indices >= 0)
+    positions = np.stack([QY - n_QY // 2, QX - n_QX // 2])
+    components = np.full((len(images), 3), np.nan)
+    for index, image in enumerate(images):
+        weights = np.asarray(image, dtype = np.float64)[QY, QX]
+        valid = weights >= 0
+        if weights[valid].sum() == 0:
+            continue
+        covariance = np.cov(positions[:, valid], aweights = weights[valid], bias = True)
+        (minor, major), vectors = np.linalg.eigh(covariance)
+        components[index] = (np.arctan2(*vectors[:, 1]) % np.pi, (major - minor) / (major + minor),
+                             np.sqrt(major / minor))
+    return components
+
+
+def binned_images(images, binning, frame_step = 1, detector_mask = None):
+    """
+    preprocess.bin_images: rounded block means of the unmasked, non-negative
+    pixels, -1 for blocks without any.
+    """
+    images = np.asarray(images)[::frame_step]
+    n_QY, n_QX = images.shape[1] // binning, images.shape[2] // binning
+    blocks = images[:, :n_QY * binning, :n_QX * binning].astype(np.int64)
+    valid = blocks >= 0
+    if detector_mask is not None:
+        valid &= ~detector_mask[:n_QY * binning, :n_QX * binning]
+    blocks = np.where(valid, blocks, 0).reshape(len(images), n_QY, binning, n_QX, binning)
+    valid = valid.reshape(len(images), n_QY, binning, n_QX, binning)
+    sums = blocks.sum(axis = (2, 4))
+    counts = valid.sum(axis = (2, 4))
+    return np.where(counts > 0, (sums + counts // 2) // np.maximum(counts, 1), -1).astype(np.int16)
@@ -0,0 +1,288 @@
+# /tests/test_analyze.py
+# The analysis pipeline, in memory and streamed.
+#
+#
+# Copyright (C) 2024 Tine Kalac
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+import h5py
+import numpy as np
+import pytest
+
+from biosed import analyze, gpu, integration, io, orientation, preprocess
+from biosed.config import config
+from reference import beam_stack
+
+# The default detector mask is 512 x 512 pixels. The pipeline applies it,
+# the functions only when it is passed.
+DETECTOR_SHAPE = (512, 512)
+DETECTOR_MASK = config.get("masking.detector_mask")
+
+
+def scan_frames(n_images = 6):
+    return beam_stack([(200 + frame, 300 - 3 * frame) for frame in range(n_images)],
+                      DETECTOR_SHAPE)
+
+
+def raster_frames(row_lengths):
+    """
+    Frames of a raster scan with rows of the given lengths. The beam moves a
+    pixel per frame towards lower QX and flies back at the end of every row.
+    """
+    return beam_stack([(120 + row, 230 - frame) for row, length in enumerate(row_lengths)
+                       for frame in range(length)], DETECTOR_SHAPE)
+
+
+def batch_results(frames, frame_indices):
+    """
+    Profiles and harmonic orientation of the scan frames, as computed by the
+    batch functions.
+    """
+    beam_centers = preprocess.find_beam_centers(frames)
+    profiles, _, harmonics = integration.centered_crown_integration(frames, beam_centers,
+                                                                    harmonic_orders = (0, 2),
+                                                                    detector_mask = DETECTOR_MASK)
+    valid_indices = np.ravel(frame_indices)
+    return profiles[valid_indices], orientation.harmonic_orientation(harmonics[valid_indices])[0]
+
+
+def test_streaming(frame_directory):
+    data_directory = str(frame_directory(scan_frames()))
+    pipeline = analyze.AnalysisPipeline()
+    pipeline.load_data(data_directory)
+
+    # Two frames per chunk
+    config.set("analyze.streaming", True)
+    config.set("analyze.memory_budget",
+               2 * np.prod(DETECTOR_SHAPE) * analyze._STREAMING_BYTES_PER_PIXEL)
+    streamed = analyze.AnalysisPipeline()
+    streamed.load_data(data_directory)
+
+    assert streamed.data is None
+    np.testing.assert_array_equal(streamed.beam_centers, pipeline.beam_centers)
+    expected = integration.centered_crown_integration(pipeline.data, pipeline.beam_centers,
+                                                      n_phi_bins = pipeline.azi_resolution,
+                                                      detector_mask = DETECTOR_MASK)[0]
+    np.testing.assert_array_equal(streamed._azi_intensity_all, expected)
+
+
+def test_streaming_follows_the_integration_config(frame_directory):
+    frames = raster_frames([8] * 5)
+    config.set("analyze.streaming", True)
+    pipeline = analyze.AnalysisPipeline().map_orientation(str(frame_directory(frames)))
+
+    # The profiles are streamed again with the new q range
+    config.set("integration.q_range", (1.5, 2.0))
+    pipeline.map_orientation()
+
+    expected, _ = integration.centered_crown_integration(frames, pipeline.beam_centers,
+                                                         q_range = (1.5, 2.0),
+                                                         detector_mask = DETECTOR_MASK)
+    np.testing.assert_array_equal(pipeline._azi_intensity_all, expected)
+    np.testing.assert_array_equal(pipeline.azi_intensity, expected[pipeline.frame_indices.ravel()])
+
+
+def test_streaming_of_an_empty_stack():
+    config.set("analyze.streaming", True)
+
+    with pytest.raises(Exception, match = "No images found"):
+        analyze.AnalysisPipeline().load_data(np.empty((0, *DETECTOR_SHAPE), dtype = np.int16))
+
+
+def test_report(frame_directory):
+    pipeline = analyze.AnalysisPipeline()
+    pipeline.load_data(str(frame_directory(scan_frames())))
+
+    stages = pipeline.get("report")["stages"]
+    assert [record["name"] for record in stages] == ["load", "beam_centers"]
+    assert stages[1]["n_frames"] == 6
+    assert "centers_of_mass" in stages[1]["kernels"]
+
+
+def test_backend_config(frame_directory, monkeypatch):
+    # The GPU entry points are replaced by the C++ kernels, so no device is needed
+    calls = []
+
+    def beam_centers_on_cpu(sed_data, direct_beam_threshold, detector_mask):
+        calls.append("beam_centers")
+        return preprocess.find_beam_centers(sed_data, direct_beam_threshold,
+                                            detector_mask = detector_mask, backend = "cpu")
+
+    def integration_on_cpu(sed_data, beam_centers, plan, harmonic_orders, frame_indices,
+                           detector_mask, *args):
+        calls.append("integration")
+        return integration.centered_crown_integration(sed_data, beam_centers, plan = plan,
+                                                      harmonic_orders = harmonic_orders,
+                                                      frame_indices = frame_indices,
+                                                      detector_mask = detector_mask,
+                                                      backend = "cpu")
+
+    monkeypatch.setattr(gpu, "find_beam_centers", beam_centers_on_cpu)
+    monkeypatch.setattr(integration, "_gpu_centered_crown_integration", integration_on_cpu)
+    frames = raster_frames([8] * 5)
+    # Set after the modules are imported
+    config.set("parallel.backend", "gpu")
+
+    pipeline = analyze.AnalysisPipeline().map_orientation(str(frame_directory(frames)))
+
+    assert calls == ["beam_centers", "integration"]
+    config.set("parallel.backend", "cpu")
+    expected = analyze.AnalysisPipeline().map_orientation(str(frame_directory(frames, "cpu")))
+    np.testing.assert_array_equal(pipeline.beam_centers, expected.beam_centers)
+    np.testing.assert_array_equal(pipeline.orientation_map, expected.orientation_map)
+
+
+def test_live_pipeline():
+    frames = raster_frames([8] * 5)
+    live = analyze.LiveAnalysisPipeline()
+
+    updates = [live.push_frames(frames[start:start + 7]) for start in range(0, len(frames), 7)]
+
+    # A row is complete once the flyback after it is recorded, so the last
+    # row is still open. The first row is a frame longer than the others.
+    assert updates[0] is False and updates[-2:] == [True, False]
+    assert live.scan_shape == (3, 6)
+    np.testing.assert_array_equal(live.frame_indices, [np.arange(9, 15), np.arange(17, 23),
+                                                       np.arange(25, 31)])
+    profiles, orientation_values = batch_results(frames, live.frame_indices)
+    np.testing.assert_allclose(live.azi_intensity, profiles, rtol = 1e-12)
+    np.testing.assert_allclose(live.get("orientation map"), orientation_values.reshape(3, 6),
+                               rtol = 1e-12)
+
+
+def test_live_pipeline_with_scan_limits():
+    frames = raster_frames([8] * 6)
+    live = analyze.LiveAnalysisPipeline()
+    live.scan_limits = (10, 100)
+
+    for start in range(0, len(frames), 5):
+        live.push_frames(frames[start:start + 5])
+
+    # The first row is cut to the limits, the last one is still open
+    beam_centers = preprocess.find_beam_centers(frames)
+    _, scan_shape, frame_indices = preprocess.get_scan_shape(beam_centers[:39], (10, 39),
+                                                             return_indices = True)
+    assert live.scan_shape == scan_shape == (4, 5)
+    np.testing.assert_array_equal(live.frame_indices, frame_indices)
+    np.testing.assert_array_equal(live.valid_frames, np.isin(np.arange(39), frame_indices))
+    profiles, orientation_values = batch_results(frames, frame_indices)
+    np.testing.assert_allclose(live.azi_intensity, profiles, rtol = 1e-12)
+    np.testing.assert_allclose(live.orientation_map, orientation_values, rtol = 1e-12)
+
+
+def test_live_pipeline_reads_the_config():
+    frames = raster_frames([8] * 5)
+    live = analyze.LiveAnalysisPipeline()
+    # Set after the pipeline is created, one background per frame
+    frame_backgrounds = np.arange(len(frames), dtype = np.float32)
+    config.set("integration.background", frame_backgrounds)
+
+    for start in range(0, len(frames), 7):
+        live.push_frames(frames[start:start + 7])
+
+    beam_centers = preprocess.find_beam_centers(frames)
+    profiles, _ = integration.centered_crown_integration(frames, beam_centers,
+                                                         background = frame_backgrounds,
+                                                         detector_mask = DETECTOR_MASK)
+    np.testing.assert_allclose(live.azi_intensity, profiles[live.frame_indices.ravel()],
+                               rtol = 1e-12)
+
+
+def test_watch(frame_directory):
+    frames = raster_frames([8] * 5)
+    data_directory = str(frame_directory(frames))
+    scan_shapes = []
+
+    live = analyze.LiveAnalysisPipeline().watch(data_directory,
+                                                callback = lambda live: scan_shapes.append(live.scan_shape),
+                                                poll_interval = 0.01, idle_timeout = 0.05)
+
+    assert live.n_frames == len(frames)
+    assert scan_shapes[-1] == (3, 6)
+    profiles, _ = batch_results(frames, live.frame_indices)
+    np.testing.assert_allclose(live.azi_intensity, profiles, rtol = 1e-12)
+
+
+def test_live_pipeline_reads_the_scan_geometry_config():
+    frames = raster_frames([8] * 5)
+    live = analyze.LiveAnalysisPipeline()
+    # The first row of 9 frames is within 20 % of the others
+    config.set("preprocess.row_length_tolerance", 0.2)
+
+    for start in range(0, len(frames), 7):
+        live.push_frames(frames[start:start + 7])
+
+    assert live.scan_shape == (4, 6)
+
+
+def test_live_output_file(tmp_path, monkeypatch):
+    output_file = tmp_path / "live.h5"
+    config.set("analyze.output_file", str(output_file))
+    opened = []
+
+    class CountingWriter(io.HDF5Writer):
+        def __init__(self, filename, *args, **kwargs):
+            opened.append(filename)
+            super().__init__(filename, *args, **kwargs)
+
+    monkeypatch.setattr(io, "HDF5Writer", CountingWriter)
+    frames = raster_frames([8] * 5)
+
+    with analyze.LiveAnalysisPipeline() as live:
+        for start in range(0, len(frames), 7):
+            live.push_frames(frames[start:start + 7])
+
+    # One open for all batches, closed with the pipeline
+    assert opened == [str(output_file)]
+    assert live._writer is None
+    with h5py.File(output_file, "r") as h5file:
+        np.testing.assert_array_equal(h5file["frames/beam_centers"][...],
+                                      preprocess.find_beam_centers(frames))
+        assert h5file["frames/azi_intensity"].shape[0] == len(frames)
+        np.testing.assert_array_equal(h5file["orientation_map"][...], live.get("orientation map"))
+        np.testing.assert_array_equal(h5file["frame_indices"][...], live.frame_indices)
+
+
+def test_watch_closes_the_output_file(frame_directory, tmp_path):
+    output_file = tmp_path / "live.h5"
+    config.set("analyze.output_file", str(output_file))
+    frames = raster_frames([8] * 5)
+
+    live = analyze.LiveAnalysisPipeline().watch(str(frame_directory(frames)),
+                                                poll_interval = 0.01, idle_timeout = 0.05)
+
+    assert live._writer is None
+    with h5py.File(output_file, "r") as h5file:
+        assert h5file["frames/azi_intensity"].shape[0] == len(frames)
+        np.testing.assert_array_equal(h5file["orientation_map"][...], live.get("orientation map"))
+
+
+def test_cached_beam_centers(frame_directory, tmp_path):
+    config.set("analyze.cache_directory", str(tmp_path / "cache"))
+    data_directory = str(frame_directory(scan_frames()))
+    pipeline = analyze.AnalysisPipeline()
+    pipeline.load_data(data_directory)
+
+    cached = analyze.AnalysisPipeline()
+    cached.load_data(data_directory)
+
+    # The frames are only loaded if the beam centers are not in the cache
+    assert cached.data is None
+    np.testing.assert_array_equal(cached.beam_centers, pipeline.beam_centers)
+
+    config.set("preprocess.direct_beam_threshold", 200)
+    changed = analyze.AnalysisPipeline()
+    changed.load_data(data_directory)
+    assert changed.data is not None
@@ -0,0 +1,105 @@
+# /tests/test_cache.py
+# Hits and misses of the result cache.
+#
+#
+# Copyright (C) 2024 Tine Kalac
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+import os
+
+import h5py
+import numpy as np
+
+from biosed import io
+from biosed.cache import ResultCache
+from reference import random_stack
+
+
+def test_hit_and_miss(tmp_path, raw_scan):
+    _, data_source = raw_scan
+    cache = ResultCache(tmp_path / "cache", data_source)
+    assert cache.enabled
+    beam_centers = np.random.default_rng(0).random((5, 2))
+
+    key = cache.key("beam_centers", cache.data_key, {"threshold": 100, "mask": np.ones(3)})
+    assert cache.load(key, ["beam_centers"]) is None
+    cache.save(key, beam_centers = beam_centers)
+
+    results = cache.load(key, ["beam_centers"])
+    np.testing.assert_array_equal(results["beam_centers"], beam_centers)
+    # Results of the stage that were not saved are a miss
+    assert cache.load(key, ["beam_centers", "scan_limits"]) is None
+
+
+def test_load_opens_the_file_once(tmp_path, raw_scan, monkeypatch):
+    _, data_source = raw_scan
+    cache = ResultCache(tmp_path / "cache", data_source)
+    key = cache.key("scan_geometry", cache.data_key, {})
+    cache.save(key, scan_limits = np.array([0, 5]), valid_frames = np.ones(5, dtype = bool))
+
+    opened = []
+    open_file = h5py.File
+
+    def counting_open(filename, *args, **kwargs):
+        opened.append(filename)
+        return open_file(filename, *args, **kwargs)
+
+    monkeypatch.setattr(h5py, "File", counting_open)
+    results = cache.load(key, ["scan_limits", "valid_frames"])
+
+    assert len(opened) == 1
+    np.testing.assert_array_equal(results["scan_limits"], [0, 5])
+    assert results["valid_frames"].all()
+
+
+def test_parameters_change_the_key(tmp_path, raw_scan):
+    _, data_source = raw_scan
+    cache = ResultCache(tmp_path / "cache", data_source)
+    key = cache.key("beam_centers", cache.data_key, {"threshold": 100})
+    cache.save(key, beam_centers = np.zeros((5, 2)))
+
+    assert cache.key("beam_centers", cache.data_key, {"threshold": 100}) == key
+    other_key = cache.key("beam_centers", cache.data_key, {"threshold": 101})
+    assert other_key != key
+    assert cache.load(other_key, ["beam_centers"]) is None
+    # A downstream stage depends on the key of its upstream stage
+    assert cache.key("profiles", key, {}) != cache.key("profiles", other_key, {})
+
+
+def test_rewritten_data_is_a_miss(tmp_path, raw_scan):
+    _, data_source = raw_scan
+    data_key = ResultCache(tmp_path / "cache", data_source).data_key
+    random_stack(6, (32, 32)).tofile(data_source.filename)
+
+    rewritten = io.open_raw(data_source.filename, frame_shape = (32, 32))
+    assert ResultCache(tmp_path / "cache", rewritten).data_key != data_key
+
+
+def test_arrays_in_memory_are_not_cached(tmp_path):
+    cache = ResultCache(tmp_path / "cache", np.zeros((5, 32, 32), dtype = np.int16))
+    assert not cache.enabled
+    key = cache.key("beam_centers", cache.data_key, {})
+    cache.save(key, beam_centers = np.zeros((5, 2)))
+    assert cache.load(key, ["beam_centers"]) is None
+    assert not os.path.exists(tmp_path / "cache")
+
+
+def test_clear(tmp_path, raw_scan):
+    _, data_source = raw_scan
+    cache = ResultCache(tmp_path / "cache", data_source)
+    key = cache.key("beam_centers", cache.data_key, {})
+    cache.save(key, beam_centers = np.zeros((5, 2)))
+    cache.clear()
+    assert cache.load(key, ["beam_centers"]) is None
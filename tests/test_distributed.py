@@ -0,0 +1,118 @@
+# /tests/test_distributed.py
+# Sharding of a scan over the workers.
+#
+#
+# Copyright (C) 2024 Tine Kalac
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+import numpy as np
+import pytest
+
+from biosed import distributed, integration, preprocess
+
+BEAM_PARAMETERS = {"detector_mask": None}
+INTEGRATION_PARAMETERS = {"trimming_radius": 10, "n_phi_bins": 36, "q_range": (0.1, 0.3),
+                          "q_callibration": 2.55 / 70, "detector_mask": None}
+
+
+@pytest.mark.parametrize("n_images, n_shards", [(10, 3), (3, 5), (1, 4), (7, 7)])
+def test_shard_bounds(n_images, n_shards):
+    bounds = distributed.shard_bounds(n_images, n_shards)
+
+    # Every frame is in exactly one shard, in order
+    assert len(bounds) == n_shards
+    assert bounds[0][0] == 0 and bounds[-1][1] == n_images
+    assert all(stop == start for (_, stop), (start, _) in zip(bounds[:-1], bounds[1:]))
+    sizes = [stop - start for start, stop in bounds]
+    assert min(sizes) >= 0 and max(sizes) - min(sizes) <= 1
+
+
+def test_gather_drops_empty_shards():
+    phi_values = np.arange(36)
+    shard_results = [(2, np.ones((1, 2)), np.ones((1, 36)), phi_values),
+                     (0, np.zeros((2, 2)), np.zeros((2, 36)), phi_values),
+                     (2, np.empty((0, 2)), np.empty((0, 36)), phi_values)]
+
+    beam_centers, azi_intensity, gathered_phi_values = distributed._gather(shard_results)
+
+    np.testing.assert_array_equal(beam_centers, [[0, 0], [0, 0], [1, 1]])
+    assert azi_intensity.shape == (3, 36)
+    np.testing.assert_array_equal(gathered_phi_values, phi_values)
+
+
+def test_process_shard(raw_scan):
+    images, data_source = raw_scan
+    description, n_images = distributed.describe_source(data_source)
+
+    start, beam_centers, azi_intensity, _ = distributed.process_shard(
+        description, 1, 4, 2, 1, BEAM_PARAMETERS, INTEGRATION_PARAMETERS)
+
+    # The shard is processed in chunks of 2 frames, the beam is tracked within a chunk
+    expected_centers = np.concatenate([preprocess.find_beam_centers(images[1:3], **BEAM_PARAMETERS),
+                                       preprocess.find_beam_centers(images[3:4], **BEAM_PARAMETERS)])
+    expected_profiles, _ = integration.centered_crown_integration(images[1:4], expected_centers,
+                                                                  **INTEGRATION_PARAMETERS)
+    assert n_images == 5 and start == 1
+    np.testing.assert_array_equal(beam_centers, expected_centers)
+    np.testing.assert_array_equal(azi_intensity, expected_profiles)
+
+
+def test_process_empty_shard(raw_scan):
+    _, data_source = raw_scan
+    description, n_images = distributed.describe_source(data_source)
+
+    # More shards than frames
+    start, beam_centers, azi_intensity, phi_values = distributed.process_shard(
+        description, n_images, n_images, 2, 1, BEAM_PARAMETERS, INTEGRATION_PARAMETERS)
+
+    assert start == n_images
+    assert beam_centers.shape == (0, 2)
+    assert azi_intensity.shape == (0, 36)
+    assert phi_values.shape == (36,)
+
+
+def test_process_shard_slices_frame_backgrounds(raw_scan):
+    images, data_source = raw_scan
+    description, _ = distributed.describe_source(data_source)
+    frame_backgrounds = np.arange(5, dtype = np.float32)
+    parameters = {**INTEGRATION_PARAMETERS, "background": frame_backgrounds}
+
+    _, beam_centers, azi_intensity, _ = distributed.process_shard(
+        description, 2, 5, 2, 1, BEAM_PARAMETERS, parameters)
+
+    expected_profiles, _ = integration.centered_crown_integration(
+        images[2:5], beam_centers, **{**parameters, "background": frame_backgrounds[2:5]})
+    np.testing.assert_array_equal(azi_intensity, expected_profiles)
+
+
+def test_process_scan(raw_scan):
+    images, data_source = raw_scan
+
+    beam_centers, azi_intensity, phi_values = distributed.process_scan(
+        data_source, BEAM_PARAMETERS, INTEGRATION_PARAMETERS, backend = "processes", n_workers = 2)
+
+    expected_centers = preprocess.find_beam_centers(images, **BEAM_PARAMETERS)
+    expected_profiles, expected_phi_values = integration.centered_crown_integration(
+        images, expected_centers, **INTEGRATION_PARAMETERS)
+    np.testing.assert_array_equal(beam_centers, expected_centers)
+    np.testing.assert_array_equal(azi_intensity, expected_profiles)
+    np.testing.assert_array_equal(phi_values, expected_phi_values)
+
+
+def test_unknown_backend(raw_scan):
+    _, data_source = raw_scan
+    with pytest.raises(ValueError):
+        distributed.process_scan(data_source, BEAM_PARAMETERS, INTEGRATION_PARAMETERS,
+                                 backend = "threads")
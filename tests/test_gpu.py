@@ -0,0 +1,102 @@
+# /tests/test_gpu.py
+# The CUDA backend against the C++ kernels.
+#
+#
+# Copyright (C) 2024 Tine Kalac
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+import numpy as np
+import pytest
+
+from biosed import gpu, integration, preprocess
+from reference import random_stack, beam_stack
+
+DETECTOR_SHAPE = (64, 64)
+INTEGRATION_PARAMETERS = {"trimming_radius": 20, "n_phi_bins": 60, "q_range": (0.2, 0.6),
+                          "q_callibration": 2.55 / 70}
+
+needs_gpu = pytest.mark.skipif(not gpu.available(), reason = "needs CuPy and a CUDA device")
+
+
+def detector_mask():
+    mask = np.zeros(DETECTOR_SHAPE, dtype = bool)
+    mask[:, 31:33] = True
+    return mask
+
+
+def beam_centers(n_images, seed = 1):
+    rng = np.random.default_rng(seed)
+    return 32.0 + rng.uniform(-3, 3, size = (n_images, 2))
+
+
+@needs_gpu
+def test_beam_centers():
+    images = beam_stack([(20 + frame, 40 - frame) for frame in range(10)], DETECTOR_SHAPE)
+    images[3] = 0
+
+    centers = preprocess.find_beam_centers(images, detector_mask = detector_mask(), backend = "gpu")
+
+    expected = preprocess.find_beam_centers(images, detector_mask = detector_mask(), backend = "cpu")
+    np.testing.assert_array_equal(centers, expected)
+
+
+@needs_gpu
+@pytest.mark.parametrize("dtype", ["float64", "float32"])
+def test_centered_integration(dtype):
+    images = random_stack(6, DETECTOR_SHAPE, low = -5)
+    parameters = {**INTEGRATION_PARAMETERS, "detector_mask": detector_mask(), "dtype": dtype,
+                  "frame_indices": np.array([0, 2, 3, 5])}
+    centers = beam_centers(6)
+    centers[2] = np.nan
+
+    profiles, _ = integration.centered_crown_integration(images, centers, backend = "gpu",
+                                                         **parameters)
+
+    expected, _ = integration.centered_crown_integration(images, centers, backend = "cpu",
+                                                         **parameters)
+    assert profiles.dtype == expected.dtype
+    np.testing.assert_allclose(profiles, expected, rtol = 1e-12 if dtype == "float64" else 1e-6)
+
+
+@needs_gpu
+def test_harmonics():
+    images = random_stack(6, DETECTOR_SHAPE)
+    parameters = {**INTEGRATION_PARAMETERS, "detector_mask": None, "harmonic_orders": (0, 2)}
+
+    profiles, _, harmonics = integration.centered_crown_integration(
+        images, beam_centers(6), backend = "gpu", **parameters)
+
+    expected_profiles, _, expected_harmonics = integration.centered_crown_integration(
+        images, beam_centers(6), backend = "cpu", **parameters)
+    np.testing.assert_allclose(profiles, expected_profiles, rtol = 1e-12)
+    np.testing.assert_allclose(harmonics, expected_harmonics, rtol = 1e-10, atol = 1e-9)
+
+
+def test_unknown_backend():
+    images = random_stack(2, DETECTOR_SHAPE)
+
+    with pytest.raises(ValueError):
+        preprocess.find_beam_centers(images, detector_mask = None, backend = "opencl")
+    with pytest.raises(ValueError):
+        integration.centered_crown_integration(images, beam_centers(2), backend = "opencl",
+                                               detector_mask = None, **INTEGRATION_PARAMETERS)
+
+
+def test_subpixel_on_gpu():
+    # Refused before any CUDA call, so it does not need a device
+    with pytest.raises(ValueError):
+        integration.centered_crown_integration(random_stack(2, DETECTOR_SHAPE), beam_centers(2),
+                                               backend = "gpu", detector_mask = None,
+                                               subpixel = True, **INTEGRATION_PARAMETERS)
@@ -0,0 +1,96 @@
+# /tests/test_instrumentation.py
+# Stage records and kernel counters of the pipeline report.
+#
+#
+# Copyright (C) 2024 Tine Kalac
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+import json
+
+import numpy as np
+import pytest
+
+from biosed._cpp.center_of_mass import compute_centers_of_mass
+from biosed.instrumentation import PipelineReport
+from reference import beam_stack
+
+THRESHOLD = 100
+DETECTOR_SHAPE = (64, 64)
+
+
+def test_stage_counters():
+    images = beam_stack([(20 + frame, 40 - frame) for frame in range(6)], DETECTOR_SHAPE)
+    report = PipelineReport()
+
+    with report.stage("beam_centers", n_frames = len(images), n_bytes = images.nbytes):
+        compute_centers_of_mass(images, THRESHOLD, n_threads = 2)
+
+    (record,) = report.stages
+    # Only the kernels called within the stage are recorded
+    assert list(record["kernels"]) == ["centers_of_mass"]
+    counters = record["kernels"]["centers_of_mass"]
+    assert counters["calls"] == 1
+    assert counters["frames"] == 6
+    assert counters["pixels_visited"] == 6 * 64 * 64
+    assert counters["pixels_skipped"] == 0
+    assert counters["full_scans"] == 6
+
+
+def test_tracking_counters():
+    images = beam_stack([(30, 30)] * 10, DETECTOR_SHAPE)
+    report = PipelineReport()
+
+    with report.stage("beam_centers"):
+        compute_centers_of_mass(images, THRESHOLD, window_radius = 6)
+
+    # Only the first frame is scanned in full, the others in a 13 x 13 window
+    counters = report.stages[0]["kernels"]["centers_of_mass_tracking"]
+    assert counters["full_scans"] == 1
+    assert counters["pixels_visited"] == 10 * 64 * 64
+    assert counters["pixels_skipped"] == 9 * (64 * 64 - 13 * 13)
+
+
+def test_stage_memory():
+    report = PipelineReport()
+
+    with report.stage("allocate"):
+        # 64 MB, kept until the end of the stage
+        block = np.ones(8 * 1024**2)
+    del block
+
+    (record,) = report.stages
+    if record["peak_rss_bytes"] is None:
+        pytest.skip("needs /proc/self/statm")
+    assert record["rss_delta_bytes"] >= 32 * 1024**2
+    assert record["process_peak_rss_bytes"] >= record["peak_rss_bytes"]
+
+
+def test_write_trace(tmp_path):
+    report = PipelineReport()
+    with report.stage("load") as record:
+        record["n_frames"] = 3
+    with report.stage("integrate", n_frames = 3):
+        pass
+
+    report.write_trace(tmp_path / "trace.json")
+
+    with open(tmp_path / "trace.json") as file:
+        events = json.load(file)["traceEvents"]
+    assert [event["name"] for event in events] == ["load", "integrate"]
+    assert all(event["ph"] == "X" and event["dur"] >= 0 for event in events)
+    assert events[0]["args"]["n_frames"] == 3
+    assert report.to_dict()["total_seconds"] == pytest.approx(
+        sum(record["wall_seconds"] for record in report.stages))
+    assert "integrate" in report.summary()
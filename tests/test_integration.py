@@ -0,0 +1,351 @@
+# /tests/test_integration.py
+# Crown and cake integration against the NumPy reference.
+#
+#
+# Copyright (C) 2024 Tine Kalac
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+import numpy as np
+import pytest
+
+from biosed import integration, io
+from reference import random_stack, crop, subpixel_crop, bin_means, clipped_bin_means
+
+Q_CALLIBRATION = 2.55 / 70
+Q_RANGE = (0.2, 0.6)
+TRIMMING_RADIUS = 20
+DETECTOR_SHAPE = (64, 64)
+
+
+def reference_profiles(images, plan, **corrections):
+    return bin_means(images, plan.bin_indices(), plan.profile_size, **corrections)[0]
+
+
+def beam_centers(n_images, seed = 1):
+    rng = np.random.default_rng(seed)
+    return 32.0 + rng.uniform(-3, 3, size = (n_images, 2))
+
+
+# Common bin counts, and two that do not divide 360 evenly
+@pytest.mark.parametrize("n_phi_bins", [36, 72, 90, 120, 180, 360, 7, 100])
+@pytest.mark.parametrize("n_threads", [1, 3])
+def test_crown_integration(n_phi_bins, n_threads):
+    images = random_stack(5, (41, 41))
+    images[0, :5] = -1
+    plan = integration.get_integration_plan((41, 41), n_phi_bins, Q_RANGE, Q_CALLIBRATION)
+
+    profiles, phi_vals = integration.crown_integration(images, plan = plan, n_threads = n_threads)
+
+    np.testing.assert_allclose(profiles, reference_profiles(images, plan), rtol = 1e-12)
+    assert phi_vals.shape == (n_phi_bins,)
+
+
+def test_integration_plan():
+    plan = integration.get_integration_plan((41, 41), 36, Q_RANGE, Q_CALLIBRATION)
+
+    # Plans are cached by their geometry
+    assert integration.get_integration_plan((41, 41), 36, Q_RANGE, Q_CALLIBRATION) is plan
+    assert plan.shape == (41, 41)
+    assert plan.n_pixels == np.count_nonzero(plan.bin_indices() >= 0)
+    with pytest.raises(RuntimeError):
+        plan.integrate(random_stack(2, (40, 41)))
+
+
+def test_centered_integration():
+    images = random_stack(6, DETECTOR_SHAPE, low = -5)
+    centers = beam_centers(6)
+    # The crown of the last image reaches over the edge of the detector
+    centers[-1] = (12.5, 50.7)
+
+    profiles, phi_vals = integration.centered_crown_integration(
+        images, centers, trimming_radius = TRIMMING_RADIUS, n_phi_bins = 60, q_range = Q_RANGE,
+        q_callibration = Q_CALLIBRATION, detector_mask = None, n_threads = 2)
+
+    plan = integration.get_integration_plan((41, 41), 60, Q_RANGE, Q_CALLIBRATION)
+    expected = reference_profiles(crop(images, centers, TRIMMING_RADIUS), plan)
+    np.testing.assert_allclose(profiles, expected, rtol = 1e-12)
+    assert phi_vals.shape == (60,)
+
+
+@pytest.mark.parametrize("n_phi_bins", [36, 100])
+def test_float32_profiles(n_phi_bins):
+    images = random_stack(4, (41, 41), high = 32767)
+    plan = integration.get_integration_plan((41, 41), n_phi_bins, Q_RANGE, Q_CALLIBRATION)
+
+    profiles, _ = integration.crown_integration(images, plan = plan, dtype = "float32")
+
+    # The sums are exact either way, only the mean is rounded
+    assert profiles.dtype == np.float32
+    np.testing.assert_array_equal(profiles, reference_profiles(images, plan).astype(np.float32))
+
+
+def test_int64_bin_sums():
+    # A single bin of the whole crop, whose sum does not fit an int32
+    images = np.full((2, 401, 401), 32767, dtype = np.int16)
+    profiles, _ = integration.crown_integration(images, n_phi_bins = 1, q_range = (0.0, 20.0),
+                                                q_callibration = Q_CALLIBRATION)
+    np.testing.assert_array_equal(profiles, 32767.0)
+
+
+def test_multi_ring_integration():
+    images = random_stack(3, (41, 41))
+    ring_phi_bins, q_ranges = [30, 60], [(0.15, 0.3), (0.35, 0.6)]
+    plan = integration.get_integration_plan((41, 41), ring_phi_bins, q_ranges, Q_CALLIBRATION)
+
+    profiles, phi_vals = integration.crown_integration(images, plan = plan)
+
+    expected = reference_profiles(images, plan).reshape(3, 2, 60)
+    # The first ring has fewer bins than the plan
+    expected[:, 0, 30:] = np.nan
+    np.testing.assert_allclose(profiles, expected, rtol = 1e-12)
+    assert np.all(np.isnan(phi_vals[0, 30:]))
+
+
+def test_overlapping_rings():
+    # Rings out of q order, nested and overlapping, each like its own plan
+    images = random_stack(3, (41, 41))
+    ring_phi_bins, q_ranges = [36, 24, 36, 12], [(0.35, 0.6), (0.1, 0.7), (0.2, 0.4), (0.4, 0.45)]
+    plan = integration.get_integration_plan((41, 41), ring_phi_bins, q_ranges, Q_CALLIBRATION)
+
+    profiles, _ = integration.crown_integration(images, plan = plan)
+
+    for ring, (n_phi_bins, q_range) in enumerate(zip(ring_phi_bins, q_ranges)):
+        ring_plan = integration.get_integration_plan((41, 41), n_phi_bins, q_range, Q_CALLIBRATION)
+        expected, _ = integration.crown_integration(images, plan = ring_plan)
+        np.testing.assert_array_equal(profiles[:, ring, :n_phi_bins], expected)
+
+
+def test_csr_arrays():
+    plan = integration.get_integration_plan((41, 41), [30, 60], [(0.15, 0.3), (0.35, 0.6)],
+                                            Q_CALLIBRATION)
+
+    bin_starts, pixel_offsets, bin_slots = plan.csr_arrays()
+
+    # The pixel list holds every pixel of bin_indices exactly once
+    bin_indices = plan.bin_indices().ravel()
+    assert plan.profile_size == 2 * 60
+    assert bin_starts[-1] == plan.n_pixels == np.count_nonzero(bin_indices >= 0)
+    assert len(np.unique(pixel_offsets)) == len(pixel_offsets)
+    for start, stop, slot in zip(bin_starts[:-1], bin_starts[1:], bin_slots):
+        assert np.all(bin_indices[pixel_offsets[start:stop]] == slot)
+
+
+def test_cake_integration():
+    images = random_stack(3, (41, 41))
+    n_q_bins, n_phi_bins, q_range = 4, 36, (0.1, 0.7)
+
+    sums, counts, q_vals, phi_vals = integration.cake_integration(
+        images, n_q_bins = n_q_bins, n_phi_bins = n_phi_bins, q_range = q_range,
+        q_callibration = Q_CALLIBRATION)
+
+    # The q bins are the rings of a multi-ring plan with half-open q ranges
+    q_edges = np.linspace(*q_range, n_q_bins + 1)
+    q_ranges = [(q_edges[i], q_edges[i+1] if i == n_q_bins - 1 else np.nextafter(q_edges[i+1], -np.inf))
+                for i in range(n_q_bins)]
+    plan = integration.get_integration_plan((41, 41), [n_phi_bins] * n_q_bins, q_ranges,
+                                            Q_CALLIBRATION)
+    _, expected_sums, expected_counts = bin_means(images, plan.bin_indices(), plan.profile_size)
+
+    assert sums.shape == counts.shape == (3, n_q_bins, n_phi_bins)
+    np.testing.assert_array_equal(counts, expected_counts.reshape(counts.shape))
+    np.testing.assert_array_equal(sums, expected_sums.reshape(sums.shape).astype(np.float32))
+    np.testing.assert_allclose(q_vals, 0.5 * (q_edges[:-1] + q_edges[1:]))
+    assert phi_vals.shape == (n_phi_bins,)
+
+
+def test_crown_integration_of_raw_file(tmp_path):
+    images = random_stack(7, (41, 41))
+    images.astype(np.uint16).tofile(tmp_path / "scan.raw")
+    plan = integration.get_integration_plan((41, 41), 36, Q_RANGE, Q_CALLIBRATION)
+
+    # Not int16, so the frames are converted chunk by chunk
+    image_stack = io.open_raw(tmp_path / "scan.raw", frame_shape = (41, 41), dtype = "uint16")
+    profiles, _ = integration.crown_integration(image_stack, plan = plan)
+
+    np.testing.assert_array_equal(profiles, integration.crown_integration(images, plan = plan)[0])
+
+
+def test_harmonics_of_crown_integration():
+    images = random_stack(4, DETECTOR_SHAPE)
+    plan = integration.get_integration_plan((41, 41), 36, Q_RANGE, Q_CALLIBRATION)
+
+    profiles, _, harmonics = integration.crown_integration(
+        images[:, 10:51, 10:51], plan = plan, harmonic_orders = (0, 2))
+    centered_profiles, _, centered_harmonics = integration.centered_crown_integration(
+        images, beam_centers(4), plan = plan, harmonic_orders = (0, 2), detector_mask = None)
+
+    np.testing.assert_allclose(harmonics, np.fft.fft(profiles)[:, [0, 2]], rtol = 1e-10, atol = 1e-9)
+    np.testing.assert_allclose(centered_harmonics, np.fft.fft(centered_profiles)[:, [0, 2]],
+                               rtol = 1e-10, atol = 1e-9)
+
+
+def test_centered_integration_of_selected_frames():
+    images = random_stack(8, DETECTOR_SHAPE)
+    centers = beam_centers(8)
+    frame_indices = np.array([1, 2, 5, 7])
+
+    profiles, _ = integration.centered_crown_integration(
+        images, centers, trimming_radius = TRIMMING_RADIUS, n_phi_bins = 36, q_range = Q_RANGE,
+        q_callibration = Q_CALLIBRATION, frame_indices = frame_indices, detector_mask = None)
+
+    plan = integration.get_integration_plan((41, 41), 36, Q_RANGE, Q_CALLIBRATION)
+    expected = reference_profiles(crop(images[frame_indices], centers[frame_indices],
+                                       TRIMMING_RADIUS), plan)
+    np.testing.assert_allclose(profiles, expected, rtol = 1e-12)
+
+
+def test_empty_stack():
+    images = np.empty((0, *DETECTOR_SHAPE), dtype = np.int16)
+    profiles, phi_vals = integration.centered_crown_integration(
+        images, np.empty((0, 2)), trimming_radius = TRIMMING_RADIUS, n_phi_bins = 36,
+        q_range = Q_RANGE, q_callibration = Q_CALLIBRATION, detector_mask = None)
+    assert profiles.shape == (0, 36)
+
+
+def test_centered_integration_of_invalid_centers():
+    images = random_stack(4, DETECTOR_SHAPE)
+    centers = beam_centers(4)
+    # Interpolated or user-supplied centers may not be finite or on the detector
+    centers[1] = np.nan
+    centers[2] = (np.inf, 1e300)
+
+    profiles, _ = integration.centered_crown_integration(
+        images, centers, trimming_radius = TRIMMING_RADIUS, n_phi_bins = 60, q_range = Q_RANGE,
+        q_callibration = Q_CALLIBRATION, detector_mask = None)
+
+    plan = integration.get_integration_plan((41, 41), 60, Q_RANGE, Q_CALLIBRATION)
+    valid = [0, 3]
+    expected = reference_profiles(crop(images[valid], centers[valid], TRIMMING_RADIUS), plan)
+    np.testing.assert_allclose(profiles[valid], expected, rtol = 1e-12)
+    np.testing.assert_array_equal(profiles[1:3], 0)
+
+
+def test_centered_integration_with_mask():
+    images = random_stack(6, DETECTOR_SHAPE, low = -5)
+    centers = beam_centers(6)
+    detector_mask = np.random.default_rng(2).random(DETECTOR_SHAPE) < 0.1
+
+    profiles, _ = integration.centered_crown_integration(
+        images, centers, trimming_radius = TRIMMING_RADIUS, n_phi_bins = 60, q_range = Q_RANGE,
+        q_callibration = Q_CALLIBRATION, detector_mask = detector_mask, n_threads = 2)
+
+    plan = integration.get_integration_plan((41, 41), 60, Q_RANGE, Q_CALLIBRATION)
+    masked_images = np.where(detector_mask, -1, images)
+    expected = reference_profiles(crop(masked_images, centers, TRIMMING_RADIUS), plan)
+    np.testing.assert_allclose(profiles, expected, rtol = 1e-12)
+
+
+def test_subpixel_integration():
+    images = random_stack(4, DETECTOR_SHAPE)
+    centers = beam_centers(4)
+    # Whole-pixel centers need only one of the four taps
+    centers[0] = (31.0, 33.0)
+
+    profiles, _ = integration.centered_crown_integration(
+        images, centers, trimming_radius = TRIMMING_RADIUS, n_phi_bins = 60, q_range = Q_RANGE,
+        q_callibration = Q_CALLIBRATION, detector_mask = None, subpixel = True)
+
+    plan = integration.get_integration_plan((41, 41), 60, Q_RANGE, Q_CALLIBRATION)
+    expected = reference_profiles(subpixel_crop(images, centers, TRIMMING_RADIUS), plan)
+    np.testing.assert_allclose(profiles, expected, rtol = 1e-10)
+
+
+def test_subpixel_integration_of_invalid_centers():
+    images = random_stack(3, DETECTOR_SHAPE)
+    centers = beam_centers(3)
+    centers[1] = (np.nan, -np.inf)
+
+    profiles, _ = integration.centered_crown_integration(
+        images, centers, trimming_radius = TRIMMING_RADIUS, n_phi_bins = 60, q_range = Q_RANGE,
+        q_callibration = Q_CALLIBRATION, detector_mask = None, subpixel = True)
+
+    plan = integration.get_integration_plan((41, 41), 60, Q_RANGE, Q_CALLIBRATION)
+    valid = [0, 2]
+    expected = reference_profiles(subpixel_crop(images[valid], centers[valid], TRIMMING_RADIUS), plan)
+    np.testing.assert_allclose(profiles[valid], expected, rtol = 1e-10)
+    np.testing.assert_array_equal(profiles[1], 0)
+
+
+def test_background_and_gain():
+    images = random_stack(4, (41, 41))
+    rng = np.random.default_rng(3)
+    background = rng.uniform(0, 20, (41, 41)).astype(np.float32)
+    gain = rng.uniform(0.5, 1.5, (41, 41)).astype(np.float32)
+    plan = integration.get_integration_plan((41, 41), 60, Q_RANGE, Q_CALLIBRATION)
+
+    profiles, _ = integration.crown_integration(images, plan = plan, background = background,
+                                                gain = gain)
+
+    expected = reference_profiles(images, plan, background = background, gain = gain)
+    np.testing.assert_allclose(profiles, expected, rtol = 1e-10)
+
+
+def test_frame_backgrounds():
+    images = random_stack(5, (41, 41))
+    frame_backgrounds = np.arange(5, dtype = np.float32) * 2.5
+    plan = integration.get_integration_plan((41, 41), 60, Q_RANGE, Q_CALLIBRATION)
+
+    profiles, _ = integration.crown_integration(images, plan = plan, background = frame_backgrounds)
+    constant, _ = integration.crown_integration(images, plan = plan, background = 4.0)
+
+    np.testing.assert_allclose(profiles, reference_profiles(images, plan, background = frame_backgrounds),
+                               rtol = 1e-10)
+    np.testing.assert_allclose(constant, reference_profiles(images, plan) - 4.0, rtol = 1e-10)
+
+
+def test_chunk_background():
+    frame_backgrounds = np.arange(10, dtype = np.float32)
+    image = np.ones((4, 4), dtype = np.float32)
+
+    np.testing.assert_array_equal(integration.chunk_background(frame_backgrounds, (4, 4), 3, 6),
+                                  [3, 4, 5])
+    np.testing.assert_array_equal(integration.chunk_background(image, (4, 4), 3, 6), image)
+    assert integration.chunk_background(2.0, (4, 4), 3, 6) == 2.0
+    assert integration.chunk_background(None, (4, 4), 3, 6) is None
+
+
+def test_hot_pixel_rejection():
+    images = random_stack(3, (41, 41), low = 90, high = 110)
+    plan = integration.get_integration_plan((41, 41), 60, Q_RANGE, Q_CALLIBRATION)
+    bin_indices = plan.bin_indices()
+    # A single outlier of a bin of n pixels is at most sqrt(n - 1) standard
+    # deviations above the mean, so it is put in the largest bin
+    slot = np.argmax(np.bincount(bin_indices[bin_indices >= 0], minlength = plan.profile_size))
+    images.reshape(3, -1)[:, np.flatnonzero(bin_indices == slot)[0]] = 30000
+
+    profiles, _ = integration.crown_integration(images, plan = plan, hot_pixel_sigma = 3.0)
+
+    expected = clipped_bin_means(images, bin_indices, plan.profile_size, 3.0)
+    np.testing.assert_allclose(profiles, expected, rtol = 1e-12)
+    assert np.all(profiles[:, slot] < 110)
+
+
+def test_hot_pixel_in_small_bin():
+    # A mean + 3 sigma cut can not reject a single outlier of a bin of
+    # fewer than about 10 pixels
+    plan = integration.get_integration_plan((32, 32), 90, (0.3, 0.6), Q_CALLIBRATION)
+    bin_indices = plan.bin_indices()
+    counts = np.bincount(bin_indices[bin_indices >= 0], minlength = plan.profile_size)
+    slot = np.flatnonzero(counts >= 3)[np.argmin(counts[counts >= 3])]
+    assert counts[slot] < 10
+
+    images = random_stack(1, (32, 32), low = 90, high = 110)
+    pixels = np.flatnonzero(bin_indices == slot)
+    expected = images.reshape(-1)[pixels[1:]].mean()
+    images.reshape(-1)[pixels[0]] = 30000
+
+    profiles, _ = integration.crown_integration(images, plan = plan, hot_pixel_sigma = 3.0)
+
+    assert profiles[0, slot] == pytest.approx(expected, rel = 1e-12)
@@ -0,0 +1,154 @@
+# /tests/test_io.py
+# Loading of detector image stacks, chunked stack processing and HDF5 writing.
+#
+#
+# Copyright (C) 2024 Tine Kalac
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+import h5py
+import numpy as np
+import pytest
+
+from biosed import io
+from reference import random_stack
+
+
+@pytest.mark.parametrize("n_threads", [0, 3])
+def test_load_files(frame_directory, n_threads):
+    images = random_stack(5, (16, 24))
+
+    image_stack = io.load_files(io.list_data_files(frame_directory(images)), n_threads = n_threads)
+
+    assert image_stack.dtype == np.int16
+    np.testing.assert_array_equal(image_stack, images)
+
+
+def test_load_files_of_other_shape(frame_directory):
+    data_directory = frame_directory([*random_stack(3, (16, 24)), np.zeros((16, 20))])
+
+    with pytest.raises(ValueError):
+        io.load_files(io.list_data_files(data_directory), n_threads = 2)
+
+
+def test_load_files_of_empty_list(tmp_path):
+    assert io.load_files([], frame_shape = (4, 6)).shape == (0, 4, 6)
+    with pytest.raises(ValueError):
+        io.load_files([])
+    with pytest.raises(ValueError):
+        io.load_data(tmp_path)
+
+
+def test_open_raw(tmp_path):
+    images = random_stack(4, (16, 24))
+    filename = tmp_path / "scan.raw"
+    with open(filename, "wb") as raw_file:
+        raw_file.write(bytes(64))
+        raw_file.write(images.tobytes())
+
+    image_stack = io.open_raw(filename, frame_shape = (16, 24), offset = 64)
+
+    # int16 memory maps go to the kernels without a copy
+    assert io.is_native_stack(image_stack)
+    np.testing.assert_array_equal(image_stack, images)
+
+
+def test_iterate_stack_chunks_of_hdf5(tmp_path):
+    images = random_stack(8, (16, 24))
+    filename = tmp_path / "scan.h5"
+    with h5py.File(filename, "w") as h5file:
+        h5file.create_dataset("frames", data = images.astype(np.uint16), chunks = (2, 16, 24))
+
+    image_stack = io.open_hdf5_stack(filename, "frames")
+
+    assert not io.is_native_stack(image_stack)
+    # Rounded up to whole HDF5 chunks
+    assert io.stack_chunk_size(image_stack, 5) == 6
+    starts, chunks = zip(*io.iterate_stack_chunks(image_stack, 3))
+    assert starts == (0, 3, 6)
+    assert all(io.is_native_stack(chunk) for chunk in chunks)
+    np.testing.assert_array_equal(np.concatenate(chunks), images)
+
+
+def test_map_stack_chunks_of_empty_stack():
+    def kernel(chunk, *frame_arrays):
+        return chunk.sum(axis = (1, 2)), chunk.reshape(len(chunk), -1)[:, :3]
+
+    # Not an int16 array, so the stack is processed chunk by chunk
+    stack = np.zeros((0, 8, 8))
+    sums, first_pixels = io.map_stack_chunks(kernel, stack, np.empty((0, 2)))
+    assert sums.shape == (0,)
+    assert first_pixels.shape == (0, 3)
+
+    stack = np.zeros((0, 8, 8))
+    sums, _ = io.map_stack_chunks(kernel, stack, frame_indices = np.empty(0, dtype = np.int64))
+    assert sums.shape == (0,)
+
+
+def test_append(tmp_path):
+    filename = tmp_path / "frames.h5"
+    rows = np.arange(30, dtype = np.float64).reshape(10, 3)
+
+    with io.HDF5Writer(filename) as writer:
+        writer.append("frames/profiles", rows[:4])
+        writer.append("frames/profiles", rows[4:])
+    # A new writer keeps appending to the same dataset
+    with io.HDF5Writer(filename) as writer:
+        writer.append("frames/profiles", rows[:2])
+
+    with h5py.File(filename, "r") as h5file:
+        dataset = h5file["frames/profiles"]
+        assert dataset.maxshape == (None, 3)
+        assert dataset.compression is None
+        np.testing.assert_array_equal(dataset[...], np.concatenate([rows, rows[:2]]))
+
+
+def test_append_replaces_fixed_datasets(tmp_path):
+    filename = tmp_path / "frames.h5"
+    with io.HDF5Writer(filename) as writer:
+        writer.write("beam_centers", np.zeros((5, 2)))
+        writer.append("beam_centers", np.ones((3, 2)))
+        np.testing.assert_array_equal(writer.h5file["beam_centers"][...], np.ones((3, 2)))
+
+
+def test_append_of_other_shape(tmp_path):
+    with io.HDF5Writer(tmp_path / "frames.h5") as writer:
+        writer.append("profiles", np.zeros((2, 3)))
+        with pytest.raises(ValueError):
+            writer.append("profiles", np.zeros((2, 4)))
+
+
+def test_write_chunks_whole_rows(tmp_path):
+    filename = tmp_path / "results.h5"
+    orientation_map = np.random.default_rng(0).random((20, 30))
+
+    with io.HDF5Writer(filename, compression = "gzip", chunk_bytes = 1000) as writer:
+        writer.write("orientation_map", orientation_map)
+        writer.write("scan_limits", np.array([3, 9]))
+        writer.write("empty", np.empty((0, 60)))
+
+    with h5py.File(filename, "r") as h5file:
+        dataset = h5file["orientation_map"]
+        assert dataset.compression == "gzip"
+        assert dataset.chunks[1:] == (30,)
+        np.testing.assert_array_equal(dataset[...], orientation_map)
+        assert h5file["empty"].shape == (0, 60)
+
+
+def test_save_results_skips_none(tmp_path):
+    filename = tmp_path / "results.h5"
+    io.save_results(filename, beam_centers = np.zeros((4, 2)), azi_intensity = None)
+
+    with h5py.File(filename, "r") as h5file:
+        assert list(h5file.keys()) == ["beam_centers"]
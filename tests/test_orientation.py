@@ -0,0 +1,162 @@
+# /tests/test_orientation.py
+# Poisson ODF fits and circular harmonics against lmfit and NumPy.
+#
+#
+# Copyright (C) 2024 Tine Kalac
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+import numpy as np
+import pytest
+
+from biosed import integration, orientation
+from biosed._cpp.harmonics import compute_harmonics
+from reference import random_stack, crop, principal_components
+
+PHI = (np.arange(72) + 0.5) * 5
+Q_CALLIBRATION = 2.55 / 70
+Q_RANGE = (0.2, 0.6)
+# (phi_0, eta, C) of the test profiles
+PARAMETERS = np.array([(0.6, 0.4, 5.0), (1.9, 0.7, 2.0), (2.8, 0.2, 10.0)])
+
+
+def noisy_profiles(seed = 0):
+    profiles = np.array([orientation.poisson_odf(np.deg2rad(PHI), *p) for p in PARAMETERS])
+    return np.random.default_rng(seed).poisson(20 * profiles) / 20
+
+
+def test_fit_of_exact_profiles():
+    profiles = np.array([orientation.poisson_odf(np.deg2rad(PHI), *p) for p in PARAMETERS])
+
+    fits = orientation.fit_poisson_odf(profiles, PHI, backend = "native", n_threads = 2)
+
+    np.testing.assert_allclose(fits, PARAMETERS, rtol = 1e-6)
+
+
+def test_native_fit_matches_lmfit():
+    profiles = noisy_profiles()
+
+    native = orientation.fit_poisson_odf(profiles, PHI, backend = "native", n_threads = 2)
+    lmfit = orientation.fit_poisson_odf(profiles, PHI, backend = "lmfit")
+
+    # Both minimize the same weighted residuals, to their own tolerances
+    np.testing.assert_allclose(native, lmfit, rtol = 1e-4)
+
+
+def test_unknown_backend():
+    with pytest.raises(ValueError):
+        orientation.fit_poisson_odf(noisy_profiles(), PHI, backend = "scipy")
+
+
+@pytest.mark.parametrize("initial_guess", ["harmonic", "neighbor"])
+def test_initial_guess(initial_guess):
+    profiles = noisy_profiles()
+
+    fits = orientation.fit_poisson_odf(profiles, PHI, backend = "native",
+                                       initial_guess = initial_guess)
+
+    # Only the starting point differs, not the minimum
+    expected = orientation.fit_poisson_odf(profiles, PHI, backend = "native",
+                                           initial_guess = "fixed")
+    np.testing.assert_allclose(fits, expected, rtol = 1e-5)
+
+
+def test_unknown_initial_guess():
+    with pytest.raises(ValueError):
+        orientation.fit_poisson_odf(noisy_profiles(), PHI, initial_guess = "random")
+
+
+def test_compute_harmonics():
+    profiles = random_stack(1, (5, 36))[0].astype(np.float64)
+    # Orders of a period or more wrap around like the FFT bins
+    orders = [0, 1, 2, 7, 40]
+
+    harmonics = compute_harmonics(profiles, orders, n_threads = 2)
+
+    expected = np.fft.fft(profiles)[:, [order % 36 for order in orders]]
+    np.testing.assert_allclose(harmonics, expected, rtol = 1e-10, atol = 1e-9)
+
+
+def test_negative_harmonic_order():
+    with pytest.raises(RuntimeError):
+        compute_harmonics(np.ones((2, 36)), [-2])
+
+
+def test_harmonics_of_empty_profiles():
+    with pytest.raises(RuntimeError):
+        compute_harmonics(np.empty((3, 0)), [0, 2])
+
+
+def test_harmonic_analysis():
+    profiles = random_stack(1, (5, 72))[0].astype(np.float64)
+
+    orientations, alignment = orientation.harmonic_analysis(profiles, PHI, n_threads = 2,
+                                                            return_alignment = True)
+
+    coefficients = np.fft.fft(profiles)
+    np.testing.assert_allclose(orientations, (-0.5 * np.angle(coefficients[:, 2])) % np.pi,
+                               rtol = 1e-10, atol = 1e-12)
+    np.testing.assert_allclose(alignment, 2 * np.abs(coefficients[:, 2]) / coefficients[:, 0].real,
+                               rtol = 1e-10)
+
+
+def streak_images(angles, shape = (41, 41)):
+    """
+    Streaks through the center at the given angles from QX towards QY, on
+    a flat background.
+    """
+    QY, QX = np.indices(shape)
+    QY, QX = QY - shape[0] // 2, QX - shape[1] // 2
+    images = random_stack(len(angles), shape, high = 20)
+    for image, angle in zip(images, angles):
+        distance = QY * np.cos(angle) - QX * np.sin(angle)
+        image += (1000 * np.exp(-(distance / 3)**2)).astype(np.int16)
+    return images
+
+
+def test_principal_components():
+    angles = [0.4, 1.2, 2.5]
+    images = streak_images(angles)
+    # Masked pixels are left out
+    images[0, :20, :20] = -1
+    plan = integration.get_integration_plan((41, 41), 36, Q_RANGE, Q_CALLIBRATION)
+
+    components = plan.principal_components(images, n_threads = 2)
+
+    np.testing.assert_allclose(components, principal_components(images, plan.bin_indices()),
+                               rtol = 1e-9)
+    np.testing.assert_allclose(components[1:, 0], angles[1:], atol = 0.05)
+    assert np.all(components[:, 2] > 1)
+
+
+def test_principal_components_of_empty_images():
+    plan = integration.get_integration_plan((41, 41), 36, Q_RANGE, Q_CALLIBRATION)
+    components = plan.principal_components(np.zeros((2, 41, 41), dtype = np.int16))
+    assert np.all(np.isnan(components))
+
+
+def test_find_principal_components():
+    rng = np.random.default_rng(1)
+    images = np.zeros((4, 64, 64), dtype = np.int16)
+    images[:, 11:52, 11:52] = streak_images([0.3, 0.9, 1.7, 2.9])
+    beam_centers = 31.0 + rng.uniform(-2, 2, size = (4, 2))
+    plan = integration.get_integration_plan((41, 41), 36, Q_RANGE, Q_CALLIBRATION)
+
+    found = orientation.find_principal_components(images, beam_centers = beam_centers,
+                                                  trimming_radius = 20, plan = plan, n_threads = 2,
+                                                  detector_mask = None)
+
+    # The q range is placed around the beam center of every image
+    expected = principal_components(crop(images, beam_centers, 20), plan.bin_indices())
+    np.testing.assert_allclose(np.stack(found, axis = 1), expected, rtol = 1e-9)
@@ -0,0 +1,187 @@
+# /tests/test_preprocess.py
+# Beam centers against the NumPy reference, and the scan geometry.
+#
+#
+# Copyright (C) 2024 Tine Kalac
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+import numpy as np
+import pytest
+
+from biosed import preprocess
+from biosed._cpp.center_of_mass import compute_centers_of_mass, simd_backend
+from reference import random_stack, beam_stack, centers_of_mass
+
+THRESHOLD = 100
+
+
+# Row widths around the 16 pixels of an AVX2 register, up to the widest row
+# whose column indices fit the int16 lanes
+@pytest.mark.parametrize("width", [1, 15, 16, 17, 100, 32767])
+def test_centers_of_mass(width):
+    images = random_stack(3, (4, width), low = -50, high = 32767)
+    images[2] = 0
+
+    centers = compute_centers_of_mass(images, THRESHOLD, n_threads = 2)
+
+    np.testing.assert_array_equal(centers, centers_of_mass(images, THRESHOLD))
+    np.testing.assert_array_equal(centers[2], [-1, -1])
+
+
+def test_centers_of_mass_of_wide_rows():
+    # Column indices beyond int16 need the scalar kernel
+    assert simd_backend(512) in ("avx2", "scalar")
+    assert simd_backend(32768) == "scalar"
+    images = random_stack(2, (2, 32768), low = -50, high = 32767)
+
+    centers = compute_centers_of_mass(images, THRESHOLD)
+
+    np.testing.assert_array_equal(centers, centers_of_mass(images, THRESHOLD))
+
+
+def test_float32_centers_of_mass():
+    images = random_stack(3, (40, 100), low = -50, high = 32767)
+
+    centers = compute_centers_of_mass(images, THRESHOLD, dtype = "float32")
+
+    assert centers.dtype == np.float32
+    np.testing.assert_array_equal(centers, centers_of_mass(images, THRESHOLD).astype(np.float32))
+
+
+def test_centers_of_mass_with_mask():
+    images = random_stack(4, (40, 100), low = -50, high = 32767)
+    detector_mask = np.random.default_rng(1).random((40, 100)) < 0.2
+    detector_mask[:, 30:70] = True
+
+    centers = compute_centers_of_mass(images, THRESHOLD, mask = detector_mask)
+
+    np.testing.assert_array_equal(centers, centers_of_mass(images, THRESHOLD, detector_mask))
+
+
+def test_find_beam_centers_checks_the_mask():
+    with pytest.raises(ValueError):
+        preprocess.find_beam_centers(random_stack(2, (64, 64)), detector_mask = np.zeros((32, 32)))
+
+
+def test_find_beam_centers_of_any_detector_shape():
+    # The configured 512 x 512 mask is only applied by the pipeline
+    images = random_stack(2, (64, 64), low = -50, high = 32767)
+
+    centers = preprocess.find_beam_centers(images, n_threads = 1)
+
+    np.testing.assert_array_equal(centers, centers_of_mass(images, THRESHOLD))
+
+
+@pytest.mark.parametrize("n_threads", [1, 3])
+def test_beam_tracking(n_threads):
+    # The beam moves a pixel per frame along the rows and jumps back at the
+    # end of every row, more than a window away. 600 frames are 3 tracking
+    # blocks.
+    frames = np.arange(600)
+    images = beam_stack(np.stack([16 + (frames // 40) % 30, 10 + frames % 40], axis = 1), (64, 64))
+
+    tracked = compute_centers_of_mass(images, THRESHOLD, n_threads = n_threads, window_radius = 8)
+
+    np.testing.assert_array_equal(tracked, compute_centers_of_mass(images, THRESHOLD))
+
+
+def test_beam_tracking_of_frames_without_beam():
+    # Frames in the middle of a tracking block have no pixel above the
+    # threshold, the tracking restarts with a full scan after them
+    frames = np.arange(300)
+    images = beam_stack(np.stack([30 + (frames // 50) % 3, 10 + frames % 50], axis = 1), (64, 64))
+    images[[100, 101, 150]] = 0
+
+    tracked = compute_centers_of_mass(images, THRESHOLD, window_radius = 8)
+
+    np.testing.assert_array_equal(tracked, compute_centers_of_mass(images, THRESHOLD))
+    np.testing.assert_array_equal(tracked[[100, 101, 150]], -1)
+
+
+def test_beam_tracking_with_mask():
+    frames = np.arange(300)
+    images = beam_stack(np.stack([30 + (frames // 50) % 3, 10 + frames % 50], axis = 1), (64, 64))
+    detector_mask = np.zeros((64, 64), dtype = bool)
+    detector_mask[:, 31] = True
+
+    tracked = compute_centers_of_mass(images, THRESHOLD, window_radius = 8, mask = detector_mask)
+
+    np.testing.assert_array_equal(tracked, compute_centers_of_mass(images, THRESHOLD,
+                                                                   mask = detector_mask))
+
+
+def test_beam_tracking_ignores_pixels_outside_of_the_window():
+    images = beam_stack(np.full((20, 2), 30), (64, 64))
+    images[5:, 2, 2] = 1000
+
+    tracked = compute_centers_of_mass(images, THRESHOLD, window_radius = 6)
+
+    np.testing.assert_array_equal(tracked, 30.0)
+    assert np.all(compute_centers_of_mass(images, THRESHOLD)[5:] < 30)
+
+
+def test_negative_window_radius():
+    with pytest.raises(RuntimeError):
+        compute_centers_of_mass(random_stack(2, (8, 8)), THRESHOLD, window_radius = -1)
+
+
+def raster_centers(row_lengths):
+    """
+    Beam centers of a raster scan with rows of the given lengths. The beam
+    moves a pixel per frame towards lower QX and flies back at the end of
+    every row.
+    """
+    return np.array([(20.0 + row, 30.0 - frame) for row, length in enumerate(row_lengths)
+                     for frame in range(length)])
+
+
+def test_scan_geometry():
+    beam_centers = raster_centers([8] * 5)
+
+    # The flyback gradient spreads over the last and first frame of two
+    # rows, so the first and last rows are a frame longer and irregular
+    assert preprocess.find_scan_limits(beam_centers) == (9, 31)
+    valid_frames, scan_shape, frame_indices = preprocess.get_scan_shape(beam_centers,
+                                                                        return_indices = True)
+
+    assert scan_shape == (3, 6)
+    np.testing.assert_array_equal(frame_indices, [np.arange(9, 15), np.arange(17, 23),
+                                                  np.arange(25, 31)])
+    np.testing.assert_array_equal(np.flatnonzero(valid_frames), frame_indices.ravel())
+
+
+def test_scan_geometry_of_given_limits():
+    beam_centers = raster_centers([8] * 5)
+
+    valid_frames, scan_shape = preprocess.get_scan_shape(beam_centers, (0, 40))
+
+    # All rows are truncated to the shortest one
+    assert scan_shape == (5, 6)
+    assert valid_frames.sum() == 30
+
+
+def test_scan_geometry_with_row_length_tolerance():
+    beam_centers = raster_centers([8] * 5)
+
+    # The first and last rows are within 20 % of the others
+    _, scan_shape = preprocess.get_scan_shape(beam_centers, row_length_tolerance = 0.2)
+
+    assert scan_shape == (5, 6)
+
+
+def test_scan_without_regular_rows():
+    # Rows of 6 and 12 frames, neither is close to the median length
+    with pytest.raises(ValueError):
+        preprocess.find_scan_limits(raster_centers([7, 13]))
@@ -0,0 +1,84 @@
+# /tests/test_preview.py
+# Binned previews of a scan against the NumPy reference.
+#
+#
+# Copyright (C) 2024 Tine Kalac
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+import numpy as np
+import pytest
+
+from biosed import preprocess
+from reference import random_stack, binned_images
+
+
+@pytest.mark.parametrize("binning, frame_step", [(1, 1), (2, 1), (4, 3), (3, 2)])
+def test_bin_images(binning, frame_step):
+    # Rows and columns after the last whole block are dropped
+    images = random_stack(7, (30, 34), low = -3)
+    images[1, :8, :8] = -1
+
+    binned = preprocess.bin_images(images, binning, frame_step, n_threads = 2,
+                                   detector_mask = None)
+
+    np.testing.assert_array_equal(binned, binned_images(images, binning, frame_step))
+
+
+def test_bin_images_with_mask():
+    images = random_stack(3, (32, 32))
+    detector_mask = np.zeros((32, 32), dtype = bool)
+    detector_mask[:4, :4] = True
+    detector_mask[10, 5:20] = True
+
+    binned = preprocess.bin_images(images, 4, detector_mask = detector_mask)
+
+    np.testing.assert_array_equal(binned, binned_images(images, 4, detector_mask = detector_mask))
+    assert np.all(binned[:, 0, 0] == -1)
+
+
+def test_bin_images_of_memory_map(tmp_path):
+    images = random_stack(9, (16, 16))
+    memory_map = np.memmap(tmp_path / "scan.raw", dtype = np.int16, mode = "w+", shape = images.shape)
+    memory_map[:] = images
+    memory_map.flush()
+
+    binned = preprocess.bin_images(np.memmap(tmp_path / "scan.raw", dtype = np.int16, mode = "r",
+                                             shape = images.shape),
+                                   2, 2, detector_mask = None)
+
+    np.testing.assert_array_equal(binned, binned_images(images, 2, 2))
+
+
+def test_unbin_beam_centers():
+    beam_centers = np.array([[3.0, 4.0], [-1.0, -1.0], [5.5, 2.25]])
+
+    full_centers = preprocess.unbin_beam_centers(beam_centers, binning = 4, frame_step = 1)
+
+    # The center of a block of 4 pixels is 1.5 pixels from its first pixel
+    np.testing.assert_array_equal(full_centers, [[13.5, 17.5], [-1.0, -1.0], [23.5, 10.5]])
+
+
+def test_unbin_beam_centers_with_frame_step():
+    beam_centers = np.array([[3.0, 4.0], [-1.0, -1.0], [5.0, 8.0]])
+
+    full_centers = preprocess.unbin_beam_centers(beam_centers, binning = 2, frame_step = 3,
+                                                 n_images = 8)
+
+    # Frames without a beam are interpolated from the frames that have one
+    kept_frames, kept_centers = np.array([0, 6]), np.array([[6.5, 8.5], [10.5, 16.5]])
+    expected = np.stack([np.interp(np.arange(8), kept_frames, kept_centers[:, axis])
+                         for axis in range(2)], axis = 1)
+    np.testing.assert_allclose(full_centers, expected)
+    assert preprocess.unbin_beam_centers(beam_centers, 2, 3).shape == (7, 2)